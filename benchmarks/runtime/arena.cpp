@@ -0,0 +1,216 @@
+// Measures the effect of where node blocks come from on the collector's mark
+// phase: TLB misses, page faults, and time.
+//
+// The heap is built three ways.  "new[]" allocates each block with new[] and
+// value-initializes it, as NodePool did before Cy_Arena (arena.hpp).  "arena"
+// takes blocks from Cy_Arena with 4 KiB pages, and "arena+thp" asks for
+// transparent huge pages.  Blocks double in size, as NodePool grows them.
+// Each node points at the next in a random order and at a random node, so
+// marking touches memory all over the heap.
+//
+// TLB misses are read from the dTLB load-miss counter through
+// perf_event_open.  Where hardware counters are unavailable, as in most
+// virtual machines, they are reported as n/a.  Each heap is built in a child
+// process so that its memory is returned before the next.
+#include "arena.hpp"
+#include "marker.hpp"
+#include <boost/timer/timer.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <numeric>
+#include <random>
+#include <string>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <vector>
+
+using namespace sprite::compiler;
+
+extern "C"
+{
+  vtable CyVt_Fwd __asm__(".vt.fwd");
+}
+
+namespace
+{
+  size_t const NNODES = size_t(1) << 23;
+  size_t const FIRST_BLOCK = 8192 / sizeof(node);
+  size_t const REPEAT = 3;
+
+  vtable vt_pair;
+
+  void succ2(node * p, node *** begin, node *** end)
+  {
+    *begin = reinterpret_cast<node **>(&p->slot0);
+    *end = *begin + 2;
+  }
+
+  // A counter of events in this process, or -1 if it cannot be opened.
+  struct Counter
+  {
+    Counter(uint32_t type, uint64_t config)
+    {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    Counter(Counter && arg) : fd(arg.fd) { arg.fd = -1; }
+    ~Counter() { if(fd >= 0) close(fd); }
+
+    long long read() const
+    {
+      long long value;
+      if(fd < 0 || ::read(fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+      return value;
+    }
+
+    int fd;
+  };
+
+  Counter dtlb_misses()
+  {
+    return Counter(
+        PERF_TYPE_HW_CACHE
+      , PERF_COUNT_HW_CACHE_DTLB
+          | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+      );
+  }
+
+  Counter page_faults()
+    { return Counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS); }
+
+  std::string show(long long n)
+    { return n < 0 ? "n/a" : std::to_string(n); }
+
+  // The memory of this process backed by transparent huge pages, in KiB.
+  long anon_huge_kb()
+  {
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string key;
+    long kb;
+    while(smaps >> key)
+    {
+      if(key == "AnonHugePages:" && smaps >> kb)
+        return kb;
+    }
+    return -1;
+  }
+
+  void run(char const * name, char * (*allocate)(size_t bytes))
+  {
+    // Allocate the blocks, doubling as NodePool does.
+    Counter const faults = page_faults();
+    boost::timer::cpu_timer build;
+    std::vector<node *> nodes;
+    nodes.reserve(NNODES);
+    Cy_MarkBits marks;
+    for(size_t n = FIRST_BLOCK; nodes.size() < NNODES; n *= 2)
+    {
+      n = std::min(n, NNODES - nodes.size());
+      char * const begin = allocate(n * sizeof(node));
+      if(!begin)
+      {
+        std::cerr << name << ": out of memory" << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      marks.add_block(begin, begin + n * sizeof(node));
+      for(size_t i=0; i<n; ++i)
+        nodes.push_back(reinterpret_cast<node *>(begin) + i);
+    }
+
+    // Link the nodes.
+    std::mt19937 rng(1);
+    std::vector<size_t> order(NNODES);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+    for(size_t i=0; i<NNODES; ++i)
+    {
+      node & n = *nodes[order[i]];
+      n.vptr = &vt_pair;
+      n.tag = CTOR;
+      n.slot0 = nodes[order[(i + 1) % NNODES]];
+      n.slot1 = nodes[rng() % NNODES];
+    }
+    build.stop();
+    long long const nfaults = faults.read();
+
+    std::vector<node*> roots{nodes[order[0]]};
+    double best = 1e300;
+    long long misses = -1;
+    size_t live = 0;
+    for(size_t r=0; r<REPEAT; ++r)
+    {
+      marks.clear();
+      Counter const tlb = dtlb_misses();
+      boost::timer::cpu_timer timer;
+      live = Cy_Marker::get().mark(marks, roots, 0, nullptr, 1);
+      timer.stop();
+      double const ms = timer.elapsed().wall * 1e-6;
+      if(ms < best)
+      {
+        best = ms;
+        misses = tlb.read();
+      }
+    }
+    if(live != NNODES)
+    {
+      std::cerr << name << ": marked " << live << " nodes, expected "
+        << NNODES << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::cout << name << ": build " << build.elapsed().wall * 1e-6
+      << " ms with " << show(nfaults) << " page faults; mark " << best
+      << " ms with " << show(misses) << " dTLB misses; "
+      << show(anon_huge_kb()) << " KiB in huge pages" << std::endl;
+  }
+
+  char * new_block(size_t bytes)
+    { return new (std::nothrow) char[bytes](); }
+
+  char * arena_block(size_t bytes)
+  {
+    static Cy_Arena arena(size_t(1) << 30, false);
+    return arena.allocate(bytes);
+  }
+
+  char * huge_arena_block(size_t bytes)
+  {
+    static Cy_Arena arena(size_t(1) << 30, true);
+    return arena.allocate(bytes);
+  }
+
+  void in_child(char const * name, char * (*allocate)(size_t bytes))
+  {
+    std::cout.flush();
+    pid_t const pid = fork();
+    if(pid == 0)
+    {
+      run(name, allocate);
+      std::exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      std::exit(EXIT_FAILURE);
+  }
+}
+
+int main()
+{
+  vt_pair.gcsucc = succ2;
+  in_child("new[]    ", new_block);
+  in_child("arena    ", arena_block);
+  in_child("arena+thp", huge_arena_block);
+}
@@ -0,0 +1,118 @@
+// Measures the cost of a context switch in the middle of a deep normalization.
+//
+// Each computation recurses through a chain of DEPTH nodes and then reaches a
+// safepoint where it is preempted, SWITCHES times in all.  Two mechanisms are
+// compared:
+//
+//   unwind: the switch throws an exception to the scheduler, which later
+//           restarts the computation from its root (the former Cy_Eval).
+//   fiber:  the switch suspends the computation's fiber, which later resumes
+//           where it stopped (Cy_Eval today).
+//
+// Since the restart re-walks the spine, the unwinding cost grows with depth.
+#include "context_switch.hpp"
+#include <boost/timer/timer.hpp>
+#include <iostream>
+#include <vector>
+
+extern "C" { int64_t CyTrace_IndentLvl = 0; }
+namespace sprite { namespace compiler { Cy_RootStack CyMem_Roots; }}
+
+using namespace sprite::compiler;
+
+namespace
+{
+  size_t const SWITCHES = 200000;
+  // The number of computations alternating in the work queue.
+  size_t const NCOMPUTATIONS = 4;
+
+  struct Unwind {};
+
+  size_t remaining;
+  bool use_fibers;
+  vtable vt;
+
+  // Normalizes a chain of nodes.  The last one is a safepoint that switches
+  // until the budget is exhausted.
+  void N(node * root)
+  {
+    node * const next = reinterpret_cast<node *>(root->slot0);
+    if(next)
+      next->vptr->N(next);
+    else
+    {
+      while(remaining)
+      {
+        --remaining;
+        if(use_fibers)
+          Fiber::current()->yield();
+        else
+          throw Unwind();
+      }
+    }
+    // Keep the recursion from being turned into a loop.
+    root->aux++;
+  }
+
+  std::vector<node> make_chain(size_t depth)
+  {
+    std::vector<node> chain(depth);
+    for(size_t i=0; i<depth; ++i)
+    {
+      chain[i].vptr = &vt;
+      chain[i].slot0 = i+1 < depth ? &chain[i+1] : nullptr;
+    }
+    return chain;
+  }
+
+  void run(size_t depth, bool fibers)
+  {
+    std::vector<std::vector<node>> chains;
+    for(size_t i=0; i<NCOMPUTATIONS; ++i)
+      chains.push_back(make_chain(depth));
+    std::vector<Fiber *> running(NCOMPUTATIONS, nullptr);
+    remaining = SWITCHES;
+    use_fibers = fibers;
+
+    boost::timer::cpu_timer timer;
+    for(size_t i=0; remaining; i = (i+1) % NCOMPUTATIONS)
+    {
+      node * const root = &chains[i][0];
+      if(fibers)
+      {
+        if(!running[i])
+          running[i] = Fiber::acquire(root);
+        if(running[i]->resume())
+        {
+          Fiber::release(running[i]);
+          running[i] = nullptr;
+        }
+      }
+      else
+      {
+        try
+          { root->vptr->N(root); }
+        catch(Unwind const &)
+          {}
+      }
+    }
+    timer.stop();
+    for(Fiber * fiber: running)
+      if(fiber) Fiber::release(fiber);
+
+    double const ns = 1.0 * timer.elapsed().wall / SWITCHES;
+    std::cout
+        << (fibers ? "fiber " : "unwind") << "  depth " << depth << ": "
+        << ns << " ns/switch" << std::endl;
+  }
+}
+
+int main()
+{
+  vt.N = &N;
+  for(size_t depth: {1, 10, 100, 1000})
+  {
+    run(depth, false);
+    run(depth, true);
+  }
+}
@@ -0,0 +1,164 @@
+// Compares the fingerprint representations by replaying traces of fingerprint
+// operations: TreeFingerprint and HamtFingerprint with 16- and 32-way
+// branches.
+//
+// To record a trace, build the runtime with -DRECORDFP (see
+// runtime/sprite-rt/C/fingerprint.hpp) and run a benchmark program:
+//
+//     SPRITE_FP_TRACE=Queens.fptrace ./Queens.sprite
+//     make fingerprint.run ARGS=Queens.fptrace
+//
+// Without arguments, a synthetic trace is replayed.  It forks fingerprints the
+// way the Fair Scheme does, with choice IDs spread over a wide range, since
+// most choices issued by a program never reach the top of a computation.
+#include "fingerprint.hpp"
+#include <boost/timer/timer.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+extern "C" { sprite::compiler::aux_t Cy_NextChoiceId = 0; }
+namespace sprite { namespace compiler
+{
+  namespace fingerprints { boost::pool<> branch_pool(sizeof(Branch)); }
+}}
+
+using namespace sprite::compiler;
+
+namespace
+{
+  // One recorded operation.  See RecordedFingerprint.
+  struct Op
+  {
+    char kind;
+    uint32_t fp;
+    uint32_t arg;
+  };
+
+  struct Trace
+  {
+    std::vector<Op> ops;
+    // The number of fingerprints created.
+    uint32_t nfingerprints = 0;
+  };
+
+  Trace load(char const * filename)
+  {
+    FILE * file = fopen(filename, "r");
+    if(!file)
+    {
+      perror(filename);
+      exit(EXIT_FAILURE);
+    }
+    Trace trace;
+    char kind;
+    unsigned long fp, arg;
+    while(fscanf(file, " %c %lu", &kind, &fp) == 2)
+    {
+      arg = 0;
+      if(kind != 'n' && kind != 'd' && fscanf(file, "%lu", &arg) != 1)
+        break;
+      trace.ops.push_back(Op{kind, uint32_t(fp), uint32_t(arg)});
+      if(kind == 'n' || kind == 'c')
+        trace.nfingerprints = std::max<uint32_t>(trace.nfingerprints, fp + 1);
+    }
+    fclose(file);
+    return trace;
+  }
+
+  // Forks fingerprints breadth-first, as the Fair Scheme does.  Each step
+  // tests the choices made on its path and then either forks on a new choice
+  // or retires the fingerprint.
+  Trace synthesize()
+  {
+    size_t const NFORKS = 200000;
+    size_t const WIDTH = 4096;
+    // Choice IDs advance by up to this much between forks.
+    uint32_t const SPREAD = 64;
+    // Tests per step.
+    size_t const NTESTS = 8;
+
+    Trace trace;
+    std::mt19937 rng(42);
+    struct Frame { uint32_t fp; std::vector<uint32_t> path; };
+    std::vector<Frame> queue;
+    size_t head = 0;
+    uint32_t next_id = 0;
+    queue.push_back(Frame{trace.nfingerprints++, {}});
+    trace.ops.push_back(Op{'n', 0, 0});
+    for(size_t forks=0; head < queue.size(); )
+    {
+      Frame frame = std::move(queue[head++]);
+      for(size_t i=0; i<NTESTS && !frame.path.empty(); ++i)
+      {
+        uint32_t const id = frame.path[rng() % frame.path.size()];
+        trace.ops.push_back(Op{'t', frame.fp, id});
+      }
+      if(forks < NFORKS && queue.size() - head < WIDTH)
+      {
+        ++forks;
+        next_id += 1 + rng() % SPREAD;
+        trace.ops.push_back(Op{'t', frame.fp, next_id});
+        uint32_t const copy = trace.nfingerprints++;
+        trace.ops.push_back(Op{'c', copy, frame.fp});
+        trace.ops.push_back(Op{'l', copy, next_id});
+        trace.ops.push_back(Op{'r', frame.fp, next_id});
+        frame.path.push_back(next_id);
+        queue.push_back(Frame{copy, frame.path});
+        queue.push_back(std::move(frame));
+      }
+      else
+        trace.ops.push_back(Op{'d', frame.fp, 0});
+    }
+    return trace;
+  }
+
+  template<typename Fp> void replay(char const * name, Trace const & trace)
+  {
+    std::vector<Fp *> fps(trace.nfingerprints, nullptr);
+    size_t checksum = 0;
+    boost::timer::cpu_timer timer;
+    for(Op const & op: trace.ops)
+    {
+      switch(op.kind)
+      {
+        case 'n': fps[op.fp] = new Fp(); break;
+        case 'c': fps[op.fp] = new Fp(*fps[op.arg]); break;
+        case 'a': *fps[op.fp] = *fps[op.arg]; break;
+        case 'd': delete fps[op.fp]; fps[op.fp] = nullptr; break;
+        case 't':
+          checksum = checksum * 3 + static_cast<size_t>(fps[op.fp]->test(op.arg));
+          break;
+        case 'l': fps[op.fp]->set_left(op.arg); break;
+        case 'r': fps[op.fp]->set_right(op.arg); break;
+      }
+    }
+    timer.stop();
+    for(Fp * fp: fps)
+      delete fp;
+
+    double const ns = 1.0 * timer.elapsed().wall / trace.ops.size();
+    std::cout
+        << name << ": " << ns << " ns/op (checksum " << std::hex << checksum
+        << std::dec << ")" << std::endl;
+  }
+
+  void compare(char const * name, Trace const & trace)
+  {
+    std::cout << name << ": " << trace.ops.size() << " operations on "
+        << trace.nfingerprints << " fingerprints" << std::endl;
+    replay<TreeFingerprint>("  tree     ", trace);
+    replay<BasicHamtFingerprint<4>>("  hamt/16  ", trace);
+    replay<BasicHamtFingerprint<5>>("  hamt/32  ", trace);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  if(argc < 2)
+    compare("synthetic", synthesize());
+  for(int i=1; i<argc; ++i)
+    compare(argv[i], load(argv[i]));
+}
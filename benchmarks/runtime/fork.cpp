@@ -0,0 +1,117 @@
+// Measures the cost of forking a computation's state at a choice, as the Fair
+// Scheme does in Cy_Eval: the fingerprint and constraint store handles are
+// copied, and each side then writes its fingerprint.  Some forks also bind a
+// variable, which writes the constraint store and one of its inner buckets.
+//
+// Compares Shared (shared.hpp), which keeps an intrusive, non-atomic reference
+// count in a pooled allocation, with the std::shared_ptr handle it replaced.
+#include "fingerprint.hpp"
+#include "shared.hpp"
+#include <boost/timer/timer.hpp>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+extern "C" { sprite::compiler::aux_t Cy_NextChoiceId = 0; }
+namespace sprite { namespace compiler
+{
+  namespace fingerprints { boost::pool<> branch_pool(sizeof(Branch)); }
+}}
+
+using namespace sprite::compiler;
+
+namespace
+{
+  // The previous copy-on-write handle, built on std::shared_ptr.
+  template<typename T> struct StdShared
+  {
+    template<typename...Args>
+    StdShared(Args&&...args)
+      : data(std::make_shared<T>(std::forward<Args>(args)...))
+    {}
+    StdShared(StdShared const & arg) : data(arg.data) {}
+    StdShared(StdShared & arg) : data(arg.data) {}
+    StdShared(StdShared && arg) : data(std::move(arg.data)) {}
+    StdShared & operator=(StdShared const & arg)
+      { data = arg.data; return *this; }
+    StdShared & operator=(StdShared && arg)
+      { data = std::move(arg.data); return *this; }
+
+    T const & read() const { return *data; }
+    T & write()
+    {
+      if(!data.unique())
+        data = std::make_shared<T>(*data);
+      return *data;
+    }
+
+  private:
+
+    std::shared_ptr<T> data;
+  };
+
+  // Mirrors the layout of ConstraintStore::eq_var.
+  template<template<typename> class Handle> struct Store
+  {
+    using bucket_t = std::vector<std::pair<void *, void *>>;
+    Handle<std::unordered_map<aux_t, Handle<bucket_t>>> eq_var;
+  };
+
+  template<template<typename> class Handle> struct Frame
+  {
+    Handle<Fingerprint> fingerprint;
+    Handle<Store<Handle>> constraints;
+  };
+
+  template<template<typename> class Handle> void run(char const * name)
+  {
+    size_t const NFORKS = 2000000;
+    size_t const WIDTH = 4096;
+    // One fork in this many binds a variable.
+    size_t const BIND_RATE = 8;
+
+    std::mt19937 rng(42);
+    std::vector<Frame<Handle>> queue(1);
+    size_t checksum = 0;
+    boost::timer::cpu_timer timer;
+    for(size_t forks=0; forks<NFORKS; ++forks)
+    {
+      aux_t const id = aux_t(forks);
+      size_t const i = rng() % queue.size();
+      Frame<Handle> & frame = queue[i];
+
+      // The fork itself.
+      Frame<Handle> left{frame.fingerprint, frame.constraints};
+      left.fingerprint.write().set_left_no_check(id);
+      frame.fingerprint.write().set_right_no_check(id);
+
+      if(forks % BIND_RATE == 0)
+      {
+        auto & vstore = left.constraints.write().eq_var.write();
+        auto & bucket = vstore[aux_t(rng() % 64)];
+        bucket.write().emplace_back(nullptr, nullptr);
+        checksum += bucket.read().size();
+      }
+
+      // Bound the population by retiring a random frame.
+      if(queue.size() < WIDTH)
+        queue.push_back(std::move(left));
+      else
+        queue[rng() % queue.size()] = std::move(left);
+    }
+    timer.stop();
+
+    double const ns = 1.0 * timer.elapsed().wall / NFORKS;
+    std::cout
+        << name << ": " << ns << " ns/fork (checksum " << checksum << ")"
+        << std::endl;
+  }
+}
+
+int main()
+{
+  run<StdShared>("std::shared_ptr");
+  run<Shared>("Shared         ");
+}
@@ -0,0 +1,86 @@
+// Compares the std::list work queue formerly used by Cy_Eval with
+// Cy_FrameRing.  The benchmark forks and retires frames the way the Fair
+// Scheme does: a fork puts the left branch in front and rotates the right
+// branch to the back, and a finished frame is popped from the front.
+//
+// Forks copy the fingerprint and constraint handles but do not write to them,
+// so that the timings reflect the queue rather than the fingerprint.
+#include "computation_frame.hpp"
+#include <boost/timer/timer.hpp>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+
+extern "C" { aux_t Cy_NextChoiceId = 0; int64_t CyTrace_IndentLvl = 0; }
+namespace sprite { namespace compiler
+{
+  Cy_RootStack CyMem_Roots;
+  namespace fingerprints { boost::pool<> branch_pool(sizeof(Branch)); }
+}}
+
+namespace
+{
+  size_t const NFRAMES = 10000000;
+  // The queue width at which frames are retired rather than forked.
+  size_t const WIDTH = 4096;
+
+  node * dummy(size_t i) { return reinterpret_cast<node *>(i * sizeof(node)); }
+
+  // Forks the front frame.
+  template<typename Queue> void fork_list(Queue & q, aux_t id)
+  {
+    auto & frame = q.front();
+    Shared<Fingerprint> left_fp(frame.fingerprint);
+    Shared<ConstraintStore> left_cst(frame.constraints);
+    auto head = q.begin();
+    q.emplace_front(dummy(id), std::move(left_fp), std::move(left_cst));
+    q.splice(q.end(), q, head);
+  }
+
+  void fork_ring(Cy_FrameRing & q, aux_t id)
+  {
+    auto & frame = q.front();
+    Shared<Fingerprint> left_fp(frame.fingerprint);
+    Shared<ConstraintStore> left_cst(frame.constraints);
+    q.rotate();
+    q.emplace_front(dummy(id), std::move(left_fp), std::move(left_cst));
+  }
+
+  template<typename Queue, typename Fork>
+  size_t run(char const * name, Fork fork)
+  {
+    Queue q;
+    size_t forked = 0, retired = 0, checksum = 0;
+    boost::timer::cpu_timer timer;
+    q.emplace_back(dummy(0));
+    while(!q.empty())
+    {
+      if(forked < NFRAMES && q.size() < WIDTH)
+        fork(q, static_cast<aux_t>(++forked % WIDTH));
+      else
+      {
+        checksum += reinterpret_cast<size_t>(q.front().expr);
+        q.pop_front();
+        ++retired;
+      }
+    }
+    timer.stop();
+    std::cout
+      << name << ": " << forked << " forks, " << retired << " retired, "
+      << timer.format(3, "%ws wall %us user\n");
+    return checksum;
+  }
+}
+
+int main()
+{
+  size_t const a = run<std::list<Cy_EvalFrame>>(
+      "std::list   ", fork_list<std::list<Cy_EvalFrame>>
+    );
+  size_t const b = run<Cy_FrameRing>("Cy_FrameRing", fork_ring);
+  if(a != b)
+  {
+    std::cerr << "checksum mismatch" << std::endl;
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,291 @@
+// Measures the throughput of the collector (NodePool in cymemory.hpp) when it
+// runs many small collections, as a program with little live data does.
+//
+// The live data is a list whose cells hold free variables, some of which are
+// bound to one another in a constraint store.  Three computations share the
+// store, and one has copied its map of bindings, so buckets are shared, too.
+// Each pass allocates some garbage and collects.
+//
+// Also compares the bookkeeping of one collection with the one it replaced:
+// a new deque of roots, copied for the marker, and hash sets of the live IDs
+// and of the bindings already swept.  The replacement reuses its vectors,
+// keeps the IDs in a bitmap (Cy_IdSet), and stamps shared objects
+// (Shared::gc_visit).
+#include "basic_runtime.hpp"
+#include "computation_frame.hpp"
+#include "cymemory.hpp"
+#include <boost/timer/timer.hpp>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+using namespace sprite::compiler;
+
+extern "C"
+{
+  vtable CyVt_Fwd __asm__(".vt.fwd");
+  Cy_ComputationFrame * Cy_GlobalComputations = nullptr;
+  Shared<Fingerprint> * Cy_CurrentFingerprint = nullptr;
+  Shared<ConstraintStore> * Cy_CurrentConstraints = nullptr;
+  aux_t Cy_NextChoiceId = 0;
+  int64_t CyTrace_IndentLvl = 0;
+
+  void CyMem_HeapExhausted()
+  {
+    std::cerr << "heap exhausted" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  void CyMem_IdsExhausted()
+  {
+    std::cerr << "choice IDs exhausted" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  void CyMem_Remember(node * p)
+  {
+    p->mark |= GC_REMEMBERED;
+    CyMem_Remembered.push_back(p);
+  }
+}
+
+namespace sprite { namespace compiler
+{
+  Cy_RootStack CyMem_Roots;
+  namespace fingerprints { boost::pool<> branch_pool(sizeof(Branch)); }
+  std::jmp_buf & Cy_JmpBuf() { static std::jmp_buf buf; return buf; }
+}}
+
+namespace
+{
+  // The number of list cells, each holding a variable.
+  size_t const NCELLS = 4096;
+  // One variable in this many is bound to the next.
+  size_t const BIND_RATE = 4;
+  // The number of garbage nodes allocated between collections.
+  size_t const NGARBAGE = 4096;
+  size_t const NPASSES = 20000;
+  size_t const REPEAT = 5;
+
+  vtable vt_pair, vt_var;
+
+  void succ2(node * p, node *** begin, node *** end)
+  {
+    *begin = reinterpret_cast<node **>(&p->slot0);
+    *end = *begin + 2;
+  }
+
+  void succ0(node *, node *** begin, node *** end)
+    { *begin = *end = nullptr; }
+
+  void destroy(node *) {}
+
+  typedef NodePool<GlobalAllocator> pool_t;
+
+  node * alloc(pool_t & pool)
+  {
+    while(CyMem_AllocPtr == CyMem_AllocLimit)
+      pool.refill();
+    node * p = reinterpret_cast<node *>(CyMem_AllocPtr);
+    CyMem_AllocPtr += NODE_BYTES;
+    return p;
+  }
+
+  void set(node * p, vtable * vt, tag_t tag, node * lhs, node * rhs)
+  {
+    p->vptr = vt;
+    p->tag = tag;
+    p->mark = 0;
+    p->slot0 = lhs;
+    p->slot1 = rhs;
+  }
+
+  // Builds the live data.  Returns the variables.
+  std::vector<node*> build(pool_t & pool, Cy_FrameRing & ring)
+  {
+    std::vector<node*> vars;
+    node * const nil = alloc(pool);
+    set(nil, &vt_var, CTOR, nullptr, nullptr);
+    CyMem_Roots.push_back(nil);
+    for(size_t i=0; i<NCELLS; ++i)
+    {
+      node * const var = alloc(pool);
+      set(var, &vt_var, FREE, nullptr, nullptr);
+      var->aux = Cy_NextChoiceId++;
+      vars.push_back(var);
+      CyMem_Roots.push_back(var);
+      node * const cell = alloc(pool);
+      CyMem_Roots.pop_back();
+      set(cell, &vt_pair, CTOR, var, CyMem_Roots.back());
+      CyMem_Roots.back() = cell;
+    }
+
+    ring.emplace_back(CyMem_Roots.back());
+    ConstraintStore & store = ring.back().constraints.write();
+    for(size_t i=0; i+1<vars.size(); i+=BIND_RATE)
+      store.add_var_constraints(vars[i], vars[i+1], false);
+    for(int k=0; k<2; ++k)
+    {
+      Cy_EvalFrame & first = ring.front();
+      ring.emplace_back(
+          first.expr, Shared<Fingerprint>(first.fingerprint)
+        , Shared<ConstraintStore>(first.constraints)
+        );
+    }
+    ring.back().constraints.write().eq_var.write();
+    return vars;
+  }
+
+  // The bookkeeping of a collection before Cy_IdSet and Shared::gc_visit.
+  size_t old_bookkeeping(std::vector<node*> const & id_nodes)
+  {
+    std::deque<node*> roots;
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      roots.push_back(frame->root);
+      for(Cy_EvalFrame & comp: *frame->computation)
+        roots.push_back(comp.expr);
+    }
+    for(node * p: CyMem_Roots)
+      roots.push_back(p);
+    std::vector<node*> root_slots(roots.begin(), roots.end());
+    std::vector<node**> stack;
+    for(node *& root: root_slots)
+      stack.push_back(&root);
+
+    std::unordered_set<aux_t> used_ids;
+    for(node * p: id_nodes)
+      used_ids.insert(p->aux);
+    std::unordered_set<void const *> done;
+    size_t kept = 0;
+    for(Cy_EvalFrame & comp: *Cy_GlobalComputations->computation)
+    {
+      for(auto & binding: comp.constraints->eq_var.read())
+      {
+        if(!done.insert(&binding).second)
+          continue;
+        for(auto const & data: binding.second.read())
+        {
+          if(done.insert(&data).second)
+            kept += used_ids.count(data.first->aux)
+                 && used_ids.count(data.second->aux);
+        }
+      }
+    }
+    return kept + stack.size();
+  }
+
+  // The same, as collect_only does it now.
+  struct NewBookkeeping
+  {
+    size_t operator()(std::vector<node*> const & id_nodes)
+    {
+      roots.clear();
+      for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+          frame = frame->next
+        )
+      {
+        roots.push_back(frame->root);
+        for(Cy_EvalFrame & comp: *frame->computation)
+          roots.push_back(comp.expr);
+      }
+      for(node * p: CyMem_Roots)
+        roots.push_back(p);
+      stack.clear();
+      for(node *& root: roots)
+        stack.push_back(&root);
+
+      used_ids.reserve(Cy_NextChoiceId);
+      for(node * p: id_nodes)
+        used_ids.insert(p->aux);
+      size_t const stamp = shared::new_stamp();
+      size_t kept = 0;
+      for(Cy_EvalFrame & comp: *Cy_GlobalComputations->computation)
+      {
+        if(!comp.constraints->eq_var.gc_visit(stamp))
+          continue;
+        for(auto & binding: comp.constraints->eq_var.read())
+        {
+          if(!binding.second.gc_visit(stamp))
+            continue;
+          for(auto const & data: binding.second.read())
+            kept += used_ids.contains(data.first->aux)
+                 && used_ids.contains(data.second->aux);
+        }
+      }
+      used_ids.clear();
+      return kept + stack.size();
+    }
+
+    std::vector<node*> roots;
+    std::vector<node**> stack;
+    Cy_IdSet used_ids;
+  };
+
+  template<typename F>
+  double best_us(std::vector<node*> const & id_nodes, F f, size_t & result)
+  {
+    double best = 1e300;
+    for(size_t r=0; r<REPEAT; ++r)
+    {
+      boost::timer::cpu_timer timer;
+      for(size_t i=0; i<NPASSES; ++i)
+        result += f(id_nodes);
+      timer.stop();
+      best = std::min(best, timer.elapsed().wall * 1e-3 / NPASSES);
+    }
+    return best;
+  }
+}
+
+int main()
+{
+  // A heap a few times the size of the live data, so that it is collected
+  // often.  SPRITE_HEAP_MAX_MB keeps it from growing.
+  setenv("SPRITE_HEAP_INITIAL_KB", "1024", 0);
+  setenv("SPRITE_HEAP_MAX_MB", "1", 0);
+
+  vt_pair.sentinel = vt_var.sentinel = &CyVt_Fwd;
+  vt_pair.destroy = vt_var.destroy = destroy;
+  vt_pair.gcsucc = succ2;
+  vt_var.gcsucc = succ0;
+
+  pool_t pool(NODE_BYTES, 256);
+  Cy_FrameRing ring;
+  std::vector<node*> const vars = build(pool, ring);
+  Cy_ComputationFrame frame{&ring, nullptr, vars[0], false, false, nullptr};
+  Cy_GlobalComputations = &frame;
+
+  boost::timer::cpu_timer timer;
+  for(size_t i=0; i<NPASSES; ++i)
+  {
+    for(size_t k=0; k<NGARBAGE; ++k)
+      set(alloc(pool), &vt_pair, CTOR, vars[0], vars[0]);
+    pool.collect();
+  }
+  timer.stop();
+  double const us = timer.elapsed().wall * 1e-3 / NPASSES;
+  std::cout << "collector: " << us << " us per collection ("
+    << size_t(1e6 / us) << " per second) with " << 2 * NCELLS
+    << " nodes live" << std::endl;
+
+  std::vector<node*> id_nodes(vars.begin(), vars.end());
+  size_t old_result = 0;
+  size_t new_result = 0;
+  NewBookkeeping bookkeeping;
+  double const old_us = best_us(id_nodes, old_bookkeeping, old_result);
+  double const new_us = best_us(id_nodes, std::ref(bookkeeping), new_result);
+  if(old_result != new_result)
+  {
+    std::cerr << "bookkeeping results differ: " << old_result << " and "
+      << new_result << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "bookkeeping: " << old_us << " us per collection before, "
+    << new_us << " us now" << std::endl;
+}
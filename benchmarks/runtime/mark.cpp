@@ -0,0 +1,138 @@
+// Measures the pause taken by the mark phase of the collector (Cy_Marker in
+// marker.hpp) with one and with several threads.
+//
+// Two heaps are marked.  In "tree", the nodes form a binary tree whose leaves
+// point back at random nodes, so there is plenty of work to share.  In "list",
+// they form a list whose elements are small trees, which leaves little to
+// share; this is the worst case for the parallel marker.  Every mark is
+// checked against the sequential one.  Thread counts above the number of
+// cores are reported as oversubscribed.
+#include "marker.hpp"
+#include <boost/timer/timer.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace sprite::compiler;
+
+extern "C"
+{
+  vtable CyVt_Fwd __asm__(".vt.fwd");
+}
+
+namespace
+{
+  size_t const NNODES = size_t(1) << 21;
+  size_t const REPEAT = 5;
+  // One node in this many is a choice.
+  size_t const CHOICE_RATE = 16;
+
+  vtable vt_pair, vt_leaf;
+
+  void succ2(node * p, node *** begin, node *** end)
+  {
+    *begin = reinterpret_cast<node **>(&p->slot0);
+    *end = *begin + 2;
+  }
+
+  void succ0(node *, node *** begin, node *** end)
+    { *begin = *end = nullptr; }
+
+  void set(node & n, node * lhs, node * rhs, size_t i)
+  {
+    n.vptr = lhs ? &vt_pair : &vt_leaf;
+    n.tag = i % CHOICE_RATE == 0 ? CHOICE : CTOR;
+    n.mark = 0;
+    n.aux = static_cast<aux_t>(i);
+    n.slot0 = lhs;
+    n.slot1 = rhs;
+  }
+
+  void make_tree(std::vector<node> & heap)
+  {
+    // The leaves point back at random nodes.
+    std::mt19937 rng(1);
+    size_t const n = heap.size();
+    for(size_t i=0; i<n; ++i)
+    {
+      if(2*i+2 < n)
+        set(heap[i], &heap[2*i+1], &heap[2*i+2], i);
+      else
+        set(heap[i], &heap[rng() % n], &heap[rng() % n], i);
+    }
+  }
+
+  void make_list(std::vector<node> & heap)
+  {
+    // Each element is a cons cell holding a tree of seven nodes.
+    size_t const n = heap.size();
+    size_t const cell = 8;
+    for(size_t i=0; i+cell<=n; i+=cell)
+    {
+      node * next = i + 2*cell <= n ? &heap[i+cell] : &heap[i+1];
+      set(heap[i], &heap[i+1], next, i);
+      set(heap[i+1], &heap[i+2], &heap[i+3], i+1);
+      set(heap[i+2], &heap[i+4], &heap[i+5], i+2);
+      set(heap[i+3], &heap[i+6], &heap[i+7], i+3);
+      for(size_t j=4; j<cell; ++j)
+        set(heap[i+j], nullptr, nullptr, i+j);
+    }
+  }
+
+  void run(char const * name, void (*make)(std::vector<node> &))
+  {
+    std::vector<node> heap(NNODES);
+    make(heap);
+    std::vector<node*> roots{&heap[0]};
+    Cy_MarkBits marks;
+    marks.add_block(
+        reinterpret_cast<char *>(heap.data())
+      , reinterpret_cast<char *>(heap.data() + heap.size())
+      );
+
+    size_t expected_live = 0;
+    size_t expected_ids = 0;
+    unsigned const hw = std::max(1u, std::thread::hardware_concurrency());
+    for(size_t nthreads: {1, 2, 4, 8})
+    {
+      double best = 1e300;
+      for(size_t r=0; r<REPEAT; ++r)
+      {
+        marks.clear();
+        std::vector<node*> id_nodes;
+        boost::timer::cpu_timer timer;
+        size_t const live =
+            Cy_Marker::get().mark(marks, roots, 0, &id_nodes, nthreads);
+        timer.stop();
+        best = std::min(best, timer.elapsed().wall * 1e-6);
+
+        if(nthreads == 1 && r == 0)
+        {
+          expected_live = live;
+          expected_ids = id_nodes.size();
+        }
+        else if(live != expected_live || id_nodes.size() != expected_ids)
+        {
+          std::cerr << name << ": marked " << live << " nodes with "
+            << id_nodes.size() << " IDs using " << nthreads
+            << " threads, expected " << expected_live << " with "
+            << expected_ids << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+      }
+      std::cout << name << ": " << nthreads << " threads: " << best
+        << " ms to mark " << expected_live << " nodes"
+        << (nthreads > hw ? " (oversubscribed)" : "") << std::endl;
+    }
+  }
+}
+
+int main()
+{
+  vt_pair.gcsucc = succ2;
+  vt_leaf.gcsucc = succ0;
+  run("tree", make_tree);
+  run("list", make_list);
+}
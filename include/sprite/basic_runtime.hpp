@@ -1,4 +1,5 @@
 #pragma once
+#include "stddef.h"
 #include "stdint.h"
 
 // !!! Important !!!
@@ -42,13 +43,44 @@ namespace sprite { namespace compiler
   {
     vtable * vptr;  // Pointer to the vtable.
     tag_t    tag;   // Node type tag.
-    mark_t   mark;  // GC mark.
+    mark_t   mark;  // Generational GC state.  See MarkBits.
     aux_t    aux;   // Aux space.
     void *   slot0; // First successor or start of data area.
     void *   slot1; // Second successor.
   };
 
+  // A node with three or more successors keeps them in an array pointed to
+  // by slot0.  The array is external, from Cy_ArrayAllocTyped, or inline:
+  // a node allocated with its successors takes the chunks following its own
+  // in the node heap, and the array begins at slot1.  Code that reads the
+  // array through slot0 handles both.  Nodes with more than
+  // INLINE_ARITY_MAX successors keep them external.
+  constexpr size_t INLINE_ARITY_MAX = 61;
+
+  // The number of node-sized chunks taken by a node with @p arity successors
+  // stored inline.
+  constexpr size_t inline_node_chunks(size_t arity)
+    { return ((3 + arity) * sizeof(void *) + sizeof(node) - 1) / sizeof(node); }
+
+  // The most chunks any node takes.
+  constexpr size_t INLINE_NODE_MAX_CHUNKS = inline_node_chunks(INLINE_ARITY_MAX);
+
   enum Tag : tag_t
       { FAIL= -6, FREE= -5, FWD= -4, BINDING= -3, CHOICE= -2, OPER= -1, CTOR=0, TAGOFFSET= -FAIL };
+
+  // Bits of node::mark.  Only the generational collector uses them.  Mark
+  // bits are kept apart from the nodes.  See runtime/sprite-rt/C/cymemory.hpp
+  // and markbits.hpp.
+  enum MarkBits : mark_t
+  {
+      GC_OLD= 1         // Promoted to the old generation.
+    , GC_REMEMBERED= 2  // Old, and listed in the remembered set.
+    , GC_AGE_SHIFT= 2   // Minor collections survived while young.
+    , GC_AGE_MASK= 3 << GC_AGE_SHIFT
+  };
+
+  // Search strategies for Cy_Eval.  See runtime/sprite-rt/C/scheduler.hpp.
+  enum SearchStrategy : int
+      { SEARCH_FAIR=0, SEARCH_DFS=1, SEARCH_BFS=2, SEARCH_ID=3 };
 }}
 
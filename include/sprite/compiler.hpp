@@ -3,6 +3,7 @@
 #include "sprite/backend/support/testing.hpp"
 #include "sprite/curryinput.hpp"
 #include "sprite/runtime.hpp"
+#include "sprite/tree_utils.hpp"
 #include "sprite/basic_runtime.hpp"
 #include <unordered_map>
 #include <iterator>
@@ -15,6 +16,26 @@ namespace sprite { namespace compiler
   {
     bool enable_tracing = false;
     int bypass_choices = false;
+    // The default search strategy of the generated program.  The environment
+    // variable SPRITE_SEARCH overrides it at run time.
+    int search_strategy = SEARCH_FAIR;
+    // Collect at the restart point before an allocation, rather than at the
+    // allocation, so that nothing is executed again.  See
+    // rt_h::make_restart_point.
+    int gc_resume = false;
+    // Compute Int, Char and Float expressions, and comparisons of them, in
+    // registers rather than building nodes for the runtime.  Disable to debug
+    // the generated code.
+    int inline_primitives = true;
+    // Head-normalize the demanded arguments of the replacement before it is
+    // built, so that no node is built for an operation whose value is needed
+    // at once.  Off by default: an argument that would never be reached,
+    // because another fails first, may diverge, and then the alternatives of
+    // an enclosing choice are never reached.
+    int eager_demanded = false;
+    // Report statistics about the generated code, such as the number of
+    // vtable calls made directly.
+    int verbose = false;
   };
 
   // ===========================
@@ -104,6 +125,9 @@ namespace sprite { namespace compiler
     // The node information.
     std::unordered_map<curry::Qname, NodeSTab> nodes;
 
+    // The arguments demanded by functions of this module and its imports.
+    curry::Demands demands;
+
     // Look up a node symbol table.
     compiler::NodeSTab const & lookup(curry::Qname const &) const;
     compiler::NodeSTab & lookup(curry::Qname const &);
@@ -207,11 +231,31 @@ namespace sprite { namespace compiler
     return bitcast(slot0, **types::char_());
   }
 
-  // Gets the extended child array cast to char_t**.
+  // Makes a node store its successors inline, starting at slot1, and returns
+  // the array, cast to char**.  The node must have been allocated with
+  // inline_node_chunks(arity) chunks.
+  inline value set_inline_child_array(value const & node)
+  {
+    return set_extended_child_array(
+        node, bitcast(&node.arrow(ND_SLOT1), *types::char_())
+      );
+  }
+
+  // Gets the extended child array cast to char_t**.  Since slot0 points to
+  // the array in either layout, this works for inline successors, too.
   inline value get_extended_child_array(rt_h const & rt, value const & node)
     { return bitcast(node.arrow(ND_SLOT0), **rt.node_t); }
 
-  // Gets a node successor.
+  // The number of chunks to allocate for a new node with @p arity successors.
+  // A new node stores three or more successors inline.
+  inline size_t node_chunks(size_t arity)
+  {
+    if(arity > INLINE_ARITY_MAX)
+      throw compile_error("Too many successors");
+    return arity < 3 ? 1 : inline_node_chunks(arity);
+  }
+
+  // Gets a node successor.  Handles both layouts of a successor array.
   inline ref get_successor(
       rt_h const & rt, value const & node, size_t arity, size_t pos
     )
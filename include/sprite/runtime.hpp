@@ -2,6 +2,8 @@
 #include <unistd.h>
 #include "sprite/backend.hpp"
 #include "sprite/basic_runtime.hpp"
+#include <unordered_map>
+#include <utility>
 
 // The number of pre-defined arity functions.
 #define SPRITE_PREDEF_ARITY_LIMIT 10
@@ -33,6 +35,7 @@ namespace sprite { namespace compiler
     // Forward declarations.
     type node_t = types::struct_("node");
     type vtable_t = types::struct_("vtable");
+    type root_stack_t = types::struct_("Cy_RootStack");
 
     // The type of a step-performing function (i.e., N or H).
     function_type stepfun_t = void_t(*node_t);
@@ -95,6 +98,12 @@ namespace sprite { namespace compiler
             , "equal", "equate", "ns_equate", "compare", "show"}
         #endif
         );
+
+      /// The stack of temporary roots.  See Cy_RootStack in the runtime.
+      root_stack_t = types::struct_(
+          "Cy_RootStack"
+        , {**node_t /*top*/, **node_t /*limit*/, **node_t /*base*/}
+        );
     }
   };
 
@@ -121,11 +130,25 @@ namespace sprite { namespace compiler
     function const Cy_ArrayAllocTyped = extern_((**node_t)(aux_t), "Cy_ArrayAllocTyped");
     function const Cy_ArrayDealloc = extern_(void_t(aux_t, *char_t), "Cy_ArrayDealloc");
     function const CyMem_Collect = extern_(void_t(), "CyMem_Collect");
-    globalvar const CyMem_FreeList = extern_(*char_t, "CyMem_FreeList").as_globalvar();
-    function const _CyMem_PushRoot = extern_(void_t(*node_t), "CyMem_PushRoot");
-    function const _CyMem_PopRoot = extern_(void_t(), "CyMem_PopRoot");
+    globalvar const CyMem_AllocPtr = extern_(*char_t, "CyMem_AllocPtr").as_globalvar();
+    globalvar const CyMem_AllocLimit = extern_(*char_t, "CyMem_AllocLimit").as_globalvar();
+    globalvar const CyMem_AllocChunks = extern_(size_t_t, "CyMem_AllocChunks").as_globalvar();
+    globalvar const CyMem_Roots = extern_(root_stack_t, "CyMem_Roots").as_globalvar();
+    function const CyMem_GrowRoots = extern_(void_t(), "CyMem_GrowRoots");
+
+    // Emits an inline push onto the root stack, CyMem_Roots.  Calls
+    // CyMem_GrowRoots only if the stack is full.
     void CyMem_PushRoot(value root_p, bool enable_tracing) const;
+
+    // Emits an inline pop from the root stack.
     void CyMem_PopRoot(bool enable_tracing) const;
+    function const CyMem_Remember = extern_(void_t(*node_t), "CyMem_Remember");
+
+    // Emits the write barrier for @p node_p.  Must follow every store of a
+    // node pointer into a successor of a node that may predate the current
+    // step, with no allocation in between.  Records the node in the
+    // remembered set if it belongs to the old generation.
+    void write_barrier(value node_p) const;
 
     // Tracing.
     function const CyTrace_Indent = extern_(void_t(), "CyTrace_Indent");
@@ -134,18 +157,47 @@ namespace sprite { namespace compiler
 
     function const Cy_Suspend = extern_(void_t(), "Cy_Suspend");
 
+    // Preemption.  The flag is set when the current quantum expires.
+    globalvar const Cy_PreemptRequested =
+        extern_(int_t, "Cy_PreemptRequested").as_globalvar();
+    function const Cy_Preempt = extern_(void_t(), "Cy_Preempt");
+
+    // Emits a safepoint.  Calls Cy_Preempt if the quantum has expired.  This
+    // may throw, so it must only be placed where no new node is unrooted.
+    void safepoint() const;
+
     // Creates a new basic block at the current point in the code stream and
     // makes it the default insertion point.  Creates another basic block that
     // calls the garbage collector and then returns to this point.  Returns the
     // second one.
+    //
+    // With reserve_at_restart_points, the new block first makes room in the
+    // allocation run for every node that node_alloc allocates with the
+    // returned label.  A collection then happens here, where every live node
+    // is rooted, and the code after this point runs once.  The returned label
+    // remains as a fallback.
     label make_restart_point() const;
 
+    // Set from CompilerOptions::gc_resume.
+    mutable bool reserve_at_restart_points = false;
+
+    // The reservation made by each restart point, by the label returned: a
+    // constant holding the number of chunks, and that number.  Updated by
+    // node_alloc.
+    mutable std::unordered_map<
+        llvm::BasicBlock *, std::pair<llvm::GlobalVariable *, size_t>
+      > reservations;
+
     // Macro-like function.  Must be called from a label scope.  Either
     // allocates a new node and assigns it to the ref, or jumps to the label.
-    value node_alloc(type const & ty, label const &) const;
+    // A node that stores its successors inline takes @p nchunks chunks (see
+    // inline_node_chunks).
+    value node_alloc(type const & ty, label const &, size_t nchunks = 1) const;
 
     function_type const yieldfun_t = void_t(*node_t);
     function const Cy_Eval = extern_(void_t(*node_t, *yieldfun_t), "Cy_Eval");
+    function const CySearch_SetDefault = extern_(void_t(int_t), "CySearch_SetDefault");
+    function const CyArgs_Parse = extern_(void_t(int_t, **char_t), "CyArgs_Parse");
     function const Cy_Normalize = extern_(void_t(*node_t), "Cy_Normalize");
     function const Cy_CyStringToCString =
         extern_(void_t(*node_t, FILE_p), "Cy_CyStringToCString");
@@ -177,6 +229,7 @@ namespace sprite { namespace compiler
       { return extern_(rangefun_t, "CyFree_GcSucc"); }
 
     // Returns a function that frees the associated successor array, if any.
+    // Successors stored inline are freed with the node.
     function Cy_Destroy(size_t arity) const;
 
     // Get the vtable of a built-in type.
@@ -4,7 +4,10 @@
  * curryinput.hpp.
  */
 
+#pragma once
 #include "sprite/curryinput.hpp"
+#include <set>
+#include <unordered_map>
 
 namespace sprite { namespace curry
 {
@@ -15,4 +18,21 @@ namespace sprite { namespace curry
   std::vector<size_t> find_pathids_that_are_aux_arguments(
       Function const &, Branch const &
     );
+
+  /**
+   * @brief The demanded arguments of each function.
+   *
+   * A function demands an argument if, whenever an application of it is
+   * head-normalized to a constructor, the argument was head-normalized in
+   * place.
+   */
+  using Demands = std::unordered_map<Qname, std::vector<bool>>;
+
+  // Analyzes the functions of the given modules.  Functions not found in the
+  // modules demand nothing.
+  Demands find_demanded_arguments(std::vector<Module const *> const &);
+
+  // Identifies which variables are head-normalized whenever the given rule
+  // is.  Returns a set of pathids.
+  std::set<size_t> find_demanded_variables(Rule const &, Demands const &);
 }}
@@ -0,0 +1,148 @@
+// Defines Cy_Arena, which supplies the memory of the node heap.
+#pragma once
+#include "basic_runtime.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#if VERBOSEGC > 1
+#include <iostream>
+#endif
+
+namespace sprite { namespace compiler
+{
+  // The size of a transparent huge page on x86-64 and AArch64 with 4 KiB base
+  // pages.
+  size_t const CY_HUGE_PAGE = size_t(1) << 21;
+
+  /**
+   * @brief Hands out node blocks from large reserved address ranges.
+   *
+   * A range is reserved with mmap but not made accessible.  Each block is
+   * committed when it is handed out, by making its pages writable.  The OS
+   * supplies zeroed pages on first touch, so a block need not be cleared, and
+   * its pages cost nothing until the allocator reaches them.  Blocks are
+   * carved from the range in order, so successive blocks are adjacent and the
+   * heap is a few long address ranges.
+   *
+   * If huge pages are requested, each range is aligned to a huge page and
+   * marked with MADV_HUGEPAGE, so the kernel may back it with transparent huge
+   * pages.  That cuts the TLB misses of the collector walking a large heap.
+   *
+   * When a range is used up, another one is reserved.  Memory is never
+   * returned to the arena.  NodePool instead releases the pages of unused
+   * blocks (see NodePool::retire_blocks).
+   */
+  struct Cy_Arena
+  {
+    // Reserves ranges of @p reserve bytes, or less if the OS refuses.
+    explicit Cy_Arena(size_t reserve, bool huge_pages)
+      : reserve_size(round_up(std::max(reserve, CY_HUGE_PAGE), CY_HUGE_PAGE))
+      , huge_pages(huge_pages)
+    {}
+
+    // Returns a block of @p bytes whose contents are zero, or null if memory
+    // is exhausted.
+    char * allocate(size_t bytes);
+
+  private:
+
+    static size_t round_up(size_t n, size_t m) { return (n + m - 1) / m * m; }
+
+    // Reserves a range of at least @p bytes.  Returns false if none is left.
+    bool reserve(size_t bytes);
+
+    size_t const reserve_size;
+    bool const huge_pages;
+
+    // The unused part of the current range, and the end of its committed
+    // prefix.
+    char * next = nullptr;
+    char * committed = nullptr;
+    char * limit = nullptr;
+  };
+
+  inline char * Cy_Arena::allocate(size_t bytes)
+  {
+    #if VERBOSEGC > 1
+      std::cout
+          << "Request for a block of " << bytes
+          << " bytes (" << bytes / sizeof(node) << " nodes)."
+          << std::endl;
+    #endif
+    if(size_t(limit - next) < bytes && !this->reserve(bytes))
+      return nullptr;
+    char * const p = next;
+    next += bytes;
+
+    // Commit whole huge pages, so that the kernel can back them with huge
+    // pages.  Blocks grow geometrically, so the excess is soon used.
+    if(next > committed)
+    {
+      char * const end = std::min(
+          limit, committed + round_up(next - committed, CY_HUGE_PAGE)
+        );
+      if(mprotect(committed, end - committed, PROT_READ | PROT_WRITE) != 0)
+      {
+        next = p;
+        return nullptr;
+      }
+      committed = end;
+    }
+    #if VERBOSEGC > 1
+      std::cout
+          << "block-alloc(("
+          << reinterpret_cast<void *>(p) << ","
+          << reinterpret_cast<void *>(p + bytes)
+          << "))" << std::endl
+        ;
+    #endif
+    return p;
+  }
+
+  inline bool Cy_Arena::reserve(size_t bytes)
+  {
+    // The rest of the current range is abandoned.  It was never committed, so
+    // it costs only address space.
+    size_t size = std::max(reserve_size, round_up(bytes, CY_HUGE_PAGE));
+    size_t const align = huge_pages ? CY_HUGE_PAGE : 0;
+    for(;;)
+    {
+      void * p = mmap(
+          nullptr, size + align, PROT_NONE
+        , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+        );
+      if(p != MAP_FAILED)
+      {
+        char * begin = static_cast<char *>(p);
+        if(align)
+        {
+          // Trim the range to a huge-page boundary at both ends.
+          char * const aligned = reinterpret_cast<char *>(
+              round_up(reinterpret_cast<uintptr_t>(begin), align)
+            );
+          if(aligned != begin)
+            munmap(begin, aligned - begin);
+          if(size_t const tail = align - (aligned - begin))
+            munmap(aligned + size, tail);
+          begin = aligned;
+          #ifdef MADV_HUGEPAGE
+            madvise(begin, size, MADV_HUGEPAGE);
+          #endif
+        }
+        next = committed = begin;
+        limit = begin + size;
+        return true;
+      }
+      // The address space may be limited (ulimit -v).  Try a smaller range.
+      if(size / 2 < bytes)
+        return false;
+      size = round_up(size / 2, CY_HUGE_PAGE);
+    }
+  }
+}}
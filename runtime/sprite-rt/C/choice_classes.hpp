@@ -0,0 +1,303 @@
+// Implements @p ChoiceClasses, the equivalence classes of choices bound by =:=.
+//
+// Binding two free variables binds their choices: whichever way one is made,
+// the other must be made the same way.  The classes are kept in a union-find
+// structure over choice IDs.  Each class has a representative, which records
+// the side (LEFT or RIGHT) chosen for the class, once one is known.  Committing
+// a choice therefore touches only the representative, and a choice not yet
+// made in the fingerprint takes the side of its class when it reaches the top
+// of a computation.
+//
+// Entries are stored in a trie indexed by choice ID, as in fingerprint.hpp.
+// Each node holds CC_SIZE entries or CC_SIZE children.  Subtrees with no
+// entry are null.  Nodes are shared between copies, with reference counts, and
+// a write copies the shared nodes on its path.  Copying a ChoiceClasses object
+// is therefore O(1), which keeps forks cheap.
+//
+// Because entries are shared, finds do not compress paths.  Union by rank
+// bounds the length of a path by the log of the class size.
+#pragma once
+#include "basic_runtime.hpp"
+#include "fingerprint.hpp"
+#include <cstring>
+#include <stdint.h>
+
+namespace sprite { namespace compiler
+{
+  namespace choice_classes
+  {
+    auto constexpr CC_SHIFT = 5;
+    auto constexpr CC_SIZE = 1u << CC_SHIFT;
+    auto constexpr CC_MASK = CC_SIZE - 1;
+
+    // The union-find entry for one choice.  A zeroed entry is a class of one
+    // with no side.
+    struct Entry
+    {
+      // The parent's ID plus one, or zero for a representative.
+      uint32_t up;
+      // For representatives, (rank << 2) | side, where side is a ChoiceState.
+      uint32_t rank_side;
+
+      bool is_root() const { return up == 0; }
+      uint32_t rank() const { return rank_side >> 2; }
+      ChoiceState side() const { return static_cast<ChoiceState>(rank_side & 3); }
+    };
+
+    // A node of the trie.  Leaves hold entries.  Branches hold children.
+    struct Node
+    {
+      size_t refcount;
+      union
+      {
+        Entry entries[CC_SIZE];
+        Node * next[CC_SIZE];
+      };
+    };
+
+    inline boost::pool<> & node_pool()
+    {
+      static boost::pool<> pool(sizeof(Node));
+      return pool;
+    }
+
+    inline Node * node_new()
+    {
+      Node * node = static_cast<Node *>(node_pool().malloc());
+      memset(node, 0, sizeof(Node));
+      node->refcount = 1;
+      return node;
+    }
+
+    // Drops one reference to @p node, which has @p level levels below it.
+    inline void node_release(Node * node, unsigned level)
+    {
+      if(node && --node->refcount == 0)
+      {
+        if(level > 0)
+        {
+          for(size_t i=0; i<CC_SIZE; ++i)
+            node_release(node->next[i], level - 1);
+        }
+        node_pool().free(node);
+      }
+    }
+
+    // Makes the node in @p slot unshared, creating it if necessary.
+    inline Node * node_unique(Node *& slot, unsigned level)
+    {
+      if(!slot)
+        slot = node_new();
+      else if(slot->refcount > 1)
+      {
+        Node * copy = static_cast<Node *>(node_pool().malloc());
+        memcpy(copy, slot, sizeof(Node));
+        copy->refcount = 1;
+        if(level > 0)
+        {
+          for(size_t i=0; i<CC_SIZE; ++i)
+            if(copy->next[i]) copy->next[i]->refcount++;
+        }
+        slot->refcount--;
+        slot = copy;
+      }
+      return slot;
+    }
+  }
+
+  // A persistent union-find structure over choice IDs.
+  struct ChoiceClasses
+  {
+  private:
+
+    using Entry = choice_classes::Entry;
+    using Node = choice_classes::Node;
+
+  public:
+
+    ChoiceClasses() {}
+
+    ChoiceClasses(ChoiceClasses const & arg)
+      : depth(arg.depth), root(arg.root), conflicted(arg.conflicted)
+      { if(root) root->refcount++; }
+
+    ChoiceClasses & operator=(ChoiceClasses const & arg)
+    {
+      if(this != &arg)
+      {
+        if(arg.root)
+          arg.root->refcount++;
+        choice_classes::node_release(root, depth);
+        depth = arg.depth;
+        root = arg.root;
+        conflicted = arg.conflicted;
+      }
+      return *this;
+    }
+
+    ~ChoiceClasses() { choice_classes::node_release(root, depth); }
+
+    // True if no choices are bound.
+    bool empty() const { return !root; }
+
+    // True if a binding related choices made in different directions.
+    bool conflict() const { return conflicted; }
+
+    // Returns the representative of the class of @p id.
+    aux_t find(aux_t id) const
+    {
+      for(Entry e = get(id); !e.is_root(); e = get(id))
+        id = static_cast<aux_t>(e.up - 1);
+      return id;
+    }
+
+    // True if @p id is bound to at least one other choice.
+    bool is_bound(aux_t id) const
+      { return !get(id).is_root() || get(id).rank() > 0; }
+
+    // Returns the side chosen for the class of @p id.
+    ChoiceState side(aux_t id) const { return get(find(id)).side(); }
+
+    // Binds choices @p a and @p b.  @p a_made and @p b_made give their state
+    // in the fingerprint.  Returns false, and records a conflict, if the
+    // classes were made in different directions.
+    bool unite(aux_t a, ChoiceState a_made, aux_t b, ChoiceState b_made)
+    {
+      aux_t ra = find(a);
+      aux_t rb = find(b);
+      Entry const ea = get(ra);
+      Entry const eb = get(rb);
+      ChoiceState const sa =
+          ea.side() != ChoiceState::UNDETERMINED ? ea.side() : a_made;
+      ChoiceState const sb =
+          eb.side() != ChoiceState::UNDETERMINED ? eb.side() : b_made;
+      if(sa != ChoiceState::UNDETERMINED && sb != ChoiceState::UNDETERMINED
+          && sa != sb
+        )
+      {
+        conflicted = true;
+        return false;
+      }
+      uint32_t const side = static_cast<uint32_t>(
+          sa != ChoiceState::UNDETERMINED ? sa : sb
+        );
+      if(ra == rb)
+        return true;
+      uint32_t rank = ea.rank();
+      if(rank < eb.rank())
+      {
+        std::swap(ra, rb);
+        rank = eb.rank();
+      }
+      else if(rank == eb.rank())
+        ++rank;
+      put(rb).up = static_cast<uint32_t>(ra) + 1;
+      put(ra).rank_side = (rank << 2) | side;
+      return true;
+    }
+
+    // Records @p made as the side of the class of @p id.  Precondition:
+    // is_bound(id) and side(id) is UNDETERMINED.
+    void commit(aux_t id, ChoiceState made)
+    {
+      Entry & e = put(find(id));
+      e.rank_side = (e.rank() << 2) | static_cast<uint32_t>(made);
+    }
+
+    // Calls fn(id, entry) for every choice with an entry, in increasing ID
+    // order.
+    template<typename Fn> void for_each(Fn && fn) const
+      { for_each_(root, depth, 0, fn); }
+
+    // Returns a copy with every ID (including those of parents) mapped
+    // through @p remap.
+    template<typename Fn> ChoiceClasses renumber(Fn const & remap) const
+    {
+      ChoiceClasses out;
+      for_each(
+          [&](aux_t id, Entry const & e)
+          {
+            Entry & copy = out.put(remap(id));
+            copy.up = e.is_root()
+                ? 0 : static_cast<uint32_t>(remap(aux_t(e.up - 1))) + 1;
+            copy.rank_side = e.rank_side;
+          }
+        );
+      out.conflicted = conflicted;
+      return out;
+    }
+
+    // Identifies the shared trie, so that callers can avoid rewriting it
+    // once per copy.
+    void const * identity() const { return root; }
+
+  private:
+
+    // The largest ID representable in the current trie, plus one.
+    uint64_t id_bound() const
+      { return uint64_t(choice_classes::CC_SIZE) << (depth * choice_classes::CC_SHIFT); }
+
+    static unsigned index(aux_t id, unsigned level)
+      { return (id >> (level * choice_classes::CC_SHIFT)) & choice_classes::CC_MASK; }
+
+    Entry get(aux_t id) const
+    {
+      if(!root || uint64_t(id) >= id_bound())
+        return Entry{0, 0};
+      Node const * p = root;
+      for(unsigned level=depth; level>0; --level)
+      {
+        p = p->next[index(id, level)];
+        if(!p)
+          return Entry{0, 0};
+      }
+      return p->entries[index(id, 0)];
+    }
+
+    Entry & put(aux_t id)
+    {
+      while(uint64_t(id) >= id_bound())
+      {
+        if(root)
+        {
+          Node * const child = root;
+          root = choice_classes::node_new();
+          root->next[0] = child;
+        }
+        depth++;
+      }
+      Node ** slot = &root;
+      for(unsigned level=depth; level>0; --level)
+      {
+        Node * p = choice_classes::node_unique(*slot, level);
+        slot = &p->next[index(id, level)];
+      }
+      return choice_classes::node_unique(*slot, 0)->entries[index(id, 0)];
+    }
+
+    template<typename Fn>
+    static void for_each_(Node const * node, unsigned level, aux_t base, Fn & fn)
+    {
+      if(!node)
+        return;
+      if(level == 0)
+      {
+        for(size_t i=0; i<choice_classes::CC_SIZE; ++i)
+        {
+          Entry const & e = node->entries[i];
+          if(e.up || e.rank_side)
+            fn(base + aux_t(i), e);
+        }
+        return;
+      }
+      aux_t const stride = aux_t(1) << (level * choice_classes::CC_SHIFT);
+      for(size_t i=0; i<choice_classes::CC_SIZE; ++i)
+        for_each_(node->next[i], level - 1, base + aux_t(i) * stride, fn);
+    }
+
+    // The number of levels of branches above the leaves.
+    unsigned depth = 0;
+    Node * root = nullptr;
+    bool conflicted = false;
+  };
+}}
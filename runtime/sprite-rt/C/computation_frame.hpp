@@ -1,10 +1,12 @@
 // Defines Cy_ComputationFrame and related data structures.
 #pragma once
 #include "basic_runtime.hpp"
-// #include "context_switch.hpp"
+#include "choice_classes.hpp"
+#include "context_switch.hpp"
 #include "fingerprint.hpp"
-#include <list>
-#include <memory>
+#include "ring.hpp"
+#include "shared.hpp"
+#include "timer.hpp"
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -12,48 +14,7 @@
 
 namespace sprite { namespace compiler
 {
-  // Manages an instance of T using copy-on-write semantics.
-  //
-  // Read access produces the object directly.  Write access triggers a copy if
-  // the object is not unique.  Follow the never-empty rule.
-  template<typename T> struct Shared
-  {
-    // Construct a new managed object.
-    template<typename...Args>
-    Shared(Args&&...args)
-      : data(std::make_shared<T>(std::forward<Args>(args)...))
-    {}
-
-    // Copy/assign/move.
-    template<typename U> Shared(Shared<U> const & arg) : data(arg.data) {}
-    template<typename U> Shared(Shared<U> & arg) : data(arg.data) {}
-    template<typename U> Shared & operator=(Shared<U> const & arg)
-      { data = arg.data; }
-    template<typename U> Shared & operator=(Shared<U> & arg)
-      { data = arg.data; }
-    template<typename U> Shared(Shared<U> && arg) : data(std::move(arg.data))
-      {}
-    template<typename U> Shared & operator=(Shared<U> && arg)
-      { data = std::move(arg.data); }
-
-    // Data access.
-    T const & read() const { return *data; }
-    T & write()
-    {
-      if(!data.unique())
-        data = std::make_shared<T>(*data);
-      return *data;
-    }
-    bool needs_copy() const { return !data.unique(); }
-    T const * operator->() const { return &read(); } // implied read
-
-    // The GC gets special write access without triggering a copy.
-    T & gc_write() const { return const_cast<T&>(*data); }
-
-  private:
-
-    mutable std::shared_ptr<T> data;
-  };
+  struct Cy_Scheduler;
 }}
 
 extern "C"
@@ -113,34 +74,30 @@ extern "C"
 
     // @p eq_choice.
     //
-    // Holds choice bindings.  This is a mapping ID->[ID] relating choice IDs
-    // to equivalent choice IDs.  As an example, {0 -> [1, 2], 1 -> [0, 2], 2
-    // -> [0, 1]} says that choices 0, 1, and 2 are all equivalent.  If any of
-    // them is set in the fingerprint, then the others must also be
-    // (consistently) set.  The redundancy is motivated by the need to quickly
-    // process choices in whatever order they reach the root.
-    using eq_choice_set_t = std::unordered_set<aux_t>;
-    using eq_choice_map_t = std::unordered_map<aux_t, Shared<eq_choice_set_t>>;
-    Shared<eq_choice_map_t> eq_choice;
-
-    void add_choice_constraints(aux_t a, aux_t b)
-    {
-      _add_one_choice_constraint(a, b);
-      _add_one_choice_constraint(b, a);
-    }
+    // Holds choice bindings as equivalence classes of choice IDs.  If any
+    // choice in a class is made, then the others must be made the same way.
+    // The class records the side once one of its choices is made, so the
+    // others follow when they reach the root.  See choice_classes.hpp.
+    ChoiceClasses eq_choice;
+
+    // Binds choices @p a and @p b.  @p fp supplies the choices already made.
+    void add_choice_constraints(aux_t a, aux_t b, Fingerprint const & fp)
+      { eq_choice.unite(a, fp.test(a), b, fp.test(b)); }
+  };
 
-  private:
+  // The empty fingerprint and constraint store.  New computations share these
+  // singletons until their first write triggers a copy.
+  inline Shared<Fingerprint> const & Cy_EmptyFingerprint()
+  {
+    static Shared<Fingerprint> const empty;
+    return empty;
+  }
 
-    void _add_one_choice_constraint(aux_t a, aux_t b)
-    {
-      auto & cstore = this->eq_choice.write();
-      auto p = cstore.find(a);
-      if(p == cstore.end())
-        this->eq_choice.write()[a].write().insert(b);
-      else if(!p->second.read().count(b))
-        p->second.write().insert(b);
-    }
-  };
+  inline Shared<ConstraintStore> const & Cy_EmptyConstraints()
+  {
+    static Shared<ConstraintStore> const empty;
+    return empty;
+  }
 
   // A subcomputation.  One entry in a work queue from the Fair Scheme.
   struct Cy_EvalFrame
@@ -148,12 +105,18 @@ extern "C"
     node * expr;
     Shared<Fingerprint> fingerprint;
     Shared<ConstraintStore> constraints;
-    // The number of GC cycles before this is rotated to the end of the queue.
-    size_t time_allotment = 1;
-    // Interval time_interval;
-    // Fiber fiber;
-
-    Cy_EvalFrame(node * e) : expr(e), fingerprint(), constraints() {}
+    // The CPU time this may run before it is rotated to the end of the queue.
+    Interval time_interval;
+    // The number of choices forked on the path from the root to this frame.
+    size_t depth = 0;
+    // The fiber running this computation, or null if it has not started.
+    Fiber * fiber = nullptr;
+
+    Cy_EvalFrame(node * e)
+      : expr(e)
+      , fingerprint(Cy_EmptyFingerprint())
+      , constraints(Cy_EmptyConstraints())
+    {}
 
     Cy_EvalFrame(
         node * e, Shared<Fingerprint> && f, Shared<ConstraintStore> && c
@@ -161,16 +124,42 @@ extern "C"
       : expr(e), fingerprint(std::move(f)), constraints(std::move(c))
     {}
 
-    // Non-copyable.
+    // Non-copyable, but movable so that work queues can relocate frames.
     Cy_EvalFrame(Cy_EvalFrame const &) = delete;
     Cy_EvalFrame & operator=(Cy_EvalFrame const &) = delete;
+
+    Cy_EvalFrame(Cy_EvalFrame && arg)
+      : expr(arg.expr)
+      , fingerprint(std::move(arg.fingerprint))
+      , constraints(std::move(arg.constraints))
+      , time_interval(arg.time_interval)
+      , depth(arg.depth)
+      , fiber(arg.fiber)
+    {
+      arg.fiber = nullptr;
+    }
+
+    ~Cy_EvalFrame() { if(fiber) Fiber::release(fiber); }
   };
 
+  // A work queue from the Fair Scheme.
+  using Cy_FrameRing = Ring<Cy_EvalFrame>;
+
   // The computation of a single invocation of Cy_Eval.  Holds one instance of
-  // a work queue from the Fair Scheme.
+  // a work queue from the Fair Scheme and the scheduler that orders it.
   struct Cy_ComputationFrame
   {
-    std::list<Cy_EvalFrame> * computation;
+    Cy_FrameRing * computation;
+    Cy_Scheduler * scheduler;
+    // The expression passed to Cy_Eval.  Kept alive so that the search can be
+    // restarted from it.
+    node * root;
+    // True while one of this computation's fibers runs.  Only then may a
+    // safepoint suspend the computation.
+    bool preemptible;
+    // Set when the running fiber gave up because the heap limit was reached.
+    // See CyMem_HeapExhausted.
+    bool heap_exhausted;
     Cy_ComputationFrame * next;
   };
 
@@ -1,194 +1,252 @@
+// Defines Fiber, the execution context of one computation.
+//
+// Each Cy_EvalFrame that is being normalized runs on its own fiber.  When the
+// scheduler preempts a computation, the fiber is suspended by swapping
+// registers, so the computation later resumes exactly where it stopped,
+// instead of unwinding its stack and re-walking the expression from the frame
+// root.
+//
+// Fiber stacks are pooled.  A fiber whose computation finishes parks itself
+// and is reused for the next computation without creating a new context.
 #pragma once
+#include "basic_runtime.hpp"
+#include "root_stack.hpp"
+#include "timer.hpp"
+#include <boost/context/detail/fcontext.hpp>
+#include <exception>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <vector>
 
-// Other platforms may be added as needed.
-#ifdef _POSIX_C_SOURCE
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string>
-#include <time.h>
-#include <boost/context/all.hpp>
-
-// DEBUG
-#include <iostream>
+extern "C"
+{
+  extern int64_t CyTrace_IndentLvl;
+}
 
 namespace sprite { namespace compiler
 {
-  void _os_error(char const * where)
-  {
-    std::string msg("Error in POSIX ");
-    msg = where;
-    perror(msg.c_str());
-    exit(EXIT_FAILURE);
-  }
-
-  // Represents a timer interval.
-  struct Interval
-  {
-    // The interval is 1/50th of a sec to begin with.
-    Interval() : data({{0,0}, {0,20000000}}) {}
+  namespace fctx = boost::context::detail;
 
-    // Increase the timer interval.
-    Interval & operator++()
+  // A context used to manipulate one thread for cooperative multitasking.
+  //
+  // The root set (CyMem_Roots) and trace indentation belong to the running
+  // fiber.  They are saved into the fiber object when it is suspended.
+  struct Fiber
+  {
+    // Returns the fiber running on the thread's original stack.
+    static Fiber & main_fiber()
     {
-      data.it_value.tv_sec *= 2;
-      data.it_value.tv_nsec *= 2;
-      while(data.it_value.tv_nsec > 1000000000L)
-      {
-        data.it_value.tv_sec++;
-        data.it_value.tv_nsec -= 1000000000L;
-      }
-      return *this;
+      static Fiber main(main_fiber_tag{});
+      return main;
     }
 
-    itimerspec const & get() const { return data; }
-
-  private:
-
-    itimerspec data;
-  };
+    // Returns the running fiber.
+    static Fiber *& current()
+    {
+      static Fiber * current = &main_fiber();
+      return current;
+    }
 
-  // Represents a timer used to trigger context switches.
-  struct Timer
-  {
-    Timer()
+    // Every fiber ever created, including the main fiber.  Used by the
+    // collector to find roots of suspended computations.
+    static std::vector<Fiber *> & all()
     {
-      sigevent sevp;
-      sevp.sigev_notify = SIGEV_NONE;
-      if(timer_create(CLOCK_THREAD_CPUTIME_ID, &sevp, &timerid))
-        _os_error("timer_create");
+      static std::vector<Fiber *> fibers;
+      return fibers;
     }
 
-    // Indicates whether the timer has expired.
-    explicit operator bool() const
+    // Gets a fiber from the pool, ready to run expr->vptr->N(expr).
+    static Fiber * acquire(node * expr)
     {
-      itimerspec timedata;
-      if(timer_gettime(timerid, &timedata))
-        _os_error("timer_gettime");
-      return timedata.it_value.tv_sec != 0 || timedata.it_value.tv_nsec != 0;
+      auto & pool = idle();
+      Fiber * fiber;
+      if(pool.empty())
+        fiber = new Fiber();
+      else
+      {
+        fiber = pool.back();
+        pool.pop_back();
+      }
+      fiber->expr = expr;
+      fiber->done = false;
+      return fiber;
     }
 
-    // Sets the timer.
-    void operator()(Interval const & ivl)
+    // Returns a fiber to the pool.  If its computation did not finish, its
+    // stack is discarded by starting a fresh context.
+    static void release(Fiber * fiber)
     {
-      if(timer_settime(timerid, 0, &ivl.get(), nullptr))
-        _os_error("timer_settime");
+      if(!fiber->done)
+      {
+        fiber->context = fresh_context(fiber->stack_bottom, stack_size());
+        fiber->roots.clear();
+        fiber->indent = 0;
+      }
+      fiber->expr = nullptr;
+      idle().push_back(fiber);
     }
 
-  private:
+    Fiber(Fiber const &) = delete;
+    Fiber & operator=(Fiber const &) = delete;
 
-    timer_t timerid;
-  };
+    // Runs this fiber until its computation finishes or yields.  Returns true
+    // if it finished.
+    bool resume()
+    {
+      caller = current();
+      switch_(caller, this);
+      if(error)
+      {
+        std::exception_ptr e;
+        std::swap(e, error);
+        std::rethrow_exception(e);
+      }
+      return done;
+    }
 
-}}
+    // Suspends this fiber, which must be running, and returns to the fiber
+    // that resumed it.
+    void yield() { switch_(this, caller); }
 
-#else
-#error "Context switches are not availble on this platform."
-#endif
+    // True if this is the main fiber.
+    bool is_main() const { return stack_bottom == nullptr; }
 
-extern "C"
-{
-  // The "main" function for performing a subcomputation.  The argument is a
-  // pointer to an instance of Cy_EvalFrame.  This function normalizes the expression.
-  void CyContext_SubcomputationMain(intptr_t);
+    // True if this fiber is in the middle of a computation and not running.
+    bool is_suspended() const
+      { return !is_main() && expr && !done && this != current(); }
 
-  void make_context(void * context, void * stack_pointer);
-}
+    // The stack memory in use while suspended, from the saved context to the
+    // top of the stack.
+    void * stack_low() const { return context; }
+    void * stack_high() const
+      { return static_cast<char *>(stack_bottom) + stack_size(); }
 
-namespace sprite { namespace compiler
-{
-  // extern boost::context::fcontext_t CyContext_MainFiber;
+    // The roots of this fiber while suspended.
+    Cy_RootStack & saved_roots() { return roots; }
 
-  // Functions to manage auxiliary stacks.
-  // void * alloc_stack();
-  // void dealloc_stack(void *);
+    // Calls fn(low, high) for the stack range in use by every computation
+    // fiber, including the running one.  The registers of the running fiber
+    // are spilled to its stack first.  The main stack is not included.
+    template<typename Fn>
+    __attribute__((noinline)) static void for_each_stack(Fn const & fn)
+    {
+      __builtin_unwind_init();
+      for_current_stack(fn);
+      for(Fiber * fiber: all())
+      {
+        if(fiber->is_suspended())
+          fn(fiber->stack_low(), fiber->stack_high());
+      }
+    }
 
-  // A context used to manipulate one thread for cooperative multitasking.
-  struct Fiber
-  {
-    // Creates a new fiber for execution.
-    Fiber() : stack_pointer(malloc(stack_size())), context()
+    // True if any fiber is in the middle of a computation and not running.
+    static bool any_suspended()
     {
-      make_context(&context, stack_pointer);
-      // // make_fcontext creates an fcontext_t on the stack.  Since it is POD, we
-      // // can just copy it into this object.
-      // context = *boost::context::make_fcontext(
-      //       stack_pointer, stack_size(), &CyContext_SubcomputationMain
-      //     );
+      for(Fiber * fiber: all())
+      {
+        if(fiber->is_suspended())
+          return true;
+      }
+      return false;
+    }
+
+    // The stack size, in bytes.  Set by SPRITE_FIBER_STACK_KB (default: 8192).
+    // Only touched pages are committed.
+    static size_t stack_size()
+    {
+      static size_t const value = []
+      {
+        char const * str = getenv("SPRITE_FIBER_STACK_KB");
+        long const kb = str ? atol(str) : 8192;
+        return 1024 * static_cast<size_t>(kb < 64 ? 64 : kb);
+      }();
+      return value;
     }
 
   private:
 
     struct main_fiber_tag {};
-    Fiber(main_fiber_tag) : stack_pointer(nullptr), context() {}
-
-  public:
-
-    // Returns the main fiber (i.e., the initial context of the thread executing main).
-    static Fiber & main_fiber();
+    Fiber(main_fiber_tag) { all().push_back(this); }
 
-    Fiber(Fiber const &) = delete;
-    Fiber & operator=(Fiber const &) = delete;
+    Fiber()
+    {
+      // The lowest page is a guard page.
+      size_t const page = sysconf(_SC_PAGESIZE);
+      void * p = mmap(
+          nullptr, stack_size() + page, PROT_READ | PROT_WRITE
+        , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+        );
+      if(p == MAP_FAILED)
+        _os_error("mmap");
+      if(mprotect(p, page, PROT_NONE))
+        _os_error("mprotect");
+      stack_bottom = static_cast<char *>(p) + page;
+      context = fresh_context(stack_bottom, stack_size());
+      all().push_back(this);
+    }
 
-    Fiber(Fiber && arg)
-      : stack_pointer(arg.stack_pointer), context(arg.context)
+    // Called by for_each_stack.  This frame lies below the one holding the
+    // spilled registers.
+    template<typename Fn>
+    __attribute__((noinline)) static void for_current_stack(Fn const & fn)
     {
-      arg.stack_pointer = nullptr;
+      Fiber * const self = current();
+      if(!self->is_main())
+      {
+        void * volatile marker = nullptr;
+        fn(const_cast<void **>(&marker), self->stack_high());
+      }
     }
 
-    Fiber & operator=(Fiber && arg)
+    static std::vector<Fiber *> & idle()
     {
-      std::swap(stack_pointer, arg.stack_pointer);
-      context = arg.context;
-      return *this;
+      static std::vector<Fiber *> fibers;
+      return fibers;
     }
 
-    ~Fiber() { if(stack_pointer) free(stack_pointer); }
+    static fctx::fcontext_t fresh_context(void * bottom, size_t size)
+      { return fctx::make_fcontext(static_cast<char *>(bottom) + size, size, &entry); }
 
-    // Switch from this fiber (must be currently executing) to the one given.
-    void switch_to(Fiber & to, intptr_t arg=0) const
+    // Transfers control from one fiber to another, exchanging the per-fiber
+    // runtime state.
+    static void switch_(Fiber * from, Fiber * to)
     {
-      // Note: preserve_fpu = false;
-      boost::context::jump_fcontext(&context, &to.context, arg, false);
+      from->roots.swap(CyMem_Roots);
+      CyMem_Roots.swap(to->roots);
+      from->indent = CyTrace_IndentLvl;
+      CyTrace_IndentLvl = to->indent;
+      current() = to;
+      fctx::transfer_t const t = fctx::jump_fcontext(to->context, from);
+      // Control returned.  Record where the fiber that switched here stopped.
+      static_cast<Fiber *>(t.data)->context = t.fctx;
     }
 
-    static size_t constexpr stack_size() { return 10*1024*1024; }
-
-  private:
+    static void entry(fctx::transfer_t t)
+    {
+      static_cast<Fiber *>(t.data)->context = t.fctx;
+      Fiber * const self = current();
+      while(true)
+      {
+        try
+          { self->expr->vptr->N(self->expr); }
+        catch(...)
+          { self->error = std::current_exception(); }
+        self->done = true;
+        self->yield();
+      }
+    }
 
-    void * stack_pointer;
-    mutable boost::context::fcontext_t context;
+    // The lowest usable stack address.  Null for the main fiber.
+    void * stack_bottom = nullptr;
+    // The saved context, while not running.
+    fctx::fcontext_t context = nullptr;
+    // The fiber to return to when yielding.
+    Fiber * caller = nullptr;
+    // The expression being normalized.
+    node * expr = nullptr;
+    bool done = true;
+    std::exception_ptr error;
+    Cy_RootStack roots;
+    int64_t indent = 0;
   };
-
-  boost::context::fcontext_t fcm,fc1,fc2;
-  
-  void f1(intptr_t)
-  {
-      std::cout<<"f1: entered"<<std::endl;
-      std::cout<<"f1: call jump_fcontext( & fc1, fc2, 0)"<< std::endl;
-      boost::context::jump_fcontext(&fc1,&fc2,0);
-      std::cout<<"f1: return"<<std::endl;
-      boost::context::jump_fcontext(&fc1,&fcm,0);
-  }
-  
-  void f2(intptr_t)
-  {
-      std::cout<<"f2: entered"<<std::endl;
-      std::cout<<"f2: call jump_fcontext( & fc2, fc1, 0)"<<std::endl;
-      boost::context::jump_fcontext(&fc2,&fc1,0);
-      // BOOST_ASSERT(false&&!"f2: never returns");
-  }
-  
-  void testtest()
-  {
-    std::size_t size(8192);
-    void* sp1(std::malloc(size));
-    void* sp2(std::malloc(size));
-    
-    fc1= *boost::context::make_fcontext(sp1,size,f1);
-    fc2= *boost::context::make_fcontext(sp2,size,f2);
-    std::cout<<"main: call jump_fcontext( & fcm, fc1, 0)"<<std::endl;
-    boost::context::jump_fcontext(&fcm,&fc1,0);
-  }
 }}
-
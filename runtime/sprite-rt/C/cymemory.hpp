@@ -1,10 +1,17 @@
 // This file may only be included from main.cpp.
 #include "boost-pool-1.46/pool.hpp"
+#include "arena.hpp"
 #include "basic_runtime.hpp"
-#include <deque>
 #include "computation_frame.hpp"
+#include "marker.hpp"
+#include "root_stack.hpp"
+#include <algorithm>
 #include <boost/timer/timer.hpp>
 #include <csetjmp>
+#include <cstdint>
+#include <limits>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #ifdef VERBOSEGC
 #include <iostream>
@@ -17,9 +24,46 @@
 
 extern "C"
 {
-  // The head of the free list.
+  // The head of the free list of the boost::pool specialization below.  Node
+  // blocks come from Cy_Arena instead, so it stays empty.  See NodePool::grow.
   void * CyMem_FreeList = nullptr;
+
+  // The allocation run.  Nodes are allocated by advancing CyMem_AllocPtr
+  // toward CyMem_AllocLimit.  When the two meet, NodePool::refill installs the
+  // next run of free chunks.
+  char * CyMem_AllocPtr = nullptr;
+  char * CyMem_AllocLimit = nullptr;
+
+  // The start of the allocation run, and the number of chunks allocated from
+  // earlier runs.  Cy_InstallRun counts the used part of a run when it is
+  // replaced, so that allocating costs nothing extra.
+  char * CyMem_RunBegin = nullptr;
+  uint64_t CyMem_RunChunks = 0;
+
+  // The number of chunks allocated by this process.  Reported by --stats.
+  uint64_t CyMem_ChunksAllocated()
+  {
+    return CyMem_RunChunks
+        + size_t(CyMem_AllocPtr - CyMem_RunBegin) / NODE_BYTES;
+  }
+
+  // The number of chunks wanted by the allocation that found the run too
+  // short.  Compiled code sets it before calling CyMem_Collect when
+  // allocating a node that stores its successors inline.  See
+  // rt_h::node_alloc.
+  size_t CyMem_AllocChunks = 1;
   extern sprite::compiler::vtable CyVt_Fwd __asm__(".vt.fwd");
+
+  // Adds an old node to the remembered set.  Called by the write barrier.
+  void CyMem_Remember(sprite::compiler::node * p);
+
+  // Called when no chunk can be allocated without passing the heap limit.
+  // Fails the running computation.  Does not return.
+  void CyMem_HeapExhausted() __attribute__((__noreturn__));
+
+  // Called when the choice IDs could overflow aux_t before the next
+  // collection.  Ends the program.  Does not return.
+  void CyMem_IdsExhausted() __attribute__((__noreturn__));
 }
 
 namespace sprite { namespace compiler
@@ -27,7 +71,20 @@ namespace sprite { namespace compiler
   // struct ContextSwitch {};
   // boost::timer::cpu_timer & Cy_Timer();
   // std::jmp_buf & Cy_JmpBuf();
-  extern std::deque<node*> CyMem_Roots;
+
+  // The remembered set.  Holds the old nodes whose successors were
+  // overwritten since the last collection.  Only the generational collector
+  // promotes nodes, so this is otherwise always empty.
+  std::vector<node*> CyMem_Remembered;
+
+  // The write barrier.  Must follow every store of a node pointer into the
+  // successors of a node that may be old, with no allocation in between.
+  // The compiler emits the same check through rt_h::write_barrier.
+  inline void CyMem_WriteBarrier(node * p)
+  {
+    if((p->mark & (GC_OLD | GC_REMEMBERED)) == GC_OLD)
+      CyMem_Remember(p);
+  }
 
   #ifdef VERBOSEGC
   // This debugging timer is specific to x86_64 architecture.
@@ -40,6 +97,8 @@ namespace sprite { namespace compiler
   }
 
   size_t n_gc = 0;
+  size_t n_minor_gc = 0;
+  size_t n_compactions = 0;
   ticks gc_time = 0;
   double gc_pct_sum = 0;
 
@@ -78,7 +137,12 @@ namespace sprite { namespace compiler
           << "    GC elapsed time (s)      : " << (gc_time/freq) << "\n"
           << "    GC % elapsed time        : " << ((double)gc_time/elapsed)*100 << "\n"
           << "    GC # calls               : " << n_gc << "\n"
+          #ifdef GENGC
+          << "    GC # minor calls         : " << n_minor_gc << "\n"
+          #endif
           << "    GC avg % freed           : " << (gc_pct_sum/n_gc) << "\n"
+          << "    GC # compactions         : " << n_compactions << "\n"
+          << "    GC FWD hops saved        : " << Cy_Marker::get().fwd_hops << "\n"
           << std::endl;
       }
       catch(...) {}
@@ -90,12 +154,209 @@ namespace sprite { namespace compiler
   } _gc_report;
   #endif
 
+  #if defined(GENGC) && defined(LAZYSWEEP)
+  #error "GENGC and LAZYSWEEP cannot be combined"
+  #endif
+
+  // A range of adjacent chunks, [first, second).
+  typedef std::pair<char *, char *> Cy_ChunkRun;
+
+  // Records the chunks freed by a sweep, in address order, as runs of adjacent
+  // chunks.  A node of several chunks lies in one block, so runs do not cross
+  // blocks: the sweep calls cut at each block it enters.
+  struct Cy_RunBuilder
+  {
+    Cy_RunBuilder(std::vector<Cy_ChunkRun> & runs_, size_t partition_size_)
+      : runs(runs_), partition_size(partition_size_)
+    {}
+
+    void add(void * chunk)
+    {
+      char * const p = static_cast<char *>(chunk);
+      this->add_run(p, p + partition_size);
+    }
+
+    // Adds the chunks in [begin, end).
+    void add_run(void * begin, void * end)
+    {
+      char * const p = static_cast<char *>(begin);
+      char * const q = static_cast<char *>(end);
+      if(!cut_ && !runs.empty() && runs.back().second == p)
+        runs.back().second = q;
+      else
+        runs.emplace_back(p, q);
+      cut_ = false;
+      count += (q - p) / partition_size;
+    }
+
+    // Starts a new run with the next chunk added, even if it is adjacent.
+    void cut() { cut_ = true; }
+
+    size_t count = 0;
+
+  private:
+    std::vector<Cy_ChunkRun> & runs;
+    size_t partition_size;
+    bool cut_ = false;
+  };
+
+  // Makes [begin, end) the allocation run.
+  inline void Cy_InstallRun(char * begin, char * end)
+  {
+    CyMem_RunChunks += size_t(CyMem_AllocPtr - CyMem_RunBegin) / NODE_BYTES;
+    CyMem_RunBegin = begin;
+    CyMem_AllocPtr = begin;
+    CyMem_AllocLimit = end;
+  }
+
+  // Distinguishes initialized nodes from free chunks.  See collect_only.
+  inline bool Cy_IsNode(node * node_p)
+    { return node_p->vptr && node_p->vptr->sentinel == &CyVt_Fwd; }
+
+  // The number of chunks taken by the node at @p node_p.  More than one only
+  // if it stores its successors inline.
+  inline size_t Cy_NodeChunks(node * node_p)
+  {
+    node ** begin, ** end;
+    node_p->vptr->gcsucc(node_p, &begin, &end);
+    return 1 + marker::extra_chunks(node_p, begin, end);
+  }
+
+  // Frees an unmarked chunk.  Destroys the node it holds, if any, and clears
+  // its first word, so that Cy_IsNode is false until it is allocated again.
+  inline void Cy_ReleaseChunk(node * node_p)
+  {
+    if(Cy_IsNode(node_p))
+      node_p->vptr->destroy(node_p);
+    node_p->vptr = nullptr;
+    node_p->mark = 0;
+  }
+
+  // A set of choice and variable IDs, as a bitmap indexed by ID.  IDs are
+  // below Cy_NextChoiceId, which compact_ids keeps near the number in use, so
+  // the bitmap stays small.  It is kept between collections.  Clearing it
+  // visits only the words that were set.
+  struct Cy_IdSet
+  {
+    // Prepares the set to hold IDs below @p limit.
+    void reserve(aux_t limit)
+    {
+      size_t const n = (size_t(limit) + 63) / 64;
+      if(words.size() < n)
+        words.resize(n);
+    }
+
+    void insert(aux_t id)
+    {
+      size_t const i = size_t(id);
+      if(i / 64 >= words.size())
+        this->reserve(id + 1);
+      uint64_t & word = words[i / 64];
+      uint64_t const bit = uint64_t(1) << (i % 64);
+      if(word & bit)
+        return;
+      if(!word)
+        used.push_back(i / 64);
+      word |= bit;
+      ++count;
+    }
+
+    bool contains(aux_t id) const
+    {
+      size_t const i = size_t(id);
+      return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1);
+    }
+
+    size_t size() const { return count; }
+
+    // Appends the IDs to @p ids in increasing order.
+    void get(std::vector<aux_t> & ids) const
+    {
+      for(size_t w=0; w<words.size(); ++w)
+      {
+        for(uint64_t bits = words[w]; bits; bits &= bits - 1)
+          ids.push_back(static_cast<aux_t>(w * 64 + __builtin_ctzll(bits)));
+      }
+    }
+
+    void clear()
+    {
+      for(size_t w: used)
+        words[w] = 0;
+      used.clear();
+      count = 0;
+    }
+
+  private:
+
+    std::vector<uint64_t> words;
+    // The indices of the nonzero words.
+    std::vector<size_t> used;
+    size_t count = 0;
+  };
+
   /**
    * @brief A memory pool with integrated garbage collection.
    *
    * Extends Boost.Pool (specifically for our type node) with an additional
    * member collect, which performs garbage collection through a mark-sweep
    * algorithm.
+   *
+   * Boost.Pool only supplies blocks.  The sweep records the free chunks in
+   * address order as runs of adjacent chunks, and nodes are allocated from
+   * one run at a time by bumping CyMem_AllocPtr.  Compiled code does the same
+   * inline (see rt_h::node_alloc).  When the run is exhausted, refill moves to
+   * the next one, and collects once none remain.
+   *
+   * A node with three or more successors may store them inline, in the
+   * chunks that follow its own (see inline_node_chunks).  It is allocated
+   * from a run long enough to hold it, and reserve skips shorter runs.  The
+   * marker marks its chunks with it, so the sweep keeps them.  Only the
+   * first chunk is a node in the sense of Cy_IsNode.
+   *
+   * When built with -DLAZYSWEEP, a collection only marks.  Each call to refill
+   * sweeps forward from where the last one stopped until it finds the next run
+   * of free chunks, freeing dead nodes and clearing marks on the way.  The
+   * pause is then the mark phase alone, and the sweep visits memory just
+   * before it is allocated.
+   *
+   * When built with -DGENGC, the collector is generational.  Nodes allocated
+   * since the last collection form the nursery.  They come from the runs of
+   * chunks freed by that collection.  A minor collection marks only young nodes, starting
+   * from the roots and the remembered set, and sweeps only the nursery.
+   * Survivors stay in place.  They are promoted to the old generation after
+   * surviving SPRITE_GC_PROMOTE_AGE minor collections.  A full collection
+   * runs once the old generation has doubled since the last one.
+   *
+   * Old nodes are never traced by a minor collection, so every store of a
+   * young node into an old one must be recorded.  The write barrier
+   * (CyMem_WriteBarrier and rt_h::write_barrier) adds such nodes to
+   * CyMem_Remembered.
+   *
+   * The heap grows when a collection leaves more than SPRITE_HEAP_OCCUPANCY
+   * percent of it live.  It shrinks after a full collection that leaves it
+   * larger than the occupancy target calls for: the oldest blocks, up to the
+   * target, stay active, and the rest become idle.  The sweep frees the dead
+   * nodes of idle blocks but allocates nothing from them, so they drain.  An
+   * idle block left entirely free is released: its pages are returned to the
+   * OS.  When the heap must grow, idle and released blocks are reused before
+   * any new block is allocated.  Under LAZYSWEEP, blocks are released only,
+   * never idle.
+   *
+   * The heap never grows past SPRITE_HEAP_MAX_MB.  When no chunk is left at
+   * that size, the running computation fails (see CyMem_HeapExhausted).
+   *
+   * Nodes allocated from free runs end up scattered, so traversing one data
+   * structure touches many pages.  When SPRITE_GC_COMPACT is set and a full
+   * collection finds the live nodes spread too thinly, compact_nodes copies
+   * them, depth first from the roots, into released blocks or a new one, and
+   * releases the rest.  A list then lies in order in memory.  Copying must
+   * update every reference, and fiber stacks are scanned only conservatively,
+   * so Cy_Eval calls it only between steps when no fiber is suspended.  Under
+   * the fair and breadth-first schedulers, a preempted computation keeps its
+   * fiber suspended until it finishes.  Compaction therefore rarely runs in
+   * those searches.  It is effective for deterministic programs and under
+   * depth-first search, which never preempts.
    */
   template<typename UserAllocator = boost::default_user_allocator_new_delete>
   struct NodePool : public boost::pool<UserAllocator>
@@ -110,85 +371,468 @@ namespace sprite { namespace compiler
         size_type nrequested_size
       , size_type nnext_size = 32
       , size_type nmax_size = 0
-      )
-    : base_type(nrequested_size, nnext_size, nmax_size)
-    {
-      assert(nnext_size > 0);
-    }
+      );
 
-    // pre: !this->store().empty() (same as !!CyMem_FreeList)
-    void * malloc BOOST_PREVENT_MACRO_SUBSTITUTION()
-      { return (this->store().malloc)(); }
+    // Install the next run of free chunks as the allocation run.  Collects if
+    // there is none.  Called when CyMem_AllocPtr reaches CyMem_AllocLimit.
+    void refill();
+
+    // Installs a run of at least @p nchunks free chunks as the allocation
+    // run.  Shorter runs are skipped and found again by the next sweep.
+    // Collects, and then grows the heap, if none is left.  Called when the
+    // allocation run is too short for a node storing its successors inline.
+    void reserve(size_t nchunks);
 
     // Perform collection and maybe allocate a new block.
     void collect();
 
+    // True if the last collection found the live choice IDs to be sparse.
+    // See compact_ids.
+    bool wants_id_compaction() const { return compact_ids_pending; }
+
+    // Perform collection and renumber the live choice and free variable IDs
+    // densely from zero.  This rewrites every ID in the program, so the only
+    // IDs may be those held by the heap and the work queues.  It is called
+    // between steps of the outermost Cy_Eval.  Suspended fibers may exist,
+    // since compiled code reads IDs from nodes again after any safepoint (see
+    // compile_generator).
+    void compact_ids();
+
+    // True if the last full collection found the live nodes scattered over
+    // the heap.  See compact_nodes.
+    bool wants_node_compaction() const { return compact_nodes_pending; }
+
+    // Perform collection and move the live nodes together, in depth-first
+    // order from the roots.  Every reference to a moved node is updated, so
+    // the only references may be those held by the heap, the roots, the work
+    // queues, and the constraint stores.  It is called between steps of the
+    // outermost Cy_Eval when no fiber is suspended.
+    void compact_nodes();
+
   private:
-    // Run the collector.  Returns the number of chunks freed and a pointer
-    // to the first chunk freed.
-    std::pair<size_type,void*> collect_only();
+    // Run the full collector.  Returns the number of free chunks.
+    size_type collect_only(bool compact = false);
+
+    // Adds the roots of every computation to roots.
+    void add_roots();
+
+    // Adds the nodes referenced from fiber stacks to roots.
+    void add_stack_roots();
+
+    // Renumbers IDs during compact_ids.  used_ids holds the IDs of the live
+    // nodes, which are listed in id_nodes.
+    void renumber_ids();
+
+    // Calls CyMem_IdsExhausted if aux_t could overflow before the next
+    // collection.
+    void check_id_headroom() const;
+
+    // Reactivates the oldest idle or released block, or else allocates a new
+    // block of at least @p min_chunks chunks and clears them.  The free chunks
+    // go to the allocator: to the runs, or under LAZYSWEEP, straight to the
+    // allocation run.  Returns false if the heap limit or memory is
+    // exhausted.
+    bool grow(size_t min_chunks = 0);
+
+    // Allocates a new active block of @p chunks chunks.  Returns false if
+    // memory is exhausted.
+    bool add_block(size_t chunks);
+
+    // Returns the pages of block @p b, which must hold no nodes, to the OS.
+    void release_pages(size_t b);
+
+    // Called after a full mark.  Keeps the oldest blocks, up to @p keep
+    // chunks, active.  Makes the rest idle, and releases those left entirely
+    // free.
+    void retire_blocks(size_t keep);
+
+    // The number of chunks in all blocks.
+    size_t heap_chunks = 0;
+
+    // Supplies the blocks.
+    Cy_Arena arena;
+
+    // The mark bits of every block.
+    Cy_MarkBits marks;
+
+    // The state of each block, by its index in marks.blocks().  See
+    // retire_blocks.
+    enum BlockState : char
+    {
+      // Allocated from.
+      BLOCK_ACTIVE
+      // Not allocated from.  The sweep frees its dead nodes.
+    , BLOCK_IDLE
+      // Not allocated from.  Holds no nodes, and its pages were returned to
+      // the OS.  Not swept.
+    , BLOCK_RELEASED
+    };
+    std::vector<BlockState> block_states;
+
+    // The number of chunks in idle and released blocks.
+    size_t inactive_chunks = 0;
+
+    // The size, in chunks, of the last block allocated.
+    size_t last_block = 0;
+
+    bool compact_ids_pending = false;
+    bool compact_nodes_pending = false;
+
+    // The bookkeeping of a collection.  It is kept between collections, so
+    // that a collection allocates nothing once these have grown to size.
+    std::vector<node*> roots;
+    // The live nodes holding choice or variable IDs, and those IDs.
+    std::vector<node*> id_nodes;
+    Cy_IdSet used_ids;
+
+    #ifdef LAZYSWEEP
+    // Sweeps up to the end of the next run of free chunks and installs it.
+    // Returns false if the sweep reached the end of the heap first.
+    bool sweep_next_run();
+
+    // The index in marks.blocks() of the block being swept, and of the next
+    // chunk to sweep in it.  Blocks added after the last mark, at sweep_limit
+    // and beyond, are not swept.
+    size_t sweep_block = 0;
+    size_t sweep_index = 0;
+    size_t sweep_limit = 0;
+    #else
+    // Installs the next run freed by the last collection.  Returns false if
+    // none remain.
+    bool install_next_run();
+
+    // Replaces the runs with those built by a sweep.  Returns the number of
+    // chunks in them.
+    size_type finish_sweep(
+        Cy_RunBuilder & freed, std::vector<Cy_ChunkRun> & new_runs
+      );
+
+    // The runs of chunks freed by the last collection, and the next one to
+    // allocate from.  Under GENGC, they are the nursery.
+    std::vector<Cy_ChunkRun> runs;
+    size_t next_run = 0;
+
+    // The runs of the collection before, whose storage the next sweep reuses.
+    std::vector<Cy_ChunkRun> spare_runs;
+    #endif
+
+    #ifdef GENGC
+    // Run a minor collection.  Returns the same as collect_only.
+    size_type collect_young();
+
+    // Young nodes that survived a minor collection without being promoted.
+    std::vector<node*> young;
+
+    // The bookkeeping of a minor collection, kept as roots is.
+    std::vector<node*> remembered;
+    std::vector<node*> survivors;
+    std::vector<node*> promoted;
+
+    // The number of old nodes, counting promoted nodes that may have died
+    // since the last full collection.
+    size_t old_count = 0;
+
+    // The value of old_count that triggers a full collection.
+    size_t major_threshold = 0;
+    #endif
   };
 
-  // pre: the free list must be empty.
-  // post: the free list may not be empty.
+  // The smallest next choice ID at which compaction is considered.  Set by
+  // SPRITE_COMPACT_IDS (default: 65536).  Zero disables compaction.
+  inline aux_t Cy_CompactIdsThreshold()
+  {
+    static aux_t const value = []
+    {
+      char const * str = getenv("SPRITE_COMPACT_IDS");
+      long const n = str ? atol(str) : 65536;
+      return static_cast<aux_t>(n < 0 ? 0 : std::min<long>(n, 1L << 30));
+    }();
+    return value;
+  }
+
+  // The number of threads marking in a large heap.  Set by SPRITE_GC_THREADS
+  // (default: 1).  Each process started by SPRITE_THREADS has its own.
+  inline size_t Cy_GcThreads()
+  {
+    static size_t const value = []
+    {
+      char const * str = getenv("SPRITE_GC_THREADS");
+      long const n = str ? atol(str) : 1;
+      return static_cast<size_t>(std::min<long>(std::max<long>(n, 1), 64));
+    }();
+    return value;
+  }
+
+  // Heaps smaller than this many chunks are marked by one thread.  Waking the
+  // helpers would cost more than it saves.
+  size_t const CY_GC_PARALLEL_MIN = 1 << 18;
+
+  inline size_t Cy_GcMarkThreads(size_t heap_chunks)
+    { return heap_chunks < CY_GC_PARALLEL_MIN ? 1 : Cy_GcThreads(); }
+
+  // The size, in chunks, of the first block.  Set by SPRITE_HEAP_INITIAL_KB
+  // (default: 8).  The heap is not shrunk below this.
+  inline size_t Cy_HeapInitialChunks()
+  {
+    static size_t const value = []
+    {
+      char const * str = getenv("SPRITE_HEAP_INITIAL_KB");
+      long const kb = str ? atol(str) : 8;
+      return std::max<size_t>(1024 * std::max<long>(kb, 0) / NODE_BYTES, 64);
+    }();
+    return value;
+  }
+
+  // The largest heap, in chunks.  Set by SPRITE_HEAP_MAX_MB (default: 0,
+  // meaning no limit).
+  inline size_t Cy_HeapMaxChunks()
+  {
+    static size_t const value = []
+    {
+      char const * str = getenv("SPRITE_HEAP_MAX_MB");
+      long const mb = str ? atol(str) : 0;
+      return mb <= 0 ? 0 : (size_t(mb) << 20) / NODE_BYTES;
+    }();
+    return value;
+  }
+
+  // The largest fraction of the heap that may be live after a collection
+  // before the heap grows.  Set by SPRITE_HEAP_OCCUPANCY, a percentage from 1
+  // to 95 (default: 3.125, or one part in 32).
+  inline double Cy_HeapOccupancy()
+  {
+    static double const value = []
+    {
+      char const * str = getenv("SPRITE_HEAP_OCCUPANCY");
+      double const pct = str ? atof(str) : 3.125;
+      return std::min(std::max(pct, 1.0), 95.0) / 100;
+    }();
+    return value;
+  }
+
+  // The factor by which each new block is larger than the last.  Set by
+  // SPRITE_HEAP_GROWTH, from 1 to 16 (default: 2).
+  inline double Cy_HeapGrowth()
+  {
+    static double const value = []
+    {
+      char const * str = getenv("SPRITE_HEAP_GROWTH");
+      double const factor = str ? atof(str) : 2;
+      return std::min(std::max(factor, 1.0), 16.0);
+    }();
+    return value;
+  }
+
+  // Whether node blocks may be backed by transparent huge pages.  Set by
+  // SPRITE_HEAP_HUGEPAGES (default: 1).
+  inline bool Cy_HeapHugePages()
+  {
+    static bool const value = []
+    {
+      char const * str = getenv("SPRITE_HEAP_HUGEPAGES");
+      return !str || atol(str) != 0;
+    }();
+    return value;
+  }
+
+  // The address space reserved at a time for node blocks, when the heap has
+  // no limit.  It costs nothing until used.
+  size_t const CY_HEAP_RESERVE = size_t(64) << 30;
+
+  // Node compaction is requested after a full collection that leaves more
+  // than this fraction of the spans holding live nodes unused.  A span is the
+  // 64 chunks of one mark-bit word.  Set by SPRITE_GC_COMPACT, a percentage
+  // from 0 to 99 (default: 0, meaning never).  A pending compaction waits
+  // until no fiber is suspended, so under fair or breadth-first search it may
+  // never run (see NodePool).
+  inline double Cy_GcCompactThreshold()
+  {
+    static double const value = []
+    {
+      char const * str = getenv("SPRITE_GC_COMPACT");
+      double const pct = str ? atof(str) : 0;
+      return std::min(std::max(pct, 0.0), 99.0) / 100;
+    }();
+    return value;
+  }
+
+  // Heaps with fewer live nodes than this are not compacted.  They fit in the
+  // cache or the TLB anyway.
+  size_t const CY_GC_COMPACT_MIN = 1 << 16;
+
+  // Compaction is requested when fewer than one ID in this many is live, or
+  // when the next ID passes CY_COMPACT_IDS_LIMIT, to keep aux_t from
+  // overflowing.  It runs at the end of the current step.  A step that issues
+  // IDs past the maximum of aux_t before then stops the program (see
+  // check_id_headroom).
+  aux_t const CY_COMPACT_IDS_RATIO = 4;
+  aux_t const CY_COMPACT_IDS_LIMIT = aux_t(1) << 30;
+
+  #ifdef GENGC
+  // The number of chunks a minor collection must make available before the
+  // heap is grown.  Set by SPRITE_GC_NURSERY (default: 65536).
+  inline size_t Cy_GcNurserySize()
+  {
+    static size_t const value = []
+    {
+      char const * str = getenv("SPRITE_GC_NURSERY");
+      long const n = str ? atol(str) : 65536;
+      return static_cast<size_t>(std::max<long>(n, 256));
+    }();
+    return value;
+  }
+
+  // The number of minor collections a node must survive to be promoted.  Set
+  // by SPRITE_GC_PROMOTE_AGE, from 1 to 3 (default: 2).
+  inline int Cy_GcPromoteAge()
+  {
+    static int const value = []
+    {
+      char const * str = getenv("SPRITE_GC_PROMOTE_AGE");
+      long const n = str ? atol(str) : 2;
+      return static_cast<int>(std::min<long>(std::max<long>(n, 1), 3));
+    }();
+    return value;
+  }
+
+  // A full collection runs when the old generation has grown by this factor
+  // since the last one.
+  size_t const CY_GC_MAJOR_RATIO = 2;
+  #endif
+
   template<typename UserAllocator>
-  std::pair<typename NodePool<UserAllocator>::size_type, void *>
-  NodePool<UserAllocator>::collect_only()
+  NodePool<UserAllocator>::NodePool(
+      size_type nrequested_size, size_type nnext_size, size_type nmax_size
+    )
+  : base_type(nrequested_size, nnext_size, nmax_size)
+  , arena(
+        Cy_HeapMaxChunks()
+          ? Cy_HeapMaxChunks() * this->alloc_size() : CY_HEAP_RESERVE
+      , Cy_HeapHugePages()
+      )
   {
-    #if VERBOSEGC > 0
-      n_gc++;
-      ticks t0 = getticks();
-    #endif
+    assert(nnext_size > 0);
+  }
 
-    #if VERBOSEGC > 1
-      std::cout << "\nStarting collection." << std::endl;
-    #endif
-  
-    // Mark phase.
-    std::deque<node*> roots;
+  // A suspended computation may hold the only reference to a node that
+  // another computation has since disconnected from the graph.  Fiber stacks
+  // have no maps, so they are scanned conservatively: every word that points
+  // into a node block keeps the node containing it.  That may be a node
+  // storing its successors inline, when the word points into one of the
+  // chunks that follow its own.  Such a chunk begins with a successor, not a
+  // vtable, so it is recognized by its first word pointing into a node block.
+  // The owner is the nearest node before it, if it covers the chunk.
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::add_stack_roots()
+  {
+    auto const begins_node = [&](node * node_p)
+      { return !marks.find(node_p->vptr) && Cy_IsNode(node_p); };
 
-    // Add computation roots.
+    Fiber::for_each_stack(
+        [&](void * low, void * high)
+        {
+          // Volatile, since these words belong to no object here.
+          char * volatile * p = static_cast<char * volatile *>(low);
+          for(; p < high; ++p)
+          {
+            char * const word = *p;
+            Cy_MarkBits::Block const * block = marks.find(word);
+            if(!block)
+              continue;
+            size_t const i = block->index(word);
+            size_t const first =
+                i < INLINE_NODE_MAX_CHUNKS ? 0 : i + 1 - INLINE_NODE_MAX_CHUNKS;
+            for(size_t j = i + 1; j-- > first;)
+            {
+              node * const node_p = block->at(j);
+              if(!begins_node(node_p))
+                continue;
+              // Skip free and uninitialized chunks.  See collect_only.
+              if((j == i || j + Cy_NodeChunks(node_p) > i) && !block->test(j))
+                roots.push_back(node_p);
+              break;
+            }
+          }
+        }
+      );
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::add_roots()
+  {
+    // Add computation roots.  Short-circuit FWD nodes in the expressions of
+    // computations that have not started.  Cy_Eval keeps a copy of the
+    // expression of a running one on the main stack, which is not scanned.
+    size_t & fwd_hops = Cy_Marker::get().fwd_hops;
     Cy_ComputationFrame * frame = Cy_GlobalComputations;
     while(frame)
     {
-      for(auto const & comp: *frame->computation)
+      roots.push_back(frame->root);
+      for(Cy_EvalFrame & comp: *frame->computation)
+      {
+        if(!comp.fiber)
+          fwd_hops += marker::short_circuit(&comp.expr);
         roots.push_back(comp.expr);
+      }
       frame = frame->next;
     }
 
-    // Add roots from the temporary stack.
-    for(node * p: CyMem_Roots)
+    // Add roots from the temporary stack, including those saved by suspended
+    // fibers.  A FWD node short-circuited here stays alive while a fiber
+    // stack holds it.  Roots pushed from the main stack only hold new nodes
+    // while allocating, so none is FWD.
+    for(node *& p: CyMem_Roots)
+    {
+      fwd_hops += marker::short_circuit(&p);
       roots.push_back(p);
-
-    // Use this to remember which IDs were reachable.
-    std::unordered_set<aux_t> used_ids;
-
-    while(!roots.empty())
+    }
+    for(Fiber * fiber: Fiber::all())
     {
-      node * parent = roots.back();
-      roots.pop_back();
+      for(node *& p: fiber->saved_roots())
+      {
+        fwd_hops += marker::short_circuit(&p);
+        roots.push_back(p);
+      }
+    }
+    this->add_stack_roots();
+  }
 
-      if(parent->mark == 1)
-        continue;
+  // post: the allocation run is empty.
+  template<typename UserAllocator>
+  typename NodePool<UserAllocator>::size_type
+  NodePool<UserAllocator>::collect_only(bool compact)
+  {
+    #if VERBOSEGC > 0
+      n_gc++;
+      ticks t0 = getticks();
+    #endif
 
-      #if VERBOSEGC > 2
-        std::cout
-            << "   [mark] @" << parent << " " << parent->vptr->label(parent)
-            << std::endl;
-      #endif
+    #if VERBOSEGC > 1
+      std::cout << "\nStarting collection." << std::endl;
+    #endif
 
-        if(parent->tag == CHOICE || parent->tag == FREE)
-          used_ids.insert(parent->aux);
+    // The rest of the allocation run is free.  The sweep finds it again.
+    Cy_InstallRun(nullptr, nullptr);
 
-        parent->mark = 1;
-        node ** begin, ** end;
-        parent->vptr->gcsucc(parent, &begin, &end);
-        for(; begin!=end; ++begin)
-        {
-          if((*begin)->mark == 0)
-            roots.push_back(*begin);
-        }
-    }
+    #ifdef LAZYSWEEP
+      // Finish the last sweep, so that every unmarked chunk is free and no
+      // mark is left over.
+      while(this->sweep_next_run()) {}
+      Cy_InstallRun(nullptr, nullptr);
+    #endif
+  
+    // Mark phase.
+    marks.clear();
+    this->add_roots();
+
+    // Remember which IDs were reachable, and the nodes holding them.
+    size_t const live __attribute__((unused)) = Cy_Marker::get().mark(
+        marks, roots, 0, &id_nodes, Cy_GcMarkThreads(heap_chunks)
+      );
+    roots.clear();
+    used_ids.reserve(Cy_NextChoiceId);
+    for(node * node_p: id_nodes)
+      used_ids.insert(node_p->aux);
 
     #if VERBOSEGC > 1
       ticks tm = getticks();
@@ -196,43 +840,45 @@ namespace sprite { namespace compiler
     #endif
 
     // Sweep phase.  Sweep bindings first.  Eliminate bindings for IDs that
-    // don't appear anywhere in the program.
-    std::unordered_set<void const *> done;
+    // don't appear anywhere in the program.  Maps and buckets may be shared,
+    // so each is swept once.
+    size_t const stamp = shared::new_stamp();
     std::vector<aux_t> to_erase;
 
     #if VERBOSEGC > 1
     size_t bindings_removed = 0;
     size_t buckets_removed = 0;
     #endif
-    frame = Cy_GlobalComputations;
+    Cy_ComputationFrame * frame = Cy_GlobalComputations;
     while(frame)
     {
       for(auto const & comp: *frame->computation)
       {
         auto & constraints = comp.constraints.gc_write();
+        if(!constraints.eq_var.gc_visit(stamp))
+          continue;
         for(auto & binding: constraints.eq_var.gc_write())
         {
-          if(done.insert(&binding).second)
+          auto & bucket = binding.second.gc_write();
+          if(binding.second.gc_visit(stamp))
           {
-            auto & bucket = binding.second.gc_write();
             auto p = bucket.begin();
             auto out = p;
             auto end = bucket.end();
             for(; p!=end; ++p)
             {
-              if(done.insert(&*p).second)
-              {
-                if(used_ids.count(p->first->aux) && used_ids.count(p->second->aux))
-                  *out++ = *p;
-              }
+              if(used_ids.contains(p->first->aux)
+                  && used_ids.contains(p->second->aux)
+                )
+                *out++ = *p;
             }
             #if VERBOSEGC > 1
             bindings_removed += (end - out);
             #endif
             bucket.erase(out, end);
-            if(bucket.empty())
-              to_erase.push_back(binding.first);
           }
+          if(bucket.empty())
+            to_erase.push_back(binding.first);
         }
         #if VERBOSEGC > 1
         buckets_removed += to_erase.size();
@@ -244,8 +890,42 @@ namespace sprite { namespace compiler
       frame = frame->next;
     }
 
+    if(compact)
+      this->renumber_ids();
+    else
+    {
+      aux_t const threshold = Cy_CompactIdsThreshold();
+      compact_ids_pending = threshold && Cy_NextChoiceId >= threshold && (
+          Cy_NextChoiceId >= CY_COMPACT_IDS_LIMIT
+       || used_ids.size() * CY_COMPACT_IDS_RATIO < size_t(Cy_NextChoiceId)
+        );
+    }
+    this->check_id_headroom();
     used_ids.clear();
-    done.clear();
+    id_nodes.clear();
+
+    // Measure how scattered the live nodes are.  Compaction needs room for
+    // them outside the blocks that hold them.
+    compact_nodes_pending = false;
+    if(Cy_GcCompactThreshold() > 0 && live >= CY_GC_COMPACT_MIN)
+    {
+      size_t spans = 0;
+      size_t released = 0;
+      for(size_t b = 0; b < block_states.size(); ++b)
+      {
+        Cy_MarkBits::Block const & block = marks.blocks()[b];
+        if(block_states[b] == BLOCK_RELEASED)
+          released += block.size();
+        for(size_t w=0; w<block.nwords(); ++w)
+          spans += block.bits[w] != 0;
+      }
+      size_t const max = Cy_HeapMaxChunks();
+      bool const fits = !max
+          || released + (max > heap_chunks ? max - heap_chunks : 0) >= live;
+      size_t const needed = (live + 63) / 64;
+      compact_nodes_pending =
+          fits && needed < spans * (1 - Cy_GcCompactThreshold());
+    }
 
     #if VERBOSEGC > 1
       ticks tsb = getticks();
@@ -253,127 +933,906 @@ namespace sprite { namespace compiler
         << bindings_removed << " bindings and " << buckets_removed << " buckets."
         << std::endl;
     #endif
+    // Keep one growth step above the size the occupancy target calls for, so
+    // that the next collection does not grow the heap straight back.
+    size_t keep = std::max(
+        Cy_HeapInitialChunks()
+      , size_t(live / Cy_HeapOccupancy() * Cy_HeapGrowth())
+      );
+    #ifdef GENGC
+      keep = std::max(keep, live + Cy_GcNurserySize());
+    #endif
+    this->retire_blocks(keep);
+
+    size_t const total __attribute__((unused)) = heap_chunks - inactive_chunks;
+    #ifdef LAZYSWEEP
+      // The sweep runs as chunks are needed.  See sweep_next_run.
+      size_t const n = total - live;
+      sweep_block = 0;
+      sweep_index = 0;
+      sweep_limit = marks.blocks().size();
+    #else
+      // Every free chunk is unmarked, so the sweep adds it again.  Runs of
+      // free chunks are found a word of the bitmap at a time.
+      std::vector<Cy_ChunkRun> & new_runs = spare_runs;
+      new_runs.clear();
+      Cy_RunBuilder freed(new_runs, this->alloc_size());
+      for(size_t b=0; b<marks.blocks().size(); ++b)
+      {
+        if(block_states[b] == BLOCK_RELEASED)
+          continue;
+        bool const active = block_states[b] == BLOCK_ACTIVE;
+        Cy_MarkBits::Block const & block = marks.blocks()[b];
+        size_t const nchunks = block.size();
+        freed.cut();
+        for(size_t w=0; w<block.nwords(); ++w)
+        {
+          size_t const base = w * 64;
+          uint64_t const valid = nchunks - base >= 64
+              ? ~uint64_t(0) : (uint64_t(1) << (nchunks - base)) - 1;
+          uint64_t free_bits = ~block.bits[w] & valid;
+          while(free_bits)
+          {
+            size_t const first = __builtin_ctzll(free_bits);
+            uint64_t const rest = ~(free_bits >> first);
+            size_t const last = rest ? first + __builtin_ctzll(rest) : 64;
+            for(size_t i=base+first; i<base+last; ++i)
+            {
+              node * const node_p = block.at(i);
+              #if VERBOSEGC > 2
+                std::cout << "   [free] @" << node_p << " ";
+                if(Cy_IsNode(node_p))
+                {
+                  if(node_p->vptr == &CyVt_Fwd)
+                    std::cout << "<fwd>" << std::endl;
+                  else
+                    std::cout << node_p->vptr->label(node_p) << std::endl;
+                }
+                else
+                  std::cout << "<uninitialized>" << std::endl;
+              #endif
+
+              // When freeing a node with arity > 2, we must also free its
+              // successor list.  But the collector may run after some nodes
+              // have been allocated but before they are initialized.  So how
+              // can we tell the difference between initialized and
+              // uninitialized chunks?  We can use the fact that the first
+              // word of every chunk is a pointer.  The chunk is an
+              // initialized node, whose first word is a vtable pointer.  Or it
+              // was free when allocated, in which case the first word is null.
+              // Or it follows a node storing its successors inline, in which
+              // case the first word is a successor.  It is always possible to
+              // access the fourth entry in a vtable, and a node's slot1 is at
+              // the same position.  Slot1 of a node only ever holds a pointer
+              // to another node or a value, never &CyVt_Fwd, which is the
+              // sentinel of every vtable.  So a continuation chunk is not
+              // taken for a node.  See Cy_IsNode.
+              Cy_ReleaseChunk(node_p);
+            }
+            if(active)
+              freed.add_run(block.at(base+first), block.at(base+last));
+            free_bits &= last == 64 ? 0 : ~uint64_t(0) << last;
+          }
+
+          #if defined(GENGC) || VERBOSEGC > 2
+            for(uint64_t live_bits = block.bits[w] & valid; live_bits;
+                live_bits &= live_bits - 1
+              )
+            {
+              node * const node_p = block.at(base + __builtin_ctzll(live_bits));
+              // Skip the chunks holding inline successors.
+              if(!Cy_IsNode(node_p))
+                continue;
+              #if VERBOSEGC > 2
+                std::cout << "   [keep] @" << node_p << " "
+                  << node_p->vptr->label(node_p)
+                  << std::endl;
+              #endif
+              #ifdef GENGC
+                // Every survivor of a full collection is old.  Write only
+                // those that are not, to leave the rest of the lines clean.
+                if(node_p->mark != GC_OLD)
+                  node_p->mark = GC_OLD;
+              #endif
+            }
+          #endif
+        }
+      }
+      #ifdef GENGC
+        CyMem_Remembered.clear();
+        young.clear();
+        old_count = live;
+        major_threshold = std::max(live * CY_GC_MAJOR_RATIO, Cy_GcNurserySize());
+      #endif
+      size_t const n = this->finish_sweep(freed, new_runs);
+    #endif
     #if VERBOSEGC > 0
-      size_t total = 0;
+      ticks t1 = getticks();
+      gc_time += (t1-t0);
+      float const pct = total == 0 ? 0 : 100.0 * n / total;
+      gc_pct_sum += pct;
     #endif
-    size_t n = 0;
-    void * last = 0; // last item in the free list (first chunk freed).
-    // An iterator over the memory block list.
-    typedef boost::details::PODptr<size_type> blockptr;
-    const size_type partition_size = this->alloc_size();
-    for(blockptr ptr = this->list; ptr.valid(); ptr = ptr.next())
-    {
-      #if VERBOSEGC > 0
-        total += (ptr.end() - ptr.begin());
+
+    #if VERBOSEGC > 1
+      #ifdef LAZYSWEEP
+      std::cout << "Sweeping lazily." << std::endl;
+      #else
+      std::cout << "Sweep phase takes " << (t1-tsb) << " ticks." << std::endl;
       #endif
-      for(char * i = ptr.begin(); i != ptr.end(); i += partition_size)
+      std::cout << "Done collecting: freed " << n << " out of "
+        << total << " chunks (" << pct << "%); " << (total-n) << " remain."
+        << std::endl;
+    #endif
+    return n;
+  }
+  
+  #ifdef LAZYSWEEP
+  template<typename UserAllocator>
+  bool NodePool<UserAllocator>::sweep_next_run()
+  {
+    for(; sweep_block < sweep_limit; ++sweep_block, sweep_index = 0)
+    {
+      if(block_states[sweep_block] == BLOCK_RELEASED)
+        continue;
+      Cy_MarkBits::Block const & block = marks.blocks()[sweep_block];
+      size_t const first = block.find(sweep_index, false);
+      if(first == block.size())
+        continue;
+      size_t const last = block.find(first, true);
+      for(size_t i=first; i<last; ++i)
+      {
+        // See collect_only.
+        Cy_ReleaseChunk(block.at(i));
+      }
+      sweep_index = last;
+      Cy_InstallRun(
+          reinterpret_cast<char *>(block.at(first))
+        , reinterpret_cast<char *>(block.at(last))
+        );
+      return true;
+    }
+    return false;
+  }
+  #else
+  template<typename UserAllocator>
+  typename NodePool<UserAllocator>::size_type
+  NodePool<UserAllocator>::finish_sweep(
+      Cy_RunBuilder & freed, std::vector<Cy_ChunkRun> & new_runs
+    )
+  {
+    runs.swap(new_runs);
+    next_run = 0;
+    return freed.count;
+  }
+
+  template<typename UserAllocator>
+  bool NodePool<UserAllocator>::install_next_run()
+  {
+    if(next_run == runs.size())
+      return false;
+    Cy_InstallRun(runs[next_run].first, runs[next_run].second);
+    ++next_run;
+    return true;
+  }
+  #endif
+
+  #ifdef GENGC
+  // post: the allocation run is empty.
+  template<typename UserAllocator>
+  typename NodePool<UserAllocator>::size_type
+  NodePool<UserAllocator>::collect_young()
+  {
+    #if VERBOSEGC > 0
+      n_gc++;
+      n_minor_gc++;
+      ticks t0 = getticks();
+    #endif
+
+    // The rest of the allocation run is free.  The sweep finds it again.
+    Cy_InstallRun(nullptr, nullptr);
+
+    // Mark phase.  Old nodes are neither marked nor traced.
+    marks.clear();
+    this->add_roots();
+
+    // Bindings are swept only by full collections, which read the nodes they
+    // hold.  Keep those nodes until then.
+    size_t const stamp = shared::new_stamp();
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      for(auto const & comp: *frame->computation)
       {
-        node * const node_p = reinterpret_cast<node *>(i);
-        if(node_p->mark == 0)
+        if(!comp.constraints->eq_var.gc_visit(stamp))
+          continue;
+        for(auto const & binding: comp.constraints->eq_var.read())
         {
-          bool const is_node =
-              node_p->vptr && node_p->vptr->sentinel == &CyVt_Fwd;
-          #if VERBOSEGC > 2
-            std::cout << "   [free] @" << node_p << " ";
-            if(is_node)
+          if(!binding.second.gc_visit(stamp))
+            continue;
+          for(auto const & data: binding.second.read())
+          {
+            for(node * p: {data.first, data.second})
             {
-              if(node_p->vptr == &CyVt_Fwd)
-                std::cout << "<fwd>" << std::endl;
-              else
-                std::cout << node_p->vptr->label(node_p) << std::endl;
+              if(!(p->mark & GC_OLD) && Cy_IsNode(p))
+                roots.push_back(p);
             }
-            else
-              std::cout << "<uninitialized>" << std::endl;
+          }
+        }
+      }
+    }
 
+    // The successors of remembered nodes are roots.
+    remembered.swap(CyMem_Remembered);
+    node ** begin, ** end;
+    for(node * p: remembered)
+    {
+      p->mark &= ~GC_REMEMBERED;
+      p->vptr->gcsucc(p, &begin, &end);
+      roots.insert(roots.end(), begin, end);
+    }
 
-          #endif
-          ++n;
-          if(!last) last = node_p;
-
-          // When freeing a node with arity > 2, we must also free its
-          // successor list.  But the collector may run after some nodes have
-          // been allocated but before they are initialized.  So how can we
-          // tell the difference between initialized and uninitialized chunks?
-          // We can use the fact that the first word of every chunk is a
-          // pointer -- either the chunk is an initialized node, whose first
-          // word is a vtable pointer, or it came from the free list, in which
-          // case the first word points to another chunk.  In either case it is
-          // always possible to access the fourth word of the dereferenced
-          // pointer -- i.e., the position that would be slot1 if the pointer
-          // is to a node, or the fourth entry in the vtable if the pointer is
-          // to a vtable.  Since nodes may only contain pointers to other nodes
-          // in slot1, we can discriminate by placing an arbitrary sentinel
-          // value that is NOT a valid node pointer at the proper position of
-          // the vtable.  This implementation uses &CyVt_Fwd.
-          if(is_node)
-            node_p->vptr->destroy(node_p);
-          this->free(node_p);
+    Cy_Marker::get().mark(
+        marks, roots, GC_OLD, nullptr, Cy_GcMarkThreads(heap_chunks)
+      );
+    roots.clear();
+
+    #if VERBOSEGC > 1
+      ticks tm = getticks();
+    #endif
+
+    // Sweep phase.  Only the nursery and the unpromoted survivors of earlier
+    // minor collections hold young nodes.
+    size_type const partition_size = this->alloc_size();
+    int const promote_age = Cy_GcPromoteAge();
+    std::vector<Cy_ChunkRun> & new_runs = spare_runs;
+    new_runs.clear();
+    Cy_RunBuilder freed(new_runs, partition_size);
+    survivors.clear();
+    promoted.clear();
+    auto const sweep = [&](node * node_p, bool marked)
+    {
+      if(marked)
+      {
+        // The chunks holding inline successors go with their node.
+        if(!Cy_IsNode(node_p))
+          return;
+        int const age = ((node_p->mark & GC_AGE_MASK) >> GC_AGE_SHIFT) + 1;
+        if(age >= promote_age)
+        {
+          node_p->mark = GC_OLD;
+          promoted.push_back(node_p);
         }
         else
         {
-          #if VERBOSEGC > 2
-            std::cout << "   [keep] @" << node_p << " "
-              << node_p->vptr->label(node_p)
-              << std::endl;
-          #endif
-          node_p->mark = 0;
+          node_p->mark = static_cast<mark_t>(age << GC_AGE_SHIFT);
+          survivors.push_back(node_p);
         }
       }
+      else
+      {
+        // See collect_only.
+        Cy_ReleaseChunk(node_p);
+        freed.add(node_p);
+      }
+    };
+    for(Cy_ChunkRun const & run: runs)
+    {
+      // A run lies in one block.  See Cy_RunBuilder.
+      Cy_MarkBits::Block const * block = marks.find(run.first);
+      freed.cut();
+      for(size_t i=block->index(run.first), e=block->index(run.second); i!=e; ++i)
+        sweep(block->at(i), block->test(i));
+    }
+    for(node * node_p: young)
+    {
+      // The other chunks of a node that survived before were marked then, so
+      // they are outside the nursery.  Free them with it.
+      bool const marked = marks.test(node_p);
+      size_t const nchunks = marked ? 1 : Cy_NodeChunks(node_p);
+      freed.cut();
+      for(size_t k=0; k<nchunks; ++k)
+        sweep(node_p + k, marked);
+    }
+    young.swap(survivors);
+
+    // Old nodes that still reach young ones stay remembered.  Without
+    // unpromoted survivors there are none.
+    if(!young.empty())
+    {
+      auto const remember_if_needed = [&](node * p)
+      {
+        p->vptr->gcsucc(p, &begin, &end);
+        if(std::any_of(begin, end, [](node * q) { return !(q->mark & GC_OLD); }))
+          CyMem_Remember(p);
+      };
+      for(node * p: remembered)
+        remember_if_needed(p);
+      for(node * p: promoted)
+        remember_if_needed(p);
     }
+    remembered.clear();
+    old_count += promoted.size();
+
     #if VERBOSEGC > 0
       ticks t1 = getticks();
       gc_time += (t1-t0);
-      total /= partition_size;
-      float const pct = total == 0 ? 0 : 100.0 * n / total;
+      size_t const total = freed.count + promoted.size() + young.size();
+      float const pct = total == 0 ? 0 : 100.0 * freed.count / total;
       gc_pct_sum += pct;
     #endif
 
     #if VERBOSEGC > 1
-      std::cout << "Sweep phase takes " << (t1-tsb) << " ticks." << std::endl;
-      std::cout << "Done collecting: freed " << n << " out of "
-        << total << " chunks (" << pct << "%); " << (total-n) << " remain."
+      std::cout << "\nMinor collection: mark takes " << (tm-t0)
+        << " ticks; sweep takes " << (t1-tm) << " ticks.  Freed "
+        << freed.count << " of " << total << " young chunks (" << pct
+        << "%); promoted " << promoted.size() << "; " << young.size()
+        << " remain young; " << CyMem_Remembered.size() << " remembered."
         << std::endl;
     #endif
-    return std::make_pair(n,last);
+    return this->finish_sweep(freed, new_runs);
   }
-  
+  #endif
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::refill()
+  {
+    #ifdef LAZYSWEEP
+      if(this->sweep_next_run())
+        return;
+    #else
+      if(this->install_next_run())
+        return;
+    #endif
+    this->collect();
+    if(CyMem_AllocPtr == CyMem_AllocLimit)
+      CyMem_HeapExhausted();
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::reserve(size_t nchunks)
+  {
+    if(nchunks <= 1)
+      return this->refill();
+    size_t const bytes = nchunks * this->alloc_size();
+    auto const fits = [&]
+      { return size_t(CyMem_AllocLimit - CyMem_AllocPtr) >= bytes; };
+    auto const next = [&]
+    {
+      #ifdef LAZYSWEEP
+        return this->sweep_next_run();
+      #else
+        return this->install_next_run();
+      #endif
+    };
+    while(!fits() && next()) {}
+    if(fits())
+      return;
+    this->collect();
+    while(!fits() && next()) {}
+    // Each block holds a run of its own size once added, so growing ends
+    // with a run long enough or at the heap limit.
+    while(!fits() && this->grow(nchunks))
+    {
+      while(!fits() && next()) {}
+    }
+    if(!fits())
+      CyMem_HeapExhausted();
+  }
+
   template<typename UserAllocator>
   void NodePool<UserAllocator>::collect()
   {
-    // Run the collector.
-    std::pair<size_type,void *> const collected = collect_only();
-    size_type const nfree = collected.first;
-    void * last = collected.second;
+    // Run the collector.  The generational collector runs a full collection
+    // once the old generation has grown enough.
+    #ifdef GENGC
+      bool const full = old_count >= major_threshold;
+      size_type nfree = full ? collect_only() : collect_young();
+    #else
+      size_type const nfree = collect_only();
+    #endif
   
     // If too little space was made, then allocate a new block, too.  Do so if
-    // more than 1 part in 32 remains in use after collection, or if fewer than
-    // abs_min chunks were made available.
-    size_type const current_size = this->next_size - this->start_size;
-    size_type const threshold = current_size >> 5;
-    static size_type const abs_min = 256;
-    if(current_size - nfree >= threshold || nfree < abs_min)
-    {
-      // Save the free list and then set it to empty in this object.
-      void * const save_list = CyMem_FreeList;
-      CyMem_FreeList = nullptr;
-      assert(!save_list == !last); // both are null or both are non-null
-  
-      // This call will allocate a new block, since the free list is empty.
-      void * ret = base_type::malloc();
-      
-      // If the old free list was not empty, insert it before the new block.
-      if(last)
+    // more than Cy_HeapOccupancy of the heap remains in use after collection,
+    // or if fewer than abs_min chunks were made available.  The heap grows by
+    // one block per collection, so a burst of garbage does not leave it
+    // oversized.  The generational collector grows the heap when the nursery
+    // would be smaller than Cy_GcNurserySize.
+    #ifdef GENGC
+      bool const grow = nfree < Cy_GcNurserySize();
+      size_t const min_chunks = grow ? Cy_GcNurserySize() - nfree : 0;
+    #else
+      static size_type const abs_min = 256;
+      size_t const active = heap_chunks - inactive_chunks;
+      size_t const live = active - nfree;
+      bool const grow = live > active * Cy_HeapOccupancy() || nfree < abs_min;
+      size_t const min_chunks = 0;
+    #endif
+    bool const grew __attribute__((unused)) = grow && this->grow(min_chunks);
+
+    #ifdef GENGC
+      // At the heap limit, a full collection may free what a minor one could
+      // not.
+      if(!full && nfree == 0 && !grew)
+        collect_only();
+    #endif
+
+    #ifdef LAZYSWEEP
+      // The new block is allocated from first.
+      if(!grew)
+        this->sweep_next_run();
+    #else
+      // The new block follows the free chunks, in the nursery under GENGC.
+      this->install_next_run();
+    #endif
+  }
+
+  template<typename UserAllocator>
+  bool NodePool<UserAllocator>::grow(size_t min_chunks)
+  {
+    // Reactivate the oldest inactive block.  Its free chunks are those that
+    // are not nodes, other than those holding the inline successors of one,
+    // since the sweep freed its dead nodes.  A released block holds no nodes.
+    for(size_t b = 0; b < block_states.size(); ++b)
+    {
+      if(block_states[b] == BLOCK_ACTIVE)
+        continue;
+      Cy_MarkBits::Block const & block = marks.blocks()[b];
+      inactive_chunks -= block.size();
+      #ifdef LAZYSWEEP
+        // Only released blocks are inactive.  The sweep may not have passed
+        // this one yet.  Keep it away.
+        block_states[b] = BLOCK_ACTIVE;
+        block.fill();
+        Cy_InstallRun(block.begin, block.end);
+      #else
+        std::vector<Cy_ChunkRun> new_runs;
+        Cy_RunBuilder freed(new_runs, this->alloc_size());
+        for(size_t i=0; i<block.size();)
+        {
+          node * const node_p = block.at(i);
+          if(block_states[b] == BLOCK_RELEASED || !Cy_IsNode(node_p))
+          {
+            freed.add(node_p);
+            ++i;
+          }
+          else
+            i += Cy_NodeChunks(node_p);
+        }
+        block_states[b] = BLOCK_ACTIVE;
+        runs.insert(runs.end(), new_runs.begin(), new_runs.end());
+      #endif
+      return true;
+    }
+
+    // Each block is larger than the last by the growth factor, and no
+    // smaller than min_chunks, up to the heap limit.
+    size_t chunks = last_block
+        ? size_t(last_block * Cy_HeapGrowth()) : Cy_HeapInitialChunks();
+    chunks = std::max(chunks, min_chunks);
+    if(size_t const max = Cy_HeapMaxChunks())
+    {
+      if(heap_chunks >= max)
+        return false;
+      chunks = std::min(chunks, max - heap_chunks);
+    }
+
+    if(!this->add_block(chunks))
+      return false;
+    Cy_MarkBits::Block const & block = marks.blocks().back();
+    #ifdef LAZYSWEEP
+      Cy_InstallRun(block.begin, block.end);
+    #else
+      runs.emplace_back(block.begin, block.end);
+    #endif
+    return true;
+  }
+
+  template<typename UserAllocator>
+  bool NodePool<UserAllocator>::add_block(size_t chunks)
+  {
+    // The arena's pages read as zeros, so every chunk of the new block is
+    // free (see Cy_IsNode).  The block is not touched until it is allocated
+    // from.
+    size_type const partition_size = this->alloc_size();
+    char * const begin = arena.allocate(chunks * partition_size);
+    if(!begin)
+      return false;
+    last_block = chunks;
+    heap_chunks += last_block;
+    marks.add_block(begin, begin + chunks * partition_size);
+    block_states.push_back(BLOCK_ACTIVE);
+    this->check_id_headroom();
+    return true;
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::check_id_headroom() const
+  {
+    // Each ID is issued with a new node, so no more IDs than chunks are
+    // issued before the next collection.  aux_t must not wrap, since a
+    // wrapped ID would alias a live one.
+    uint64_t const max_id = std::numeric_limits<aux_t>::max();
+    if(uint64_t(Cy_NextChoiceId) + heap_chunks > max_id)
+      CyMem_IdsExhausted();
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::release_pages(size_t b)
+  {
+    // Return the whole pages.  They read as zeros when next touched, which
+    // leaves the chunks on them free.
+    static uintptr_t const page = sysconf(_SC_PAGESIZE);
+    Cy_MarkBits::Block const & block = marks.blocks()[b];
+    uintptr_t const lo =
+        (reinterpret_cast<uintptr_t>(block.begin) + page - 1) & ~(page - 1);
+    uintptr_t const hi = reinterpret_cast<uintptr_t>(block.end) & ~(page - 1);
+    if(lo < hi)
+      madvise(reinterpret_cast<void *>(lo), hi - lo, MADV_DONTNEED);
+    block_states[b] = BLOCK_RELEASED;
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::retire_blocks(size_t keep)
+  {
+    size_t active = 0;
+    inactive_chunks = 0;
+    for(size_t b = 0; b < block_states.size(); ++b)
+    {
+      Cy_MarkBits::Block const & block = marks.blocks()[b];
+      bool const in_use = block.find(0, true) != block.size();
+      bool keep_active = active < keep;
+      #ifdef LAZYSWEEP
+        keep_active = keep_active || in_use;
+      #endif
+      if(keep_active)
+      {
+        // A released block holds no nodes, and its pages read as zeros, so
+        // every chunk is free.
+        block_states[b] = BLOCK_ACTIVE;
+        active += block.size();
+        continue;
+      }
+      inactive_chunks += block.size();
+      if(in_use)
+        block_states[b] = BLOCK_IDLE;
+      else if(block_states[b] != BLOCK_RELEASED)
+      {
+        // The sweep will not see this block, so free its dead nodes now.
+        for(size_t i=0; i<block.size(); ++i)
+          Cy_ReleaseChunk(block.at(i));
+        this->release_pages(b);
+      }
+    }
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::compact_ids()
+  {
+    // The sweep finds every unmarked chunk, including those already free.  The
+    // next allocation installs a run.
+    this->collect_only(true);
+    compact_ids_pending = false;
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::compact_nodes()
+  {
+    // Afterward, only the live nodes are marked.
+    this->collect_only();
+    compact_nodes_pending = false;
+
+    #if VERBOSEGC > 0
+      ticks t0 = getticks();
+    #endif
+
+    // The nodes are moved out of the blocks that hold them, the from-space,
+    // into the released blocks, the to-space, plus a new block if those are
+    // too small.  The heap keeps its size.
+    size_t live = 0;
+    std::vector<size_t> from_space, to_space;
+    size_t to_chunks = 0;
+    for(size_t b = 0; b < block_states.size(); ++b)
+    {
+      Cy_MarkBits::Block const & block = marks.blocks()[b];
+      if(block_states[b] == BLOCK_RELEASED)
+      {
+        to_space.push_back(b);
+        to_chunks += block.size();
+      }
+      else
+      {
+        from_space.push_back(b);
+        for(size_t w=0; w<block.nwords(); ++w)
+          live += __builtin_popcountll(block.bits[w]);
+      }
+    }
+    // A node lies in one block, so the end of each block of the to-space may
+    // go unused.
+    size_t const needed =
+        live + (to_space.size() + 1) * (INLINE_NODE_MAX_CHUNKS - 1);
+    size_t const target = std::max(needed, heap_chunks - inactive_chunks);
+    if(to_chunks < target)
+    {
+      size_t chunks = target - to_chunks;
+      if(size_t const max = Cy_HeapMaxChunks())
+        chunks = std::min(chunks, max > heap_chunks ? max - heap_chunks : 0);
+      if(to_chunks + chunks < needed || !(chunks && this->add_block(chunks)))
+        return;
+      to_space.push_back(block_states.size() - 1);
+    }
+
+    // Free the dead nodes, so that only live ones remain.
+    #ifdef LAZYSWEEP
+      while(this->sweep_next_run()) {}
+    #endif
+    Cy_InstallRun(nullptr, nullptr);
+
+    // Allocates the next @p n chunks of the to-space.
+    size_t to_index = 0;
+    node * to_next = nullptr;
+    node * to_end = nullptr;
+    auto const allocate = [&](size_t n)
+    {
+      while(size_t(to_end - to_next) < n)
       {
-        this->nextof(last) = CyMem_FreeList;
-        CyMem_FreeList = save_list;
+        Cy_MarkBits::Block const & block = marks.blocks()[to_space[to_index++]];
+        to_next = block.at(0);
+        to_end = block.at(block.size());
       }
+      node * const q = to_next;
+      to_next += n;
+      return q;
+    };
 
-      // Put back the allocated chunk.
-      this->free(ret);
+    // Moves the node in @p slot and everything it reaches that has not moved
+    // yet, depth first, and updates the slots that refer to them.  A moved
+    // node is marked, has no vtable, and holds its new address in slot0.
+    // Chunks outside the from-space are unmarked, so a slot that already
+    // refers to the to-space is left alone, as is a dangling one.  A node
+    // storing its successors inline is moved with them.
+    size_t & fwd_hops = Cy_Marker::get().fwd_hops;
+    std::vector<node**> stack;
+    Cy_MarkBits::Block const * hint = nullptr;
+    node ** begin, ** end;
+    auto const move = [&](node ** root)
+    {
+      stack.push_back(root);
+      while(!stack.empty())
+      {
+        node ** const slot = stack.back();
+        stack.pop_back();
+        fwd_hops += marker::short_circuit(slot);
+        node * const p = *slot;
+        if(!hint || !hint->contains(p))
+          hint = marks.find(p);
+        if(!hint || !hint->test(hint->index(p)))
+          continue;
+        if(!p->vptr)
+        {
+          *slot = static_cast<node *>(p->slot0);
+          continue;
+        }
+        p->vptr->gcsucc(p, &begin, &end);
+        size_t const n = 1 + marker::extra_chunks(p, begin, end);
+        node * const q = allocate(n);
+        std::copy(p, p + n, q);
+        if(n > 1)
+          q->slot0 = &q->slot1;
+        for(size_t k=1; k<n; ++k)
+          p[k].vptr = nullptr;
+        p->vptr = nullptr;
+        p->mark = 0;
+        p->slot0 = q;
+        *slot = q;
+        // Push the successors in reverse, so that the first is moved next.
+        q->vptr->gcsucc(q, &begin, &end);
+        while(end != begin)
+          stack.push_back(--end);
+      }
+    };
+
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      move(&frame->root);
+      for(Cy_EvalFrame & comp: *frame->computation)
+        move(&comp.expr);
     }
+    for(node *& p: CyMem_Roots)
+      move(&p);
+    for(Fiber * fiber: Fiber::all())
+    {
+      for(node *& p: fiber->saved_roots())
+        move(&p);
+    }
+    size_t const stamp = shared::new_stamp();
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      for(Cy_EvalFrame & comp: *frame->computation)
+      {
+        auto const & vstore = comp.constraints->eq_var;
+        if(!vstore.gc_visit(stamp))
+          continue;
+        for(auto & binding: vstore.gc_write())
+        {
+          if(!binding.second.gc_visit(stamp))
+            continue;
+          for(ConstraintStore::BindData & data: binding.second.gc_write())
+          {
+            move(&data.first);
+            move(&data.second);
+          }
+        }
+      }
+    }
+
+    // The from-space holds no nodes now.  Every chunk is free or moved, and
+    // both have no vtable.
+    for(size_t b: from_space)
+    {
+      marks.blocks()[b].clear();
+      this->release_pages(b);
+    }
+    inactive_chunks = 0;
+    for(size_t b = 0; b < block_states.size(); ++b)
+    {
+      if(block_states[b] != BLOCK_ACTIVE)
+        inactive_chunks += marks.blocks()[b].size();
+    }
+
+    // Allocation continues after the moved nodes.
+    #ifndef LAZYSWEEP
+      runs.clear();
+    #endif
+    for(size_t i = 0; i < to_space.size(); ++i)
+    {
+      size_t const b = to_space[i];
+      Cy_MarkBits::Block const & block = marks.blocks()[b];
+      block_states[b] = BLOCK_ACTIVE;
+      size_t const used = i + 1 < to_index ? block.size()
+          : i + 1 == to_index ? block.index(to_next) : 0;
+      #ifdef LAZYSWEEP
+        // The sweep skips the moved nodes.
+        for(size_t k=0; k<used; ++k)
+          block.bits[k / 64] |= uint64_t(1) << (k % 64);
+      #else
+        if(used < block.size())
+          runs.emplace_back(
+              reinterpret_cast<char *>(block.at(used)), block.end
+            );
+      #endif
+    }
+    #ifdef LAZYSWEEP
+      sweep_block = sweep_index = 0;
+      sweep_limit = block_states.size();
+    #else
+      next_run = 0;
+    #endif
+
+    #if VERBOSEGC > 0
+      ticks const t1 = getticks();
+      gc_time += (t1-t0);
+      n_compactions++;
+    #endif
+    #if VERBOSEGC > 1
+      std::cout << "Compaction moved " << live << " chunks in " << (t1-t0)
+        << " ticks." << std::endl;
+    #endif
+  }
+
+  template<typename UserAllocator>
+  void NodePool<UserAllocator>::renumber_ids()
+  {
+    // Choice bindings may relate a live ID to one no longer held by any node.
+    // Keep those, too, since the equivalence remains in force.
+    std::unordered_map<void const *, ChoiceClasses> classes;
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      for(auto const & comp: *frame->computation)
+      {
+        ChoiceClasses const & eq_choice = comp.constraints->eq_choice;
+        if(!eq_choice.empty()
+            && classes.emplace(eq_choice.identity(), ChoiceClasses()).second
+          )
+        {
+          eq_choice.for_each(
+              [&](aux_t id, choice_classes::Entry const &)
+                { used_ids.insert(id); }
+            );
+        }
+      }
+    }
+
+    // Number the IDs in their original order.
+    std::vector<aux_t> ids;
+    ids.reserve(used_ids.size());
+    used_ids.get(ids);
+    std::unordered_map<aux_t, aux_t> remap;
+    remap.reserve(ids.size());
+    for(size_t i=0; i<ids.size(); ++i)
+      remap.emplace(ids[i], static_cast<aux_t>(i));
+    auto const renumber = [&](aux_t id) { return remap.find(id)->second; };
+
+    #if VERBOSEGC > 1
+      std::cout << "Renumbering " << ids.size() << " live IDs out of "
+        << Cy_NextChoiceId << "." << std::endl;
+    #endif
+
+    for(node * node_p: id_nodes)
+      node_p->aux = renumber(node_p->aux);
+
+    // Rewrite the fingerprints and constraint stores.  These are shared
+    // between frames, so each is rewritten once, in place.
+    size_t const stamp = shared::new_stamp();
+    for(Cy_ComputationFrame * frame = Cy_GlobalComputations; frame;
+        frame = frame->next
+      )
+    {
+      for(auto const & comp: *frame->computation)
+      {
+        if(comp.fingerprint.gc_visit(stamp))
+        {
+          Fingerprint & fp = comp.fingerprint.gc_write();
+          // Choices made on IDs that are no longer live are dropped.
+          Fingerprint compacted;
+          fp.for_each_choice(
+              [&](aux_t id, ChoiceState state)
+              {
+                auto p = remap.find(id);
+                if(p == remap.end())
+                  return;
+                if(state == ChoiceState::LEFT)
+                  compacted.set_left(p->second);
+                else
+                  compacted.set_right(p->second);
+              }
+            );
+          fp = std::move(compacted);
+        }
+
+        if(!comp.constraints.gc_visit(stamp))
+          continue;
+        ConstraintStore & constraints = comp.constraints.gc_write();
+
+        // Buckets hold nodes, which were renumbered above.  Only the keys
+        // change.  The binding sweep left no bucket for a dead variable.
+        auto & vstore = constraints.eq_var.gc_write();
+        if(constraints.eq_var.gc_visit(stamp) && !vstore.empty())
+        {
+          ConstraintStore::eq_var_map_t renumbered;
+          renumbered.reserve(vstore.size());
+          for(auto & binding: vstore)
+          {
+            auto p = remap.find(binding.first);
+            if(p != remap.end())
+              renumbered.emplace(p->second, std::move(binding.second));
+          }
+          vstore.swap(renumbered);
+        }
+
+        // Stores that shared choice classes share the renumbered copy.
+        if(!constraints.eq_choice.empty())
+        {
+          ChoiceClasses & renumbered =
+              classes.find(constraints.eq_choice.identity())->second;
+          if(renumbered.empty())
+            renumbered = constraints.eq_choice.renumber(renumber);
+          constraints.eq_choice = renumbered;
+        }
+      }
+    }
+
+    Cy_NextChoiceId = static_cast<aux_t>(ids.size());
   }
 
-  // Used when monitoring GC allocations.
+  // The allocator of the boost::pool base of NodePool.  Node blocks come from
+  // Cy_Arena, so this is unused.
   struct BaseAllocator
   {
     typedef std::size_t size_type;
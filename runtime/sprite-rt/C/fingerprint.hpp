@@ -1,4 +1,6 @@
-// Implements @p Fingerprint as a tree to minimize copying.
+// Implements @p TreeFingerprint as a tree to minimize copying.  @p
+// Fingerprint names the representation used by the runtime.  See
+// fingerprint_hamt.hpp for the alternative.
 //
 // The tree comprises branch nodes and (leaf) block nodes.  Only blocks contain
 // fingerprint data, indicating whether a particular choice has been made and
@@ -60,6 +62,7 @@
 #include <boost/integer.hpp>
 #include <boost/integer/static_log2.hpp>
 #include "boost-pool-1.46/pool.hpp"
+#include <unordered_set>
 
 // The results of using a fingerprint cache appear mixed but overall
 // beneficial.
@@ -216,7 +219,7 @@ namespace sprite { namespace compiler
   }
 
   // Implements the fingerprint as a tree structure.
-  struct Fingerprint
+  struct TreeFingerprint
   {
   private:
 
@@ -226,9 +229,9 @@ namespace sprite { namespace compiler
 
   public:
 
-    Fingerprint() {}
+    TreeFingerprint() {}
 
-    Fingerprint(Fingerprint const & arg)
+    TreeFingerprint(TreeFingerprint const & arg)
       : depth(arg.depth), id_bound(arg.id_bound), root(arg.root, depth)
     {
       #ifdef USE_FP_CACHE
@@ -236,7 +239,7 @@ namespace sprite { namespace compiler
       #endif
     }
 
-    Fingerprint(Fingerprint && arg)
+    TreeFingerprint(TreeFingerprint && arg)
       : depth(arg.depth), id_bound(arg.id_bound), root(arg.root, depth)
     {
       #ifdef USE_FP_CACHE
@@ -244,7 +247,7 @@ namespace sprite { namespace compiler
       #endif
     }
 
-    Fingerprint & operator=(Fingerprint const & arg)
+    TreeFingerprint & operator=(TreeFingerprint const & arg)
     {
       if(this != &arg)
       {
@@ -259,7 +262,7 @@ namespace sprite { namespace compiler
       return *this;
     }
 
-    Fingerprint & operator=(Fingerprint && arg)
+    TreeFingerprint & operator=(TreeFingerprint && arg)
       { return (*this = arg); }
 
     void set_left(aux_t id) { check_alloc(id); set_left_no_check(id); }
@@ -301,6 +304,10 @@ namespace sprite { namespace compiler
         }
         depth += 1;
         id_bound <<= FP_BRANCH_SHIFT;
+        #ifdef USE_FP_CACHE
+        // The cached block may have been the root.
+        cached_block = nullptr;
+        #endif
       }
     }
 
@@ -332,7 +339,15 @@ namespace sprite { namespace compiler
 
     size_t size() const { return id_bound - 1; }
 
-    ~Fingerprint() { root.branch->release(depth); }
+    // Calls fn(id, state) for every choice made, in increasing ID order.
+    // Shared subtrees found to be empty are skipped on later visits.
+    template<typename Fn> void for_each_choice(Fn && fn) const
+    {
+      std::unordered_set<Branch const *> empty;
+      for_each_choice_(root, depth, 0, empty, fn);
+    }
+
+    ~TreeFingerprint() { root.branch->release(depth); }
 
   private:
 
@@ -343,7 +358,7 @@ namespace sprite { namespace compiler
       fingerprints::cache_tries++;
       fingerprints::cache_total_depth += depth;
       #endif
-      if(cached_block && (id &~ FP_CACHE_TAG_MASK) == cache_tag)
+      if(cached_block && aux_t(id & FP_CACHE_TAG_MASK) == cache_tag)
       {
         #ifdef VERBOSEFP
         fingerprints::cache_hits++;
@@ -354,6 +369,47 @@ namespace sprite { namespace compiler
     }
     #endif
 
+    // Visits the subtree at @p node, which has @p level levels of branches
+    // above its blocks and holds the IDs starting at @p base.  Returns true if
+    // any choice was found.
+    template<typename Fn>
+    static bool for_each_choice_(
+        Node const & node, size_t level, aux_t base
+      , std::unordered_set<Branch const *> & empty, Fn & fn
+      )
+    {
+      if(level == 0)
+      {
+        Block const & block = node.block;
+        for(size_t offset=0; offset<FP_BLOCK_SIZE; ++offset)
+        {
+          if(block.used & (1 << offset))
+          {
+            fn(
+                base + aux_t(offset)
+              , (block.lr & (1 << offset)) ? ChoiceState::RIGHT : ChoiceState::LEFT
+              );
+          }
+        }
+        return block.used != 0;
+      }
+      Branch const * branch = node.branch;
+      if(empty.count(branch))
+        return false;
+      bool found = false;
+      aux_t const stride =
+          aux_t(1) << ((level-1) * FP_BRANCH_SHIFT + FP_BLOCK_SHIFT);
+      for(size_t i=0; i<FP_BRANCH_SIZE; ++i)
+      {
+        found |= for_each_choice_(
+            branch->next[i], level-1, base + i * stride, empty, fn
+          );
+      }
+      if(!found)
+        empty.insert(branch);
+      return found;
+    }
+
     // Locates the block containing @p id for read access.
     Block const & read_block(aux_t id) const
     {
@@ -362,15 +418,18 @@ namespace sprite { namespace compiler
       #endif
 
       Node * p = &root;
+      bool unique = true;
       for(depth_type i=depth-1; i>=0; --i)
       {
         auto selector = id >> (i * FP_BRANCH_SHIFT + FP_BLOCK_SHIFT);
         auto which = FP_BRANCH_MASK & selector;
+        unique = unique && p->branch->refcount == 1;
         p = &p->branch->next[which];
       }
       #ifdef USE_FP_CACHE
       cached_block = &p->block;
-      cache_tag = id &~ FP_CACHE_TAG_MASK;
+      cache_tag = aux_t(id & FP_CACHE_TAG_MASK);
+      cache_writable = unique;
       #endif
       return p->block;
     }
@@ -379,7 +438,7 @@ namespace sprite { namespace compiler
     Block & write_block(aux_t id) const
     {
       #ifdef USE_FP_CACHE
-      if(try_cache(id)) return *cached_block;
+      if(try_cache(id) && cache_writable) return *cached_block;
       #endif
 
       Node * p = &root;
@@ -392,7 +451,8 @@ namespace sprite { namespace compiler
       }
       #ifdef USE_FP_CACHE
       cached_block = &p->block;
-      cache_tag = id &~ FP_CACHE_TAG_MASK;
+      cache_tag = aux_t(id & FP_CACHE_TAG_MASK);
+      cache_writable = true;
       #endif
       return p->block;
     }
@@ -404,6 +464,10 @@ namespace sprite { namespace compiler
     // The tag associated with the cached block.  Ignored if @p cached_block is
     // null.
     mutable aux_t cache_tag;
+
+    // True if no other fingerprint shares the cached block, so that it may be
+    // written in place.  Copying a fingerprint clears the cache of both.
+    mutable bool cache_writable = false;
     #endif
 
     // Counts the number of levels of branches occurring above the blocks.  A
@@ -419,3 +483,124 @@ namespace sprite { namespace compiler
     mutable Node root;
   };
 }}
+
+#include "fingerprint_hamt.hpp"
+
+#ifdef RECORDFP
+#include <cstdio>
+#include <cstdlib>
+#endif
+
+namespace sprite { namespace compiler
+{
+  #ifdef RECORDFP
+  namespace fingerprints
+  {
+    // The trace file.  Named by SPRITE_FP_TRACE (default: fingerprint.trace).
+    inline FILE * trace_file()
+    {
+      static FILE * const file = []
+      {
+        char const * name = getenv("SPRITE_FP_TRACE");
+        FILE * f = fopen(name ? name : "fingerprint.trace", "w");
+        if(!f)
+        {
+          perror("SPRITE_FP_TRACE");
+          exit(EXIT_FAILURE);
+        }
+        return f;
+      }();
+      return file;
+    }
+
+    inline unsigned long next_trace_id()
+    {
+      static unsigned long next = 0;
+      return next++;
+    }
+  }
+
+  // Wraps a fingerprint representation and records every operation on it, one
+  // per line, for benchmarks/runtime/fingerprint.cpp to replay.  Fingerprints
+  // are numbered in order of creation.  The records are:
+  //
+  //     n A     Create A, empty.
+  //     c A B   Create A as a copy of B.
+  //     a A B   Assign B to A.
+  //     d A     Destroy A.
+  //     t A ID  Test choice ID in A.
+  //     l A ID  Set choice ID to LEFT in A.
+  //     r A ID  Set choice ID to RIGHT in A.
+  //
+  // Record with SPRITE_THREADS unset, since workers would share the file.
+  template<typename Impl> struct RecordedFingerprint
+  {
+    RecordedFingerprint() : trace_id(fingerprints::next_trace_id())
+      { record('n'); }
+
+    RecordedFingerprint(RecordedFingerprint const & arg)
+      : impl(arg.impl), trace_id(fingerprints::next_trace_id())
+      { record('c', arg.trace_id); }
+
+    RecordedFingerprint & operator=(RecordedFingerprint const & arg)
+    {
+      if(this != &arg)
+      {
+        impl = arg.impl;
+        record('a', arg.trace_id);
+      }
+      return *this;
+    }
+
+    ~RecordedFingerprint() { record('d'); }
+
+    void set_left(aux_t id) { record('l', id); impl.set_left(id); }
+    void set_right(aux_t id) { record('r', id); impl.set_right(id); }
+    void set_left_no_check(aux_t id)
+      { record('l', id); impl.set_left_no_check(id); }
+    void set_right_no_check(aux_t id)
+      { record('r', id); impl.set_right_no_check(id); }
+    void check_alloc(aux_t id) const { impl.check_alloc(id); }
+
+    ChoiceState test(aux_t id) const { record('t', id); return impl.test(id); }
+    ChoiceState test_no_check(aux_t id) const
+      { record('t', id); return impl.test_no_check(id); }
+    bool choice_is_made(aux_t id) const
+      { record('t', id); return impl.choice_is_made(id); }
+    bool choice_is_left_no_check(aux_t id) const
+      { record('t', id); return impl.choice_is_left_no_check(id); }
+
+    size_t size() const { return impl.size(); }
+
+    template<typename Fn> void for_each_choice(Fn && fn) const
+      { impl.for_each_choice(std::forward<Fn>(fn)); }
+
+  private:
+
+    void record(char op) const
+      { fprintf(fingerprints::trace_file(), "%c %lu\n", op, trace_id); }
+
+    void record(char op, unsigned long arg) const
+    {
+      fprintf(
+          fingerprints::trace_file(), "%c %lu %lu\n", op, trace_id, arg
+        );
+    }
+
+    Impl impl;
+    unsigned long trace_id;
+  };
+  #endif
+
+  #ifdef USE_FP_HAMT
+  using FingerprintImpl = HamtFingerprint;
+  #else
+  using FingerprintImpl = TreeFingerprint;
+  #endif
+
+  #ifdef RECORDFP
+  using Fingerprint = RecordedFingerprint<FingerprintImpl>;
+  #else
+  using Fingerprint = FingerprintImpl;
+  #endif
+}}
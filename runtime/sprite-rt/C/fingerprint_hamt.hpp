@@ -0,0 +1,424 @@
+// Implements @p HamtFingerprint, a fingerprint stored in a hash array mapped
+// trie (HAMT).
+//
+// The choice ID is its own hash.  The low FP_HAMT_LEAF_SHIFT bits of an ID
+// select a bit in a leaf, which holds 64 choices.  Working up from there, each
+// group of Shift bits selects a child of a branch, so each branch has up to
+// 2^Shift (16 or 32) children.  Compared to the 4-ary tree of 32-choice blocks
+// in fingerprint.hpp, this reaches one million choices in four levels rather
+// than eight.
+//
+// Branches are compressed.  A branch has a bitmap of its children and stores
+// only the children that are present, in order, so the position of a child is
+// the population count of the bitmap below its bit.  Subtrees that contain no
+// choice take no space.  The branches of the lowest level store their leaves
+// inline.
+//
+// Branches are shared between fingerprints, with reference counts.  A write
+// copies the shared branches on the path from the root to the leaf (path
+// copying); the rest of the trie stays shared.  Branches are allocated from
+// pools, one per branch size.
+//
+// The trie grows as larger IDs are written.  Reading an ID beyond the end of
+// the trie does not grow it.
+//
+// Define USE_FP_HAMT to use this representation in the runtime.  FP_HAMT_SHIFT
+// sets Shift (default: 4).
+//
+// This file is included from fingerprint.hpp.
+#pragma once
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#ifndef FP_HAMT_SHIFT
+#define FP_HAMT_SHIFT 4
+#endif
+
+namespace sprite { namespace compiler
+{
+  namespace fingerprints { namespace hamt
+  {
+    // Each leaf holds 64 choices.
+    auto constexpr FP_HAMT_LEAF_SHIFT = 6;
+    auto constexpr FP_HAMT_LEAF_MASK = (1u << FP_HAMT_LEAF_SHIFT) - 1;
+
+    // The bits of a leaf, as in fingerprints::Block.
+    struct Leaf
+    {
+      uint64_t used = 0;
+      uint64_t lr = 0;
+    };
+
+    // The header of a branch.  The children follow it: Leaf objects in the
+    // lowest level, Branch pointers elsewhere.
+    struct Branch
+    {
+      uint32_t refcount;
+      uint32_t bitmap;
+
+      Leaf * leaves() { return reinterpret_cast<Leaf *>(this + 1); }
+      Leaf const * leaves() const
+        { return reinterpret_cast<Leaf const *>(this + 1); }
+      Branch ** branches() { return reinterpret_cast<Branch **>(this + 1); }
+      Branch * const * branches() const
+        { return reinterpret_cast<Branch * const *>(this + 1); }
+
+      unsigned size() const { return __builtin_popcount(bitmap); }
+
+      // The position of the child for @p bit among the children present.
+      unsigned position(uint32_t bit) const
+        { return __builtin_popcount(bitmap & (bit - 1)); }
+    };
+
+    // Returns the number of bytes in a branch with @p n children.
+    inline size_t branch_bytes(unsigned n, bool leaves)
+      { return sizeof(Branch) + n * (leaves ? sizeof(Leaf) : sizeof(Branch *)); }
+
+    // Returns the pool for branches of @p bytes bytes.
+    inline boost::pool<> & branch_pool(size_t bytes)
+    {
+      static size_t const max_words =
+          branch_bytes(32, true) / sizeof(void *) + 1;
+      static boost::pool<> ** pools = new boost::pool<> *[max_words]();
+      size_t const words = bytes / sizeof(void *);
+      assert(words < max_words && bytes % sizeof(void *) == 0);
+      if(!pools[words])
+        pools[words] = new boost::pool<>(bytes);
+      return *pools[words];
+    }
+
+    inline Branch * branch_alloc(unsigned n, bool leaves, uint32_t bitmap)
+    {
+      void * p = branch_pool(branch_bytes(n, leaves)).malloc();
+      Branch * branch = static_cast<Branch *>(p);
+      branch->refcount = 1;
+      branch->bitmap = bitmap;
+      return branch;
+    }
+
+    // Frees the memory of @p branch without touching its children.
+    inline void branch_free(Branch * branch, bool leaves)
+      { branch_pool(branch_bytes(branch->size(), leaves)).free(branch); }
+
+    // Drops one reference to @p branch, which is at @p level (1 is lowest).
+    inline void branch_release(Branch * branch, unsigned level)
+    {
+      if(--branch->refcount == 0)
+      {
+        if(level > 1)
+        {
+          Branch ** child = branch->branches();
+          for(unsigned i=0, n=branch->size(); i<n; ++i)
+            branch_release(child[i], level - 1);
+        }
+        branch_free(branch, level == 1);
+      }
+    }
+
+    // Returns an unshared copy of @p branch with the child for @p bit present,
+    // consuming one reference to @p branch.  A new child is empty.
+    inline Branch * branch_unique(Branch * branch, unsigned level, uint32_t bit)
+    {
+      bool const leaves = level == 1;
+      bool const has_bit = branch->bitmap & bit;
+      if(branch->refcount == 1 && has_bit)
+        return branch;
+      unsigned const n = branch->size();
+      unsigned const pos = branch->position(bit);
+      Branch * copy = branch_alloc(n + !has_bit, leaves, branch->bitmap | bit);
+      size_t const width = leaves ? sizeof(Leaf) : sizeof(Branch *);
+      char const * src = reinterpret_cast<char const *>(branch + 1);
+      char * dst = reinterpret_cast<char *>(copy + 1);
+      if(has_bit)
+        memcpy(dst, src, n * width);
+      else
+      {
+        memcpy(dst, src, pos * width);
+        memcpy(dst + (pos + 1) * width, src + pos * width, (n - pos) * width);
+        if(leaves)
+          new(&copy->leaves()[pos]) Leaf();
+        else
+          copy->branches()[pos] = branch_alloc(0, level == 2, 0);
+      }
+      if(branch->refcount == 1)
+        branch_free(branch, leaves);
+      else
+      {
+        --branch->refcount;
+        if(!leaves)
+        {
+          Branch ** child = copy->branches();
+          for(unsigned i=0; i<n + !has_bit; ++i)
+          {
+            if(has_bit || i != pos)
+              ++child[i]->refcount;
+          }
+        }
+      }
+      return copy;
+    }
+  }}
+
+  // Implements the fingerprint as a HAMT with 2^Shift-way branches.
+  template<unsigned Shift> struct BasicHamtFingerprint
+  {
+  private:
+
+    static_assert(Shift > 0 && Shift <= 5, "the branch bitmap has 32 bits");
+
+    using Branch = fingerprints::hamt::Branch;
+    using Leaf = fingerprints::hamt::Leaf;
+    static auto constexpr LEAF_SHIFT = fingerprints::hamt::FP_HAMT_LEAF_SHIFT;
+    static auto constexpr LEAF_MASK = fingerprints::hamt::FP_HAMT_LEAF_MASK;
+    static auto constexpr BRANCH_MASK = (1u << Shift) - 1;
+
+  public:
+
+    BasicHamtFingerprint() {}
+
+    BasicHamtFingerprint(BasicHamtFingerprint const & arg)
+      : depth(arg.depth), leaf(arg.leaf), root(arg.root)
+    {
+      if(depth)
+        root->refcount++;
+    }
+
+    BasicHamtFingerprint & operator=(BasicHamtFingerprint const & arg)
+    {
+      if(this != &arg)
+      {
+        if(arg.depth)
+          arg.root->refcount++;
+        release();
+        depth = arg.depth;
+        leaf = arg.leaf;
+        root = arg.root;
+      }
+      return *this;
+    }
+
+    ~BasicHamtFingerprint() { release(); }
+
+    void set_left(aux_t id)
+    {
+      uint64_t const bit = uint64_t(1) << (id & LEAF_MASK);
+      Leaf & block = write_leaf(id);
+      block.used |= bit;
+      block.lr &= ~bit;
+    }
+
+    void set_right(aux_t id)
+    {
+      uint64_t const bit = uint64_t(1) << (id & LEAF_MASK);
+      Leaf & block = write_leaf(id);
+      block.used |= bit;
+      block.lr |= bit;
+    }
+
+    // The trie grows on write, so these are the same as the above.
+    void set_left_no_check(aux_t id) { set_left(id); }
+    void set_right_no_check(aux_t id) { set_right(id); }
+    void check_alloc(aux_t) const {}
+
+    ChoiceState test(aux_t id) const
+    {
+      Leaf const * block = find(id);
+      if(!block)
+        return ChoiceState::UNDETERMINED;
+      uint64_t const bit = uint64_t(1) << (id & LEAF_MASK);
+      if(!(block->used & bit))
+        return ChoiceState::UNDETERMINED;
+      return (block->lr & bit) ? ChoiceState::RIGHT : ChoiceState::LEFT;
+    }
+
+    ChoiceState test_no_check(aux_t id) const { return test(id); }
+
+    bool choice_is_made(aux_t id) const
+    {
+      Leaf const * block = find(id);
+      return block && (block->used & (uint64_t(1) << (id & LEAF_MASK)));
+    }
+
+    bool choice_is_left_no_check(aux_t id) const
+      { return test(id) == ChoiceState::LEFT; }
+
+    size_t size() const { return id_bound() - 1; }
+
+    // Calls fn(id, state) for every choice made, in increasing ID order.
+    template<typename Fn> void for_each_choice(Fn && fn) const
+    {
+      if(depth == 0)
+        for_each_leaf_choice(leaf, 0, fn);
+      else
+        for_each_choice_(root, depth, 0, fn);
+    }
+
+  private:
+
+    // The largest ID representable in the current trie, plus one.
+    uint64_t id_bound() const
+      { return uint64_t(1) << (LEAF_SHIFT + depth * Shift); }
+
+    // The index of the child of a branch at @p level that leads to @p id.
+    static unsigned index(aux_t id, unsigned level)
+      { return (id >> (LEAF_SHIFT + (level - 1) * Shift)) & BRANCH_MASK; }
+
+    void release()
+    {
+      if(depth)
+        fingerprints::hamt::branch_release(root, depth);
+      #ifdef USE_FP_CACHE
+      cached_leaf = nullptr;
+      #endif
+    }
+
+    // Locates the leaf containing @p id for read access.  Returns null if
+    // there is none, which means no choice in its range is made.
+    Leaf const * find(aux_t id) const
+    {
+      if(uint64_t(id) >= id_bound())
+        return nullptr;
+      if(depth == 0)
+        return &leaf;
+
+      #ifdef USE_FP_CACHE
+      #ifdef VERBOSEFP
+      fingerprints::cache_tries++;
+      fingerprints::cache_total_depth += depth;
+      #endif
+      if(cached_leaf && (id >> LEAF_SHIFT) == cache_tag)
+      {
+        #ifdef VERBOSEFP
+        fingerprints::cache_hits++;
+        #endif
+        return cached_leaf;
+      }
+      #endif
+
+      Branch const * p = root;
+      for(unsigned level=depth; ; --level)
+      {
+        uint32_t const bit = 1u << index(id, level);
+        if(!(p->bitmap & bit))
+          return nullptr;
+        unsigned const pos = p->position(bit);
+        if(level == 1)
+        {
+          #ifdef USE_FP_CACHE
+          cached_leaf = &p->leaves()[pos];
+          cache_tag = id >> LEAF_SHIFT;
+          #endif
+          return &p->leaves()[pos];
+        }
+        p = p->branches()[pos];
+      }
+    }
+
+    // Locates the leaf containing @p id for write access, growing the trie
+    // and copying shared branches as needed.
+    Leaf & write_leaf(aux_t id)
+    {
+      #ifdef USE_FP_CACHE
+      cached_leaf = nullptr;
+      #endif
+      while(uint64_t(id) >= id_bound())
+        grow();
+      if(depth == 0)
+        return leaf;
+
+      Branch ** slot = &root;
+      for(unsigned level=depth; ; --level)
+      {
+        uint32_t const bit = 1u << index(id, level);
+        Branch * p = *slot = fingerprints::hamt::branch_unique(*slot, level, bit);
+        unsigned const pos = p->position(bit);
+        if(level == 1)
+          return p->leaves()[pos];
+        slot = &p->branches()[pos];
+      }
+    }
+
+    // Adds a level above the root.  The old root becomes the first child, if
+    // it holds any choice.
+    void grow()
+    {
+      using namespace fingerprints::hamt;
+      if(depth == 0)
+      {
+        if(leaf.used)
+        {
+          root = branch_alloc(1, true, 1);
+          root->leaves()[0] = leaf;
+        }
+        else
+          root = branch_alloc(0, true, 0);
+        leaf = Leaf();
+      }
+      else if(root->bitmap)
+      {
+        Branch * const child = root;
+        root = branch_alloc(1, false, 1);
+        root->branches()[0] = child;
+      }
+      else
+      {
+        branch_release(root, depth);
+        root = branch_alloc(0, false, 0);
+      }
+      depth++;
+    }
+
+    template<typename Fn>
+    static void for_each_leaf_choice(Leaf const & block, aux_t base, Fn & fn)
+    {
+      for(uint64_t used = block.used; used; used &= used - 1)
+      {
+        unsigned const offset = __builtin_ctzll(used);
+        fn(
+            base + offset
+          , (block.lr & (uint64_t(1) << offset))
+                ? ChoiceState::RIGHT : ChoiceState::LEFT
+          );
+      }
+    }
+
+    template<typename Fn>
+    static void for_each_choice_(
+        Branch const * branch, unsigned level, aux_t base, Fn & fn
+      )
+    {
+      unsigned pos = 0;
+      for(uint32_t bits = branch->bitmap; bits; bits &= bits - 1, ++pos)
+      {
+        unsigned const i = __builtin_ctz(bits);
+        aux_t const child_base =
+            base + (aux_t(i) << (LEAF_SHIFT + (level - 1) * Shift));
+        if(level == 1)
+          for_each_leaf_choice(branch->leaves()[pos], child_base, fn);
+        else
+          for_each_choice_(branch->branches()[pos], level - 1, child_base, fn);
+      }
+    }
+
+    #ifdef USE_FP_CACHE
+    // The most recently read leaf, if any.  Cleared on every write, since a
+    // write may move the leaves of a branch.
+    mutable Leaf const * cached_leaf = nullptr;
+
+    // The ID of the cached leaf's first choice, shifted right by LEAF_SHIFT.
+    mutable aux_t cache_tag;
+    #endif
+
+    // The number of levels of branches above the leaves.
+    unsigned depth = 0;
+
+    // The root when the depth is zero.
+    Leaf leaf;
+
+    // The root when the depth is positive.
+    Branch * root = nullptr;
+  };
+
+  using HamtFingerprint = BasicHamtFingerprint<FP_HAMT_SHIFT>;
+}}
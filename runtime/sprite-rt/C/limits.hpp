@@ -0,0 +1,290 @@
+// This file may only be included from main.cpp.
+//
+// Implements the result limits of generated programs.
+//
+// The main function generated by scc passes its arguments to CyArgs_Parse.
+// The following options are recognized:
+//
+//     --max-values=N  Stop after N values have been printed.
+//     --timeout=MS    Stop after MS milliseconds of wall-clock time.
+//     --stats         Print a summary of value latencies and allocations to
+//                     stderr.
+//
+// A program that reaches a limit flushes its output and exits immediately.
+// The work queue and heap are released with the process rather than being
+// walked.
+//
+// The limits apply to the outermost call to Cy_Eval.  Their state lives in a
+// shared mapping, so that the values printed by all SPRITE_THREADS workers
+// count against the same limit.  Every worker arms its own timeout for the
+// same deadline, whatever the search strategy.
+#pragma once
+#include "timer.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+extern "C"
+{
+  extern volatile sig_atomic_t Cy_PreemptRequested;
+  uint64_t CyMem_ChunksAllocated();
+}
+
+namespace sprite { namespace compiler
+{
+  // Limits and value statistics.
+  struct Cy_LimitState
+  {
+    // The maximum number of values to print, or zero for no limit.
+    uint64_t max_values;
+    // The timeout, in milliseconds, or zero for no timeout.
+    uint64_t timeout_ms;
+    // Whether to print the summary.
+    bool report;
+    // Set when the program should stop.  1 means the value limit was
+    // reached; 2 means the timeout expired.
+    volatile sig_atomic_t stop;
+    // The number of values printed.
+    uint64_t count;
+    // Times, in nanoseconds since the program started.
+    uint64_t start_ns;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    // Gaps between consecutive values, in nanoseconds.
+    uint64_t min_gap_ns;
+    uint64_t max_gap_ns;
+    // Chunks allocated by SPRITE_THREADS workers that have exited.  A worker
+    // killed when the program stops early is not counted.
+    uint64_t worker_chunks;
+  };
+
+  enum { CY_STOP_NONE=0, CY_STOP_MAX_VALUES=1, CY_STOP_TIMEOUT=2 };
+
+  inline uint64_t Cy_NowNs()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // Returns the limit state.  It is created by the first call, before any
+  // worker is forked.
+  inline Cy_LimitState & Cy_Limits()
+  {
+    static Cy_LimitState * state = []
+    {
+      void * p = mmap(
+          nullptr, sizeof(Cy_LimitState), PROT_READ | PROT_WRITE
+        , MAP_SHARED | MAP_ANONYMOUS, -1, 0
+        );
+      if(p == MAP_FAILED)
+        _os_error("mmap");
+      Cy_LimitState * s = static_cast<Cy_LimitState *>(p);
+      memset(s, 0, sizeof(Cy_LimitState));
+      s->start_ns = Cy_NowNs();
+      return s;
+    }();
+    return *state;
+  }
+
+  inline bool Cy_StopRequested() { return Cy_Limits().stop != CY_STOP_NONE; }
+
+  // The timeout handler.  Safepoints notice the request through
+  // Cy_PreemptRequested.
+  inline void Cy_TimeoutHandler(int)
+  {
+    Cy_Limits().stop = CY_STOP_TIMEOUT;
+    Cy_PreemptRequested = 1;
+  }
+
+  // Installs the timeout handler.  Blocking system calls are restarted after
+  // the signal unless @p restart is false.
+  inline void Cy_TimeoutInstall(bool restart)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &Cy_TimeoutHandler;
+    sa.sa_flags = restart ? SA_RESTART : 0;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGALRM, &sa, nullptr))
+      _os_error("sigaction");
+  }
+
+  // Arms the timeout for the time remaining.  Timers are not inherited by
+  // forked workers, so each SPRITE_THREADS worker calls this when it starts.
+  inline void Cy_TimeoutArm()
+  {
+    Cy_LimitState & limits = Cy_Limits();
+    if(!limits.timeout_ms)
+      return;
+    uint64_t const deadline = limits.start_ns + limits.timeout_ms * 1000000ULL;
+    uint64_t const now = Cy_NowNs();
+    if(now >= deadline)
+    {
+      Cy_TimeoutHandler(SIGALRM);
+      return;
+    }
+    // The timer lives as long as the process.  The parent's timer does not
+    // exist in a worker, so it is not deleted.
+    Timer * timer = new Timer(SIGALRM, CLOCK_MONOTONIC);
+    (*timer)(Interval(deadline - now));
+  }
+
+  // Prints the summary, if requested.
+  inline void Cy_LimitsReport()
+  {
+    Cy_LimitState const & limits = Cy_Limits();
+    if(!limits.report)
+      return;
+    double const ms = 1e-6;
+    char const * reason =
+        limits.stop == CY_STOP_MAX_VALUES ? "max-values"
+      : limits.stop == CY_STOP_TIMEOUT ? "timeout"
+      : "exhausted";
+    fprintf(stderr, "====== Value Summary ======\n");
+    fprintf(stderr, "    Values                       : %llu\n"
+      , (unsigned long long) limits.count
+      );
+    if(limits.count)
+      fprintf(stderr, "    Time to first value (ms)     : %.3f\n"
+        , (limits.first_ns - limits.start_ns) * ms
+        );
+    if(limits.count > 1)
+    {
+      double const mean = 1.0 * (limits.last_ns - limits.first_ns)
+          / (limits.count - 1);
+      fprintf(stderr, "    Inter-value latency (ms)     : "
+          "min %.3f, mean %.3f, max %.3f\n"
+        , limits.min_gap_ns * ms, mean * ms, limits.max_gap_ns * ms
+        );
+    }
+    fprintf(stderr, "    Total time (ms)              : %.3f\n"
+      , (Cy_NowNs() - limits.start_ns) * ms
+      );
+    fprintf(stderr, "    Chunks allocated             : %llu\n"
+      , (unsigned long long) (CyMem_ChunksAllocated() + limits.worker_chunks)
+      );
+    fprintf(stderr, "    Stopped by                   : %s\n", reason);
+  }
+
+  // Adds the chunks allocated by a SPRITE_THREADS worker to the summary.
+  // Called just before the worker exits.
+  inline void Cy_LimitsWorkerExit()
+  {
+    Cy_LimitState & limits = Cy_Limits();
+    if(limits.report)
+      __sync_fetch_and_add(&limits.worker_chunks, CyMem_ChunksAllocated());
+  }
+
+  // Called under the output lock before a value is printed.  Returns false if
+  // the value should not be printed because the program is stopping.
+  inline bool Cy_LimitsTakeValue()
+  {
+    Cy_LimitState & limits = Cy_Limits();
+    if(limits.stop != CY_STOP_NONE)
+      return false;
+    ++limits.count;
+    return true;
+  }
+
+  // Called under the output lock after a value is printed.  Returns true if
+  // the value limit was reached.
+  inline bool Cy_LimitsValueDone()
+  {
+    Cy_LimitState & limits = Cy_Limits();
+    uint64_t const now = Cy_NowNs();
+    if(limits.count == 1)
+      limits.first_ns = now;
+    else
+    {
+      uint64_t const gap = now - limits.last_ns;
+      if(limits.count == 2 || gap < limits.min_gap_ns)
+        limits.min_gap_ns = gap;
+      if(gap > limits.max_gap_ns)
+        limits.max_gap_ns = gap;
+    }
+    limits.last_ns = now;
+    if(limits.max_values && limits.count >= limits.max_values)
+    {
+      limits.stop = CY_STOP_MAX_VALUES;
+      return true;
+    }
+    return false;
+  }
+
+  inline void Cy_ArgsUsage(FILE * stream, char const * program)
+  {
+    fprintf(stream,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "   --max-values=N\n"
+        "       Stop after N values have been printed.\n"
+        "   --timeout=MS\n"
+        "       Stop after MS milliseconds.\n"
+        "   --stats\n"
+        "       Print a summary of value latencies and allocations to stderr.\n"
+        "   -h, --help\n"
+        "       Display this help message.\n"
+      , program
+      );
+  }
+
+  // Parses a positive integer option argument.  Exits on error.
+  inline uint64_t Cy_ArgsNumber(char const * program, char const * arg)
+  {
+    char const * value = strchr(arg, '=');
+    if(value && *++value)
+    {
+      char * end;
+      errno = 0;
+      unsigned long long const n = strtoull(value, &end, 10);
+      if(!*end && !errno && n > 0 && *value != '-')
+        return n;
+    }
+    fprintf(stderr, "%s: invalid argument: %s\n", program, arg);
+    exit(EXIT_FAILURE);
+  }
+}}
+
+extern "C"
+{
+  // Parses the command line of a generated program.  Starts the timeout.
+  void CyArgs_Parse(int argc, char ** argv)
+  {
+    using namespace sprite::compiler;
+    Cy_LimitState & limits = Cy_Limits();
+    char const * program = argc > 0 ? argv[0] : "a.out";
+    for(int i=1; i<argc; ++i)
+    {
+      char const * arg = argv[i];
+      if(!strncmp(arg, "--max-values=", 13))
+        limits.max_values = Cy_ArgsNumber(program, arg);
+      else if(!strncmp(arg, "--timeout=", 10))
+        limits.timeout_ms = Cy_ArgsNumber(program, arg);
+      else if(!strcmp(arg, "--stats"))
+        limits.report = true;
+      else if(!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+      {
+        Cy_ArgsUsage(stdout, program);
+        exit(EXIT_SUCCESS);
+      }
+      else
+      {
+        fprintf(stderr, "%s: unrecognized option: %s\n", program, arg);
+        Cy_ArgsUsage(stderr, program);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if(limits.timeout_ms)
+    {
+      Cy_TimeoutInstall(true);
+      Cy_TimeoutArm();
+    }
+  }
+}
@@ -1,11 +1,9 @@
 #include "basic_runtime.hpp"
 #include "computation_frame.hpp"
-// #include "context_switch.hpp"
 #include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <limits>
-#include <list>
 #include "llvm/ADT/SmallVector.h"
 #include <unordered_set>
 #include <sstream>
@@ -14,6 +12,8 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "cymemory.hpp"
+#include "parallel.hpp"
+#include "scheduler.hpp"
 #include <boost/scope_exit.hpp>
 #include <boost/timer/timer.hpp>
 
@@ -27,13 +27,30 @@
 
 #define NODE_ALLOC_WITH_ACTIONS(variable, label, actions)           \
     do {                                                            \
-      if(CyMem_FreeList)                                            \
+      if(CyMem_AllocPtr != CyMem_AllocLimit)                        \
       {                                                             \
-        variable = reinterpret_cast<node*>(CyMem_FreeList);         \
-        CyMem_FreeList = *reinterpret_cast<void**>(CyMem_FreeList); \
+        variable = reinterpret_cast<node*>(CyMem_AllocPtr);         \
+        CyMem_AllocPtr += NODE_BYTES;                               \
       }                                                             \
       else                                                          \
-        { {actions}; CyMem_NodePool->collect(); goto label; }       \
+        { {actions}; CyMem_NodePool->refill(); goto label; }        \
+    } while(0)                                                      \
+  /**/
+
+// Allocates a node that stores its @p arity successors inline.
+#define NODE_ALLOC_INLINE(variable, arity, label)                   \
+    do {                                                            \
+      size_t const bytes_ = inline_node_chunks(arity) * NODE_BYTES; \
+      if(size_t(CyMem_AllocLimit - CyMem_AllocPtr) >= bytes_)       \
+      {                                                             \
+        variable = reinterpret_cast<node*>(CyMem_AllocPtr);         \
+        CyMem_AllocPtr += bytes_;                                   \
+      }                                                             \
+      else                                                          \
+      {                                                             \
+        CyMem_NodePool->reserve(inline_node_chunks(arity));         \
+        goto label;                                                 \
+      }                                                             \
     } while(0)                                                      \
   /**/
 
@@ -43,6 +60,11 @@
 #define SPRITE_ARITY_BOUND 50
 #endif
 
+static_assert(
+    SPRITE_ARITY_BOUND <= sprite::compiler::INLINE_ARITY_MAX + 1
+  , "every node may store its successors inline"
+  );
+
 // The maximum number of children stored within a node, plus one.
 #ifndef SPRITE_INPLACE_BOUND
 #define SPRITE_INPLACE_BOUND 3
@@ -80,7 +102,7 @@ namespace sprite { namespace compiler
   }();
 
   // The memory roots, used for gc.
-  std::deque<node*> CyMem_Roots;
+  Cy_RootStack CyMem_Roots;
 
   namespace fingerprints
   {
@@ -164,34 +186,124 @@ extern "C"
 
   void CyMem_PushRoot(node * p) { CyMem_Roots.push_back(p); }
   void CyMem_PopRoot() { CyMem_Roots.pop_back(); }
+  void CyMem_GrowRoots() { CyMem_Roots.grow(); }
+
+  void CyMem_Remember(node * p)
+  {
+    p->mark |= GC_REMEMBERED;
+    CyMem_Remembered.push_back(p);
+  }
 
-  struct Cy_ContextSwitch {};
   void Cy_PrintWorkQueue(FILE * stream);
+
+  // Ends the program early, when a limit set by CyArgs_Parse is reached.
+  // Nothing is freed; the process exits.
+  void Cy_Stop() __attribute__((__noreturn__));
+  void Cy_Stop()
+  {
+    Cy_ParallelKillWorkers();
+    if(Cy_Parallel.is_worker)
+      Cy_LimitsWorkerExit();
+    else
+      Cy_LimitsReport();
+    fflush(NULL);
+    _exit(EXIT_SUCCESS);
+  }
+
+  // Called from safepoints when Cy_PreemptRequested is set.  Suspends the
+  // current computation if the scheduler wants a context switch.  Otherwise,
+  // starts a new quantum.
+  void Cy_Preempt()
+  {
+    Cy_ComputationFrame * const compframe = Cy_GlobalComputations;
+    if(!compframe)
+    {
+      if(Cy_StopRequested())
+        Cy_Stop();
+      Cy_PreemptRequested = 0;
+      return;
+    }
+    // Outside of a computation fiber, Cy_Eval handles the request.  This
+    // lets a value being printed finish.
+    if(!compframe->preemptible)
+      return;
+    if(Cy_StopRequested())
+      Cy_Stop();
+    Cy_PreemptRequested = 0;
+    auto & computation = *compframe->computation;
+    assert(!computation.empty());
+    // Only switch if there are at least two computations.
+    if(computation.size() > 1
+        && compframe->scheduler->should_preempt(computation.front())
+      )
+    {
+      #ifdef VERBOSECS
+      printf("Switching context (element 0 will go to the end):\n");
+      Cy_PrintWorkQueue(stdout);
+      #endif
+      // Cy_Eval starts the next quantum before resuming this fiber.
+      Fiber::current()->yield();
+      return;
+    }
+    compframe->scheduler->resume(computation.front());
+  }
+
+  // Called by compiled code when the allocation run is exhausted, or too
+  // short for the CyMem_AllocChunks chunks wanted.  Moves to the next run of
+  // free chunks, collecting if necessary.
   void CyMem_Collect()
   {
-    // Perform a context switch, if it is time for one.  Only check if there
-    // are at least two computations.
-    if(Cy_GlobalComputations)
+    size_t const nchunks = CyMem_AllocChunks;
+    CyMem_AllocChunks = 1;
+
+    // The collector is also a safepoint.  Other computations may run in the
+    // meantime.  If one of them refilled the allocation run, then the caller
+    // can simply retry.
+    if(Cy_PreemptRequested)
     {
-      auto & computation = *Cy_GlobalComputations->computation;
-      assert(!computation.empty());
-      if(++computation.begin() != computation.end())
-      {
-        static size_t gc_cycles = 0;
-        if(++gc_cycles >= computation.front().time_allotment)
-        {
-          gc_cycles = 0;
-          #ifdef VERBOSECS
-          printf("Switching context (element 0 will go to the end):\n");
-          Cy_PrintWorkQueue(stdout);
-          #endif
-          throw Cy_ContextSwitch();
-        }
-      }
+      Cy_Preempt();
+      if(size_t(CyMem_AllocLimit - CyMem_AllocPtr) >= nchunks * NODE_BYTES)
+        return;
     }
 
     // Cy_PrintWorkQueue(stdout); // DEBUG
-    CyMem_NodePool->collect();
+    CyMem_NodePool->reserve(nchunks);
+  }
+
+  void CyMem_HeapExhausted()
+  {
+    size_t const limit_mb = (Cy_HeapMaxChunks() * NODE_BYTES) >> 20;
+    // Only a computation running on its own fiber can be failed alone.
+    Cy_ComputationFrame * const compframe = Cy_GlobalComputations;
+    if(!compframe || !compframe->preemptible)
+    {
+      if(limit_mb)
+        fprintf(stderr, "Heap limit of %zu MB reached.\n", limit_mb);
+      else
+        fprintf(stderr, "Out of memory.\n");
+      Cy_ParallelKillWorkers();
+      fflush(NULL);
+      _exit(EXIT_FAILURE);
+    }
+    if(limit_mb)
+      fprintf(stderr, "Heap limit of %zu MB reached.  A computation fails.\n", limit_mb);
+    else
+      fprintf(stderr, "Out of memory.  A computation fails.\n");
+    compframe->heap_exhausted = true;
+    Fiber::current()->yield();
+    // Cy_Eval releases the fiber without resuming it.
+    __builtin_unreachable();
+  }
+
+  void CyMem_IdsExhausted()
+  {
+    fprintf(stderr
+      , "Choice IDs exhausted after %lld were issued.  See SPRITE_COMPACT_IDS.\n"
+      , (long long) Cy_NextChoiceId
+      );
+    Cy_ParallelKillWorkers();
+    fflush(NULL);
+    _exit(EXIT_FAILURE);
   }
 
   node ** Cy_ArrayAllocTyped(aux_t n)
@@ -394,18 +506,23 @@ extern "C"
   {
     auto & store = *Cy_CurrentConstraints;
     bool first_out = true;
-    for(auto const & kv: store->eq_choice.read())
-    {
-      if(!first_out) fputc(',', stream); else first_out = false;
-      fprintf(stream, "%d:=:(", kv.first);
-      bool first = true;
-      for(auto id: kv.second.read())
-      {
-        if(!first) fputc(',', stream); else first = false;
-        fprintf(stream, "%d", id);
-      }
-      fputc(')', stream);
-    }
+    // Each bound choice is shown with the representative of its class.
+    store->eq_choice.for_each(
+        [&](aux_t id, choice_classes::Entry const & e)
+        {
+          if(e.is_root())
+            return;
+          if(!first_out) fputc(',', stream); else first_out = false;
+          aux_t const rep = store->eq_choice.find(id);
+          fprintf(stream, "%d:=:%d", id, rep);
+          switch(store->eq_choice.side(rep))
+          {
+            case ChoiceState::LEFT: fprintf(stream, ":L"); break;
+            case ChoiceState::RIGHT: fprintf(stream, ":R"); break;
+            case ChoiceState::UNDETERMINED:;
+          }
+        }
+      );
     for(auto const & kv: store->eq_var.read())
     {
       if(!first_out) fputc(',', stream); else first_out = false;
@@ -479,6 +596,7 @@ extern "C"
       root->tag = CTOR + 1;
       root->slot0 = char_data;
       root->slot1 = next;
+      CyMem_WriteBarrier(root);
 
       root = next;
     }
@@ -500,6 +618,7 @@ extern "C"
       root->tag = CTOR + 1;
       root->slot0 = char_data;
       root->slot1 = next;
+      CyMem_WriteBarrier(root);
 
       root = next;
     }
@@ -567,19 +686,22 @@ extern "C"
       }
       else
       {
-        NODE_ALLOC(copy, redo);
-        copy->vptr = item->vptr;
-        copy->tag = item->tag;
-        
         item->vptr->succ(item, &src_begin, &src_end);
         aux_t const N = static_cast<aux_t>(src_end - src_begin);
         if(N < SPRITE_INPLACE_BOUND)
+        {
+          NODE_ALLOC(copy, redo);
           dst_begin = &SUCC_0(copy);
+        }
         else
         {
-          dst_begin = Cy_ArrayAllocTyped(N);
+          // The copy stores its successors inline.
+          NODE_ALLOC_INLINE(copy, N, redo);
+          dst_begin = &SUCC_1(copy);
           DATA(copy, node**) = dst_begin;
         }
+        copy->vptr = item->vptr;
+        copy->tag = item->tag;
         while(src_begin!=src_end)
           *dst_begin++ = *src_begin++;
 
@@ -608,7 +730,9 @@ extern "C"
   {
     auto & constraints = Cy_CurrentConstraints->write();
     constraints.add_var_constraints(from, to, false);
-    constraints.add_choice_constraints(from->aux, to->aux);
+    constraints.add_choice_constraints(
+        from->aux, to->aux, Cy_CurrentFingerprint->read()
+      );
   }
 
   // Used to implement =:<=.  The RHS may be an unevaluated expression.
@@ -664,19 +788,22 @@ extern "C"
       }
       else
       {
-        NODE_ALLOC(copy, redo);
-        copy->vptr = item->vptr;
-        copy->tag = item->tag;
-        
         item->vptr->succ(item, &src_begin, &src_end);
         aux_t const N = static_cast<aux_t>(src_end - src_begin);
         if(N < SPRITE_INPLACE_BOUND)
+        {
+          NODE_ALLOC(copy, redo);
           dst_begin = &SUCC_0(copy);
+        }
         else
         {
-          dst_begin = Cy_ArrayAllocTyped(N);
+          // The copy stores its successors inline.
+          NODE_ALLOC_INLINE(copy, N, redo);
+          dst_begin = &SUCC_1(copy);
           DATA(copy, node**) = dst_begin;
         }
+        copy->vptr = item->vptr;
+        copy->tag = item->tag;
         for(; src_begin!=src_end; ++src_begin, ++dst_begin)
         {
           node * tmp;
@@ -734,7 +861,9 @@ extern "C"
         active.emplace_back(SUCC_0(lhs), SUCC_0(rhs));
         if(!constraints)
           constraints = &Cy_CurrentConstraints->write();
-        constraints->add_choice_constraints(lhs->aux, rhs->aux);
+        constraints->add_choice_constraints(
+            lhs->aux, rhs->aux, Cy_CurrentFingerprint->read()
+          );
       }
       else
       {
@@ -782,8 +911,10 @@ extern "C"
       SUCC_0(amp) = newc;
       SUCC_1(amp) = SUCC_0(conditions);
 
-      // This & operation takes the place of the old condition.
+      // This & operation takes the place of the old condition.  The
+      // conditions node is rooted, so it may have been promoted.
       SUCC_0(conditions) = amp;
+      CyMem_WriteBarrier(conditions);
     }
   }
 
@@ -879,79 +1010,62 @@ extern "C"
     return conditions;
   }
 
-  // Validate (and clear) the constraints in the store, updating the
-  // fingerprint as needed.  Return true if the computation fails.
+  // Returns the state of choice @p id.  A choice not made in the fingerprint
+  // takes the side of its class in the constraint store, if there is one.
+  // The side is then recorded in the fingerprint.
+  ChoiceState Cy_ChoiceState(
+      Shared<Fingerprint> & fp, Shared<ConstraintStore> const & constraints
+    , aux_t id
+    )
+  {
+    ChoiceState const made = fp->test(id);
+    if(made != ChoiceState::UNDETERMINED || constraints->eq_choice.empty())
+      return made;
+    ChoiceState const side = constraints->eq_choice.side(id);
+    if(side == ChoiceState::LEFT)
+      fp.write().set_left_no_check(id);
+    else if(side == ChoiceState::RIGHT)
+      fp.write().set_right_no_check(id);
+    return side;
+  }
+
+  // Validate the choice constraints on @p id against the fingerprint, in
+  // which it was just made.  Return true if the computation fails.
   bool Cy_ValidateConstraints(
       Shared<Fingerprint> & fp, Shared<ConstraintStore> & constraints, aux_t id
     )
   {
     DPRINTF("Now validating constraints for %d\n", id);
-    DPRINTF("The eq_choice keys are:");
-    #ifdef DIAGNOSTICS
-    for(auto ii: constraints->eq_choice.read())
-      DPRINTF(" %d", ii.first);
-    #endif
-    DPRINTF("\n");
-
-    std::vector<aux_t> todo{id};
-    while(!todo.empty())
+    ChoiceClasses const & classes = constraints->eq_choice;
+    if(classes.conflict())
     {
-      id = todo.back();
-      todo.pop_back();
-      DPRINTF("Checking id=%d\n", id);
-
-      auto const & cstore = constraints->eq_choice.read();
-      auto it = cstore.find(id);
-      if(it == cstore.end())
-      {
-        DPRINTF("Not found\n");
-        continue;
-      }
-      auto made = fp->test(id);
-      for(auto id2: it->second.read())
-      {
-        DPRINTF("Checking id2=%d\n", id2);
-        auto made2 = fp->test(id2);
-        switch(made2)
-        {
-          case ChoiceState::LEFT:
-          case ChoiceState::RIGHT:
-            if(made != made2)
-            {
-              DPRINTF("?%d <=> ?%d FAILED\n", id, id2);
-              return true;
-            }
-            else
-              DPRINTF("?%d <=> ?%d PASSED\n", id, id2);
-            break;
-          case ChoiceState::UNDETERMINED:
-            if(made == ChoiceState::LEFT)
-            {
-              DPRINTF("Setting ?%d to LEFT\n", id2);
-              fp.write().set_left_no_check(id2);
-            }
-            else
-            {
-              DPRINTF("Setting ?%d to RIGHT\n", id2);
-              fp.write().set_right_no_check(id2);
-            }
-            break;
-        }
-
-        // Process chains of bindings.
-        todo.push_back(id2);
-      }
-      // All affected choices are committed, now.  It is safe to clear this
-      // part of the constraint store.
-      constraints.write().eq_choice.write().erase(id);
+      DPRINTF("The bindings conflict\n");
+      return true;
+    }
+    ChoiceState const made = fp->test(id);
+    if(made == ChoiceState::UNDETERMINED || !classes.is_bound(id))
+      return false;
+    ChoiceState const side = classes.side(id);
+    if(side == ChoiceState::UNDETERMINED)
+    {
+      // The first choice of its class to be made.  Commit the class.
+      DPRINTF("Committing the class of ?%d\n", id);
+      constraints.write().eq_choice.commit(id, made);
+      return false;
     }
-    return false;
+    DPRINTF("?%d <=> ?%d %s\n", id, classes.find(id)
+      , side == made ? "PASSED" : "FAILED"
+      );
+    return side != made;
   }
 
   // Tests the indicated choice in the current fingerprint.  Precondition:
   // Cy_Eval is on the stack, so that Cy_CurrentFingerprint is non-null.
   bool Cy_TestChoiceIsMade(aux_t id)
-    { return Cy_CurrentFingerprint->read().choice_is_made(id); }
+  {
+    return Cy_ChoiceState(*Cy_CurrentFingerprint, *Cy_CurrentConstraints, id)
+        != ChoiceState::UNDETERMINED;
+  }
 
   // Indicates whether a made choice is LEFT or RIGHT.  Precondition: Cy_TestChoiceIsMade(id).
   bool Cy_TestChoiceIsLeft(aux_t id)
@@ -963,100 +1077,115 @@ extern "C"
     *end = SUCC_0(root) ? &SUCC_1(root) : &SUCC_0(root);
   }
 
-  // Fiber & Fiber::main_fiber()
-  // {
-  //   static Fiber f = Fiber(main_fiber_tag());
-  //   return f;
-  // }
-
-  // void make_context(void * context, void * stack_pointer)
-  // {
-  //   auto & slot = *reinterpret_cast<boost::context::fcontext_t*>(context);
-  //   slot = *boost::context::make_fcontext(
-  //       stack_pointer, Fiber::stack_size(), &CyContext_SubcomputationMain
-  //     );
-  // }
-
-  // // Declared in context_switch.hpp.
-  // // boost::context::fcontext_t CyContext_MainFiber;
-
-  // void CyContext_SubcomputationMain(intptr_t arg)
-  // {
-  //   Cy_EvalFrame * frame = *reinterpret_cast<Cy_EvalFrame **>(&arg);
-  //   frame->expr->vptr->N(frame->expr);
-  //   // When the call to N returns, switch back to the main fiber to process the
-  //   // switch in Cy_Eval.
-  //   frame->fiber.switch_to(Fiber::main_fiber());
-  // }
-
-  // std::stack<void *> CyContext_StackPool;
-
-  // void * alloc_stack()
-  // {
-  //   if(!CyContext_StackPool.empty())
-  //   {
-  //     void * sp = CyContext_StackPool.top();
-  //     CyContext_StackPool.pop();
-  //     return sp;
-  //   }
-  //   return malloc(Fiber::stack_size());
-  // }
-
-  // void dealloc_stack(void * sp)
-  // {
-  //   CyContext_StackPool.push(sp);
-  // }
-
-  // void CyContext_ActivateFrame(Fiber & current_fiber, Cy_EvalFrame & frame)
-  // {
-  //   Cy_CurrentFingerprint = &frame.fingerprint;
-  //   Cy_CurrentConstraints = &frame.constraints;
-  //   DPRINTF("Q> WORKING_ON %p\n", frame.expr);
-  //   current_fiber.switch_to(frame.fiber);
-  // }
-
   // Evaluates an expression.  Calls yield(x) for each result x.
   void Cy_Eval(node * root, void(*yield)(node * root))
   {
     // Set up this computation.
-    std::list<Cy_EvalFrame> computation;
+    Cy_FrameRing computation;
     computation.emplace_back(root);
 
+    std::unique_ptr<Cy_Scheduler> scheduler(Cy_MakeScheduler());
+    scheduler->start();
+
     // Link it into the list of global computations.
-    Cy_ComputationFrame compframe = { &computation, Cy_GlobalComputations };
+    Cy_ComputationFrame compframe =
+        { &computation, scheduler.get(), root, false, false, Cy_GlobalComputations };
     Cy_GlobalComputations = &compframe;
+    // A nested call runs on a fiber of the enclosing computation, which
+    // expects its fingerprint and constraints to be current when it resumes.
     struct Cleanup
-      { ~Cleanup() { Cy_GlobalComputations = Cy_GlobalComputations->next; } }
-      _cleanup;
-
-    // The next section handles context switches.  The first time through,
-    // there is no context switch, of course.
-    size_t original_depth;
-    int64_t original_indent;
-    if(false)
     {
-    switch_context:
-      computation.front().time_allotment *= 2;
-      computation.splice(computation.end(), computation, computation.begin());
-      CyMem_Roots.resize(original_depth);
-      CyTrace_IndentLvl = original_indent;
-      // The context switches are triggered right before the collector runs.
-      // Finish up by running the collection cycle.
-      CyMem_NodePool->collect();
-    }
-
-    while(!computation.empty())
+      ~Cleanup()
+      {
+        Cy_GlobalComputations = Cy_GlobalComputations->next;
+        Cy_CurrentFingerprint = fingerprint;
+        Cy_CurrentConstraints = constraints;
+      }
+      Shared<Fingerprint> * fingerprint;
+      Shared<ConstraintStore> * constraints;
+    } _cleanup = { Cy_CurrentFingerprint, Cy_CurrentConstraints };
+
+    // Only the outermost computation is evaluated in parallel.  The values it
+    // produces count against the limits set by CyArgs_Parse.
+    bool const outermost = !compframe.next;
+    bool const parallel =
+        outermost && scheduler->can_share_work() && Cy_ParallelInit();
+
+    scheduler->resume(computation.front());
+
+    // The root is read from compframe, since compaction may move it.
+    while(!computation.empty()
+        || scheduler->restart(computation, compframe.root)
+      )
     {
+      if(parallel && Cy_ParallelShareWork(computation))
+        scheduler->resume(computation.front());
+      // Another worker may have reached a limit.
+      if(parallel && Cy_StopRequested())
+        Cy_Stop();
+      // Handle a quantum that expired between steps.
+      if(Cy_PreemptRequested)
+      {
+        if(Cy_StopRequested())
+          Cy_Stop();
+        Cy_PreemptRequested = 0;
+        if(computation.size() > 1
+            && scheduler->should_preempt(computation.front())
+          )
+          scheduler->preempt(computation);
+        scheduler->resume(computation.front());
+      }
+      // Renumber the choice IDs if the last collection found them sparse, or
+      // move the nodes together if it found them scattered.  Enclosing
+      // computations may hold either in registers, so only the outermost one
+      // does this.  Suspended fibers hold no IDs across a safepoint, but they
+      // may hold nodes, so nodes are moved only when there are none.
+      if(outermost)
+      {
+        if(CyMem_NodePool->wants_id_compaction())
+          CyMem_NodePool->compact_ids();
+        else if(CyMem_NodePool->wants_node_compaction()
+            && !Fiber::any_suspended()
+          )
+          CyMem_NodePool->compact_nodes();
+      }
       Cy_EvalFrame & frame = computation.front();
+      if(!scheduler->admit(frame))
+      {
+        DPRINTF("Q> CUTOFF %p\n", frame.expr);
+        computation.pop_front();
+        continue;
+      }
       Cy_CurrentFingerprint = &frame.fingerprint;
       Cy_CurrentConstraints = &frame.constraints;
       node * expr = frame.expr;
-      original_depth = CyMem_Roots.size();
-      original_indent = CyTrace_IndentLvl;
-      try
-        { expr->vptr->N(expr); }
-      catch(Cy_ContextSwitch const &)
-        { goto switch_context; }
+
+      // Normalize on the frame's fiber, starting one if necessary.  If the
+      // computation is preempted, control returns here with the fiber
+      // suspended.
+      if(!frame.fiber)
+        frame.fiber = Fiber::acquire(expr);
+      compframe.preemptible = true;
+      bool const finished = frame.fiber->resume();
+      compframe.preemptible = false;
+      if(compframe.heap_exhausted)
+      {
+        // Discard the fiber's stack.  The computation fails.
+        compframe.heap_exhausted = false;
+        DPRINTF("Q> HEAP EXHAUSTED %p\n", expr);
+        Fiber::release(frame.fiber);
+        frame.fiber = nullptr;
+        computation.pop_front();
+        continue;
+      }
+      if(!finished)
+      {
+        scheduler->preempt(computation);
+        scheduler->resume(computation.front());
+        continue;
+      }
+      Fiber::release(frame.fiber);
+      frame.fiber = nullptr;
 
       redo: switch(expr->tag)
       {
@@ -1100,13 +1229,16 @@ extern "C"
             if(conditions)
             {
               SUCC_1(conditions) = expr;
+              CyMem_WriteBarrier(conditions);
               frame.expr = conditions;
               DPRINTF("Q> ADD_CONDITIONS %p\n", frame.expr);
               break;
             }
           }
 
-          if(frame.fingerprint->choice_is_made(expr->aux))
+          if(Cy_ChoiceState(frame.fingerprint, frame.constraints, expr->aux)
+              != ChoiceState::UNDETERMINED
+            )
           {
             node * choice = SUCC_0(expr);
             frame.expr = expr = CyFree_CopyStencil(choice);
@@ -1132,7 +1264,9 @@ extern "C"
 
             // Check LHS of constraint.
             aux_t id = lhs->aux;
-            if(frame.fingerprint->test(id) != ChoiceState::UNDETERMINED)
+            if(Cy_ChoiceState(frame.fingerprint, frame.constraints, id)
+                != ChoiceState::UNDETERMINED
+              )
             {
               DPRINTF("Processing LEFT\n");
               node * conditions = Cy_ExpandVarConstraints(frame.constraints.write(), id);
@@ -1141,6 +1275,7 @@ extern "C"
               if(conditions)
               {
                 SUCC_1(conditions) = next_expr;
+                CyMem_WriteBarrier(conditions);
                 next_expr = conditions;
               }
             }
@@ -1152,7 +1287,9 @@ extern "C"
             DPRINTF("Processing LEFT\n");
             aux_t id = lhs->aux;
             node * conditions = Cy_ExpandVarConstraints(frame.constraints.write(), id);
-            if(frame.fingerprint->test(id) != ChoiceState::UNDETERMINED)
+            if(Cy_ChoiceState(frame.fingerprint, frame.constraints, id)
+                != ChoiceState::UNDETERMINED
+              )
             {
               if(Cy_ValidateConstraints(frame.fingerprint, frame.constraints, id))
                 goto handle_failure;
@@ -1160,6 +1297,7 @@ extern "C"
             if(conditions)
             {
               SUCC_1(conditions) = next_expr;
+              CyMem_WriteBarrier(conditions);
               next_expr = conditions;
             }
 
@@ -1167,7 +1305,9 @@ extern "C"
             DPRINTF("Processing RIGHT\n");
             id = rhs->aux;
             conditions = Cy_ExpandVarConstraints(frame.constraints.write(), id);
-            if(frame.fingerprint->test(id) != ChoiceState::UNDETERMINED)
+            if(Cy_ChoiceState(frame.fingerprint, frame.constraints, id)
+                != ChoiceState::UNDETERMINED
+              )
             {
               if(Cy_ValidateConstraints(frame.fingerprint, frame.constraints, id))
                 goto handle_failure;
@@ -1175,6 +1315,7 @@ extern "C"
             if(conditions)
             {
               SUCC_1(conditions) = next_expr;
+              CyMem_WriteBarrier(conditions);
               next_expr = conditions;
             }
           }
@@ -1198,61 +1339,78 @@ extern "C"
           if(conditions)
           {
             SUCC_1(conditions) = expr;
+            CyMem_WriteBarrier(conditions);
             frame.expr = conditions;
             DPRINTF("Q> ADD_CONDITIONS@@ %p\n", frame.expr); // DEBUG
             break;
           }
           DPRINTF("Done expanding vars\n");
 
-          switch(frame.fingerprint->test(id))
+          // Bindings that relate choices made in different directions fail.
+          if(frame.constraints->eq_choice.conflict())
+            goto handle_failure;
+
+          switch(Cy_ChoiceState(frame.fingerprint, frame.constraints, id))
           {
             case ChoiceState::LEFT:
               // Discard right expression.
               DPRINTF("Q> CHOOSE_LEFT %p\n", SUCC_0(expr)); // DEBUG
               frame.expr = SUCC_0(expr);
-              // computation.splice(computation.end(), computation, computation.begin()); // DEBUG
+              // computation.rotate(); // DEBUG
               break;
             case ChoiceState::RIGHT:
               // Discard left expression.
               DPRINTF("Q> CHOOSE_RIGHT %p\n", SUCC_1(expr)); // DEBUG
               frame.expr = SUCC_1(expr);
-              // computation.splice(computation.end(), computation, computation.begin()); // DEBUG
+              // computation.rotate(); // DEBUG
               break;
             case ChoiceState::UNDETERMINED:
             {
               // Keep both left and right (unless constraints are not met).
-              auto head = computation.begin();
 
               // LEFT
               Shared<Fingerprint> left_fp(frame.fingerprint);
               left_fp.write().set_left_no_check(id); // note: call to test() dominates.
               Shared<ConstraintStore> left_cst(frame.constraints);
-              if(!Cy_ValidateConstraints(left_fp, left_cst, id))
-              {
-                computation.emplace_front(
-                    SUCC_0(expr), std::move(left_fp), std::move(left_cst)
-                  );
-                DPRINTF("Q> FORK +> %p\n", SUCC_0(expr));
-              }
-              else
+              bool const left_ok = !Cy_ValidateConstraints(left_fp, left_cst, id);
+              if(!left_ok)
                 DPRINTF("Q> LHS_CONSTRAINTS_FAILED\n");
 
               // RIGHT
-              frame.expr = SUCC_1(expr);
               frame.fingerprint.write().set_right_no_check(id); // note: as above
-              if(!Cy_ValidateConstraints(frame.fingerprint, frame.constraints, id))
+              bool const right_ok =
+                  !Cy_ValidateConstraints(frame.fingerprint, frame.constraints, id);
+              ++frame.depth;
+              if(right_ok)
               {
                 DPRINTF("Q> REBASE %p -> %p\n", expr, SUCC_1(expr));
                 frame.expr = SUCC_1(expr);
-                // If the computation split into two new expression, move the RHS to the back
-                // of the work queue.
-                if(computation.begin() != head)
-                  computation.splice(computation.end(), computation, head);
+                // If the computation split into two new expressions, the
+                // scheduler places both.  Adding to the queue invalidates
+                // frame.
+                if(left_ok)
+                {
+                  Cy_EvalFrame lhs(
+                      SUCC_0(expr), std::move(left_fp), std::move(left_cst)
+                    );
+                  lhs.depth = frame.depth;
+                  scheduler->fork(computation, std::move(lhs));
+                  DPRINTF("Q> FORK +> %p\n", SUCC_0(expr));
+                }
               }
               else
               {
                 DPRINTF("Q> RHS CONSTRAINTS FAILED\n");
-                computation.erase(head);
+                // The LHS, if any, takes the place of this frame.
+                if(left_ok)
+                {
+                  frame.expr = SUCC_0(expr);
+                  frame.fingerprint = std::move(left_fp);
+                  frame.constraints = std::move(left_cst);
+                  frame.time_interval = Interval();
+                }
+                else
+                  computation.pop_front();
               }
             }
           }
@@ -1264,11 +1422,33 @@ extern "C"
           break;
         default:
         yield_value:
-          yield(expr);
+        {
+          bool stop = false;
+          if(scheduler->accept(frame))
+          {
+            Cy_ParallelOutputGuard _guard(parallel);
+            if(!outermost)
+              yield(expr);
+            else if(Cy_LimitsTakeValue())
+            {
+              yield(expr);
+              stop = Cy_LimitsValueDone();
+            }
+            else
+              stop = true;
+          }
+          if(stop)
+            Cy_Stop();
           computation.pop_front();
           DPRINTF("Q> DONE %p\n", expr); // DEBUG
+        }
       }
     }
+
+    if(parallel)
+      Cy_ParallelFinish();
+    if(outermost)
+      Cy_LimitsReport();
   }
 
   // Note: root is a [Char], already normalized.
@@ -1506,6 +1686,7 @@ extern "C"
           root->vptr = DATA(SUCC_0(arg), vtable*);
           root->tag = root->vptr->tag;
           root->slot0 = arg->slot1;
+          CyMem_WriteBarrier(root);
           // The second argument is already in the proper place.
 
           // If the operation is a choice, assign the choice ID here, when the
@@ -1515,6 +1696,8 @@ extern "C"
           break;
         default:
         {
+          // The root keeps its one chunk, so its successors go to an external
+          // array.  Copies made later, e.g., by a pull-tab, store them inline.
           node ** args = Cy_ArrayAllocTyped(n);
           node ** pos = args + n - 1;
           node * current = root;
@@ -1528,6 +1711,7 @@ extern "C"
           root->tag = root->vptr->tag;
           root->slot0 = args;
           root->slot1 = 0;
+          CyMem_WriteBarrier(root);
         }
       }
     }
@@ -1593,6 +1777,7 @@ extern "C"
     root->tag = BINDING;
     SUCC_0(root) = success;
     SUCC_1(root) = pair;
+    CyMem_WriteBarrier(root);
   }
 
   void CyPrelude_Eq(node *) __asm__("CyPrelude_==");
@@ -1724,6 +1909,7 @@ extern "C"
   {
     node * io = SUCC_0(root);
     SUCC_0(root) = SUCC_0(io);
+    CyMem_WriteBarrier(root);
     root->vptr = io->vptr->show;
   }
 }
@@ -0,0 +1,191 @@
+// Defines Cy_MarkBits, which holds the mark bits of the node heap.
+#pragma once
+#include "basic_runtime.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace sprite { namespace compiler
+{
+  /**
+   * @brief The mark bits of the node heap, kept apart from the nodes.
+   *
+   * Each block of chunks has a bitmap with one bit per chunk.  Marking writes
+   * only the bitmaps, so a collection does not dirty the cache lines of live
+   * nodes, and pages that SPRITE_THREADS workers share with their parent stay
+   * shared.  The sweep reads the bitmaps a word at a time and finds runs of
+   * free chunks by counting trailing zeros.
+   */
+  struct Cy_MarkBits
+  {
+    struct Block
+    {
+      char * begin;
+      char * end;
+      uint64_t * bits;
+
+      // The number of chunks.
+      size_t size() const { return (end - begin) / sizeof(node); }
+      size_t nwords() const { return (size() + 63) / 64; }
+
+      // The chunk at index @p i.
+      node * at(size_t i) const
+        { return reinterpret_cast<node *>(begin + i * sizeof(node)); }
+
+      // The index of the chunk containing @p p.
+      size_t index(void const * p) const
+        { return (static_cast<char const *>(p) - begin) / sizeof(node); }
+
+      bool contains(void const * p) const
+      {
+        char const * const addr = static_cast<char const *>(p);
+        return begin <= addr && addr < end;
+      }
+
+      bool test(size_t i) const { return bits[i / 64] >> (i % 64) & 1; }
+
+      // Sets every bit.
+      void fill() const
+        { std::memset(bits, 0xff, this->nwords() * sizeof(uint64_t)); }
+
+      // Clears every bit.
+      void clear() const
+        { std::memset(bits, 0, this->nwords() * sizeof(uint64_t)); }
+
+      // The index of the first chunk at or after @p i whose bit equals
+      // @p value, or size() if there is none.
+      size_t find(size_t i, bool value) const;
+    };
+
+    // Adds a block of chunks, [begin, end).  Its bits are clear.
+    void add_block(char * begin, char * end);
+
+    // The blocks, in the order they were added.
+    std::vector<Block> const & blocks() const { return m_blocks; }
+
+    // The block containing @p p, or null.
+    Block const * find(void const * p) const;
+
+    // Clears every bit.
+    void clear();
+
+    bool test(node const * p) const
+    {
+      Block const * b = this->find(p);
+      assert(b);
+      return b->test(b->index(p));
+    }
+
+    // Sets the bit of @p p.  Returns true if it was clear.  @p hint is a block
+    // that likely contains @p p, or null.  It is updated to the block that
+    // does.  Neighbouring nodes mostly share a block, so this saves a search.
+    bool test_and_set(node const * p, Block const *& hint)
+    {
+      if(!hint || !hint->contains(p))
+        hint = this->find(p);
+      Block const * b = hint;
+      assert(b);
+      size_t const i = b->index(p);
+      uint64_t & word = b->bits[i / 64];
+      uint64_t const bit = uint64_t(1) << (i % 64);
+      if(word & bit)
+        return false;
+      word |= bit;
+      return true;
+    }
+
+    // Same as test_and_set, but safe to call from several threads at once.
+    bool atomic_test_and_set(node const * p, Block const *& hint)
+    {
+      if(!hint || !hint->contains(p))
+        hint = this->find(p);
+      Block const * b = hint;
+      assert(b);
+      size_t const i = b->index(p);
+      uint64_t * const word = &b->bits[i / 64];
+      uint64_t const bit = uint64_t(1) << (i % 64);
+      if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return false;
+      return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+    }
+
+    // Sets the bits of the @p n chunks after @p p, which hold the rest of a
+    // node that stores its successors inline.  A node lies in one block,
+    // @p b.  With @p atomic, other threads may be setting bits at once.
+    void set_following(node const * p, size_t n, Block const * b, bool atomic)
+    {
+      assert(b && b->contains(p + n));
+      size_t const i = b->index(p);
+      for(size_t k=i+1; k<=i+n; ++k)
+      {
+        uint64_t const bit = uint64_t(1) << (k % 64);
+        if(atomic)
+          __atomic_fetch_or(&b->bits[k / 64], bit, __ATOMIC_RELAXED);
+        else
+          b->bits[k / 64] |= bit;
+      }
+    }
+
+  private:
+
+    std::vector<Block> m_blocks;
+
+    // The blocks ordered by address.
+    std::vector<Block> m_sorted;
+  };
+
+  inline size_t Cy_MarkBits::Block::find(size_t i, bool value) const
+  {
+    size_t const n = this->size();
+    if(i >= n)
+      return n;
+    size_t w = i / 64;
+    uint64_t word = (value ? bits[w] : ~bits[w]) & (~uint64_t(0) << (i % 64));
+    while(!word)
+    {
+      if(++w == this->nwords())
+        return n;
+      word = value ? bits[w] : ~bits[w];
+    }
+    return std::min(n, w * 64 + __builtin_ctzll(word));
+  }
+
+  inline void Cy_MarkBits::add_block(char * begin, char * end)
+  {
+    size_t const nwords = ((end - begin) / sizeof(node) + 63) / 64;
+    uint64_t * bits = static_cast<uint64_t *>(std::calloc(nwords, sizeof(uint64_t)));
+    if(!bits)
+      throw std::bad_alloc();
+    Block const block{begin, end, bits};
+    m_blocks.push_back(block);
+    m_sorted.insert(
+        std::upper_bound(
+            m_sorted.begin(), m_sorted.end(), block
+          , [](Block const & a, Block const & b) { return a.begin < b.begin; }
+          )
+      , block
+      );
+  }
+
+  inline Cy_MarkBits::Block const * Cy_MarkBits::find(void const * p) const
+  {
+    char const * const addr = static_cast<char const *>(p);
+    auto it = std::upper_bound(
+        m_sorted.begin(), m_sorted.end(), addr
+      , [](char const * a, Block const & b) { return a < b.begin; }
+      );
+    if(it == m_sorted.begin() || addr >= (--it)->end)
+      return nullptr;
+    return &*it;
+  }
+
+  inline void Cy_MarkBits::clear()
+  {
+    for(Block const & b: m_blocks)
+      b.clear();
+  }
+}}
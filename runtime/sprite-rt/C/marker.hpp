@@ -0,0 +1,405 @@
+// Defines Cy_Marker, which implements the mark phase of the collector.
+#pragma once
+#include "basic_runtime.hpp"
+#include "markbits.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef VERBOSEGC
+#include <iostream>
+#endif
+
+extern "C"
+{
+  extern sprite::compiler::vtable CyVt_Fwd __asm__(".vt.fwd");
+}
+
+namespace sprite { namespace compiler
+{
+  namespace marker
+  {
+    // The number of nodes a worker hands over when it shares work.
+    size_t const CHUNK = 256;
+
+    inline bool holds_id(node * node_p)
+      { return node_p->tag == CHOICE || node_p->tag == FREE; }
+
+    // The number of chunks after its own taken by @p p, whose successors are
+    // [begin, end).  Nonzero only if they are stored inline, starting at
+    // slot1.  See inline_node_chunks.
+    inline size_t extra_chunks(node * p, node ** begin, node ** end)
+    {
+      if(begin != reinterpret_cast<node **>(&p->slot1))
+        return 0;
+      char const * const first = reinterpret_cast<char const *>(p);
+      return (reinterpret_cast<char const *>(end) - first - 1) / sizeof(node);
+    }
+
+    inline node * fwd_target(node * p)
+    {
+      return __atomic_load_n(
+          reinterpret_cast<node **>(&p->slot0), __ATOMIC_RELAXED
+        );
+    }
+
+    // Replaces a pointer to a FWD node in @p slot with the end of its chain,
+    // so that the FWD nodes become garbage unless something else holds them.
+    // Returns the number of hops removed.  A cycle of FWD nodes, which only a
+    // diverging program makes, is left alone.  Slots are accessed atomically
+    // because a FWD node is traced by one thread while others may follow it.
+    inline size_t short_circuit(node ** slot)
+    {
+      node * p = __atomic_load_n(slot, __ATOMIC_RELAXED);
+      node * slow = p;
+      size_t hops = 0;
+      while(p->vptr == &CyVt_Fwd)
+      {
+        p = fwd_target(p);
+        if(++hops % 2 == 0)
+        {
+          slow = fwd_target(slow);
+          if(p == slow)
+            return 0;
+        }
+      }
+      if(hops)
+        __atomic_store_n(slot, p, __ATOMIC_RELAXED);
+      return hops;
+    }
+
+    // The state of one marking thread.
+    struct Worker
+    {
+      // The private mark stack.  It holds the slots that point to nodes to
+      // mark.
+      std::vector<node**> stack;
+      // Chunks of this worker's mark stack made available to other workers.
+      std::vector<std::vector<node**>> shared;
+      std::mutex lock;
+      // Marked nodes holding choice or variable IDs.
+      std::vector<node*> id_nodes;
+      // The number of chunks marked.
+      size_t live = 0;
+      // The number of FWD hops removed.
+      size_t fwd_hops = 0;
+    };
+  }
+
+  /**
+   * @brief Marks the nodes reachable from a set of roots.
+   *
+   * With one thread, this is a depth-first traversal with an explicit stack.
+   * With more, each thread traverses from its own stack.  A thread whose
+   * stack grows long while others are idle moves its oldest entries to a
+   * shared chunk, and an idle thread steals a chunk from any worker.
+   * Marking uses an atomic or on the mark bitmap, so each node is traced by
+   * exactly one thread.  A node that stores its successors inline has the
+   * chunks holding them marked with it.
+   *
+   * The mark stacks hold successor slots rather than nodes.  A slot that
+   * points to a FWD node is rewritten to point past it when it is popped, so
+   * consumers skip fewer hops and the FWD node can be freed.  Only the thread
+   * that pops a slot writes it.
+   *
+   * The calling thread is worker 0.  The helper threads start on first use and
+   * then wait for the next collection.  Threads do not survive fork, so a
+   * process forked by Cy_ParallelShareWork starts its own helpers.
+   */
+  struct Cy_Marker
+  {
+    // Sets the bits in @p marks of every node reachable from @p roots, except
+    // those whose node::mark has one of the bits in @p skip set.  Nodes found
+    // holding choice or variable IDs are appended to @p id_nodes, if it is not
+    // null.  Returns the number of chunks marked.  Roots that are FWD nodes
+    // are short-circuited in place.
+    template<typename Roots>
+    size_t mark(
+        Cy_MarkBits & marks, Roots & roots, mark_t skip
+      , std::vector<node*> * id_nodes, size_t nthreads
+      );
+
+    // The number of FWD hops removed by short-circuiting since this process
+    // started.  The collector adds those removed from the roots.
+    size_t fwd_hops = 0;
+
+    // The marker for this process.
+    static Cy_Marker & get()
+    {
+      static Cy_Marker * instance = nullptr;
+      if(!instance || instance->pid != getpid())
+        instance = new Cy_Marker(); // the old one, if any, was inherited
+      return *instance;
+    }
+
+  private:
+
+    Cy_Marker() : pid(getpid()) {}
+
+    template<typename Roots>
+    size_t mark_sequential(
+        Cy_MarkBits & marks, Roots & roots, mark_t skip
+      , std::vector<node*> * id_nodes
+      );
+
+    // Starts helper threads until there are n-1.
+    void start_helpers(size_t n);
+
+    // The main loop of helper thread @p i.  It waits for the first
+    // collection after @p seen.
+    void helper_main(size_t i, size_t seen);
+
+    // Marks with worker @p i until no work remains anywhere.
+    void work(size_t i);
+
+    // Marks nodes from the private stack of @p w until it is empty.
+    void drain(marker::Worker & w);
+
+    // Moves the oldest entries of the stack of @p w to a shared chunk.
+    void share(marker::Worker & w);
+
+    // Takes a shared chunk from any worker, starting with @p i, into its
+    // private stack.  Returns false if none was found.
+    bool steal(size_t i);
+
+    pid_t const pid;
+    std::vector<std::unique_ptr<marker::Worker>> workers;
+    size_t nhelpers = 0;
+
+    // The mark stack of mark_sequential.  It is kept between collections, so
+    // that it is allocated only as it grows.
+    std::vector<node**> stack;
+
+    // The current collection.
+    Cy_MarkBits * marks = nullptr;
+    mark_t skip = 0;
+    bool collect_ids = false;
+    size_t nworkers = 0;
+
+    // The number of workers still marking plus the number of shared chunks.
+    // Marking is done when it reaches zero.
+    std::atomic<size_t> outstanding{0};
+
+    // The number of shared chunks.
+    std::atomic<size_t> available{0};
+
+    // Starts and joins the helpers at each collection.
+    std::mutex sync;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    size_t epoch = 0;
+    size_t nactive = 0;
+    size_t finished = 0;
+  };
+
+  template<typename Roots>
+  size_t Cy_Marker::mark(
+      Cy_MarkBits & marks_, Roots & roots, mark_t skip_
+    , std::vector<node*> * id_nodes, size_t nthreads
+    )
+  {
+    if(nthreads < 2)
+      return this->mark_sequential(marks_, roots, skip_, id_nodes);
+
+    this->start_helpers(nthreads);
+    marks = &marks_;
+    skip = skip_;
+    collect_ids = id_nodes;
+    nworkers = nthreads;
+
+    // Deal the roots out.  Every worker starts out marking.
+    size_t k = 0;
+    for(node *& root: roots)
+      workers[k++ % nworkers]->stack.push_back(&root);
+    outstanding.store(nworkers);
+    available.store(0);
+
+    {
+      std::lock_guard<std::mutex> _(sync);
+      ++epoch;
+      nactive = nworkers - 1;
+      finished = 0;
+    }
+    start_cv.notify_all();
+    this->work(0);
+    {
+      std::unique_lock<std::mutex> lock(sync);
+      done_cv.wait(lock, [&] { return finished == nactive; });
+    }
+
+    size_t live = 0;
+    for(size_t i=0; i<nworkers; ++i)
+    {
+      marker::Worker & w = *workers[i];
+      live += w.live;
+      w.live = 0;
+      fwd_hops += w.fwd_hops;
+      w.fwd_hops = 0;
+      if(id_nodes)
+        id_nodes->insert(id_nodes->end(), w.id_nodes.begin(), w.id_nodes.end());
+      w.id_nodes.clear();
+    }
+    return live;
+  }
+
+  template<typename Roots>
+  size_t Cy_Marker::mark_sequential(
+      Cy_MarkBits & marks, Roots & roots, mark_t skip
+    , std::vector<node*> * id_nodes
+    )
+  {
+    for(node *& root: roots)
+      stack.push_back(&root);
+    size_t live = 0;
+    node ** begin, ** end;
+    Cy_MarkBits::Block const * hint = nullptr;
+    while(!stack.empty())
+    {
+      node ** slot = stack.back();
+      stack.pop_back();
+      fwd_hops += marker::short_circuit(slot);
+      node * parent = *slot;
+      if((parent->mark & skip) || !marks.test_and_set(parent, hint))
+        continue;
+
+      #if VERBOSEGC > 2
+        std::cout
+            << "   [mark] @" << parent << " " << parent->vptr->label(parent)
+            << std::endl;
+      #endif
+
+      if(id_nodes && marker::holds_id(parent))
+        id_nodes->push_back(parent);
+      ++live;
+      parent->vptr->gcsucc(parent, &begin, &end);
+      if(size_t const extra = marker::extra_chunks(parent, begin, end))
+      {
+        marks.set_following(parent, extra, hint, false);
+        live += extra;
+      }
+      for(; begin != end; ++begin)
+        stack.push_back(begin);
+    }
+    return live;
+  }
+
+  inline void Cy_Marker::start_helpers(size_t n)
+  {
+    while(workers.size() < n)
+      workers.emplace_back(new marker::Worker);
+    for(; nhelpers + 1 < n; ++nhelpers)
+    {
+      // Helpers outlive every collection.  They are never joined.
+      std::thread(&Cy_Marker::helper_main, this, nhelpers + 1, epoch).detach();
+    }
+  }
+
+  inline void Cy_Marker::helper_main(size_t i, size_t seen)
+  {
+    for(;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(sync);
+        start_cv.wait(lock, [&] { return epoch != seen; });
+        seen = epoch;
+        if(i > nactive)
+          continue;
+      }
+      this->work(i);
+      {
+        std::lock_guard<std::mutex> _(sync);
+        if(++finished == nactive)
+          done_cv.notify_one();
+      }
+    }
+  }
+
+  inline void Cy_Marker::work(size_t i)
+  {
+    marker::Worker & w = *workers[i];
+    for(;;)
+    {
+      this->drain(w);
+      outstanding.fetch_sub(1);
+      for(;;)
+      {
+        if(outstanding.load() == 0)
+          return;
+        if(this->steal(i))
+          break;
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  inline void Cy_Marker::drain(marker::Worker & w)
+  {
+    node ** begin, ** end;
+    Cy_MarkBits::Block const * hint = nullptr;
+    while(!w.stack.empty())
+    {
+      node ** slot = w.stack.back();
+      w.stack.pop_back();
+      w.fwd_hops += marker::short_circuit(slot);
+      node * parent = __atomic_load_n(slot, __ATOMIC_RELAXED);
+      // Only collections write node::mark, so reading it is safe.
+      if((parent->mark & skip) || !marks->atomic_test_and_set(parent, hint))
+        continue;
+      if(collect_ids && marker::holds_id(parent))
+        w.id_nodes.push_back(parent);
+      ++w.live;
+      parent->vptr->gcsucc(parent, &begin, &end);
+      if(size_t const extra = marker::extra_chunks(parent, begin, end))
+      {
+        marks->set_following(parent, extra, hint, true);
+        w.live += extra;
+      }
+      for(; begin != end; ++begin)
+        w.stack.push_back(begin);
+      if(w.stack.size() >= 2 * marker::CHUNK
+          && available.load(std::memory_order_relaxed) < nworkers
+        )
+        this->share(w);
+    }
+  }
+
+  inline void Cy_Marker::share(marker::Worker & w)
+  {
+    // The oldest entries are nearest the roots, so they likely lead to the
+    // most work.
+    auto const first = w.stack.begin();
+    std::vector<node**> chunk(first, first + marker::CHUNK);
+    w.stack.erase(first, first + marker::CHUNK);
+    outstanding.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> _(w.lock);
+      w.shared.push_back(std::move(chunk));
+    }
+    available.fetch_add(1);
+  }
+
+  inline bool Cy_Marker::steal(size_t i)
+  {
+    if(available.load() == 0)
+      return false;
+    marker::Worker & thief = *workers[i];
+    for(size_t k=0; k<nworkers; ++k)
+    {
+      marker::Worker & victim = *workers[(i + k) % nworkers];
+      std::lock_guard<std::mutex> _(victim.lock);
+      if(!victim.shared.empty())
+      {
+        // The chunk's share of outstanding passes to the thief.
+        thief.stack.swap(victim.shared.back());
+        victim.shared.pop_back();
+        available.fetch_sub(1);
+        return true;
+      }
+    }
+    return false;
+  }
+}}
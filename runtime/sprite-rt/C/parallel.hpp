@@ -0,0 +1,248 @@
+// This file may only be included from main.cpp.
+//
+// Implements OR-parallel evaluation for Cy_Eval.
+//
+// When the environment variable SPRITE_THREADS is set to N > 1, the outermost
+// call to Cy_Eval distributes its work queue among up to N workers.  Each
+// worker is a forked copy of the process that created it.  Since expressions
+// are shared between computations and rewritten in place, sharing one heap
+// between concurrently-running workers would require synchronizing every
+// rewrite step.  Forking sidesteps that: every worker owns a private node
+// pool, free list, root stack, and work queue, and its collector stops only
+// itself.  Pages not written after the fork stay shared by the OS.
+//
+// Work distribution is sender-initiated.  Between steps, a busy worker whose
+// queue holds at least two frames checks whether a worker slot is free.  If
+// one is, it forks.  The child takes the oldest half of the queue (the back,
+// where the Fair Scheme rotates frames that have already had a turn), and the
+// parent keeps the rest.  A worker that exhausts its queue never takes work
+// from another.  It releases its slot, so a busy worker can fork into it, and
+// waits for its children in Cy_ParallelFinish.
+//
+// This replaces two parts of the original design.  Idle workers stealing from
+// the queues of busy ones would need a shared heap, and so would a
+// stop-the-world collector that pauses every worker.  With private heaps,
+// neither is needed: work moves only at a fork, and each worker collects its
+// own pool.
+//
+// Values still go through the yield callback.  Output from different workers
+// is serialized with a lock held in shared memory.
+#pragma once
+#include "limits.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sprite { namespace compiler
+{
+  // State shared by all workers.  It lives in an anonymous shared mapping
+  // created before the first fork.
+  struct Cy_ParallelState
+  {
+    // The number of workers with work to do, including the original process.
+    volatile int active;
+    // The maximum number of workers.
+    int limit;
+    // Spin lock serializing the output of values.
+    volatile int output_lock;
+  };
+
+  // Per-process parallel evaluation data.
+  struct Cy_ParallelInfo
+  {
+    // The shared state, or null if parallel evaluation is disabled.
+    Cy_ParallelState * shared = nullptr;
+    // True in processes created by Cy_ParallelShareWork.
+    bool is_worker = false;
+    // Workers forked by this process.
+    std::vector<pid_t> children;
+  } Cy_Parallel;
+
+  // Reads SPRITE_THREADS.  Returns the maximum number of workers.
+  inline int Cy_ParallelLimit()
+  {
+    static int const limit = []
+    {
+      char const * str = std::getenv("SPRITE_THREADS");
+      int n = str ? std::atoi(str) : 1;
+      return n < 1 ? 1 : n;
+    }();
+    return limit;
+  }
+
+  // Enables parallel evaluation, if requested.  Returns true if it was
+  // enabled.  Called by the outermost Cy_Eval only.
+  inline bool Cy_ParallelInit()
+  {
+    int const limit = Cy_ParallelLimit();
+    if(limit < 2)
+      return false;
+    if(!Cy_Parallel.shared)
+    {
+      void * p = mmap(
+          nullptr, sizeof(Cy_ParallelState), PROT_READ | PROT_WRITE
+        , MAP_SHARED | MAP_ANONYMOUS, -1, 0
+        );
+      if(p == MAP_FAILED)
+      {
+        perror("SPRITE_THREADS: mmap");
+        return false;
+      }
+      Cy_Parallel.shared = static_cast<Cy_ParallelState *>(p);
+      Cy_Parallel.shared->limit = limit;
+      Cy_Parallel.shared->output_lock = 0;
+    }
+    Cy_Parallel.shared->active = 1;
+    return true;
+  }
+
+  // Serializes output between workers.  A no-op when parallel evaluation is
+  // disabled.
+  struct Cy_ParallelOutputGuard
+  {
+    explicit Cy_ParallelOutputGuard(bool enabled)
+      : lock(enabled ? &Cy_Parallel.shared->output_lock : nullptr)
+    {
+      if(lock)
+        while(__sync_lock_test_and_set(lock, 1))
+          sched_yield();
+    }
+
+    ~Cy_ParallelOutputGuard()
+    {
+      if(lock)
+      {
+        fflush(stdout);
+        __sync_lock_release(lock);
+      }
+    }
+
+  private:
+
+    volatile int * lock;
+  };
+
+  // Tries to claim a free worker slot.
+  inline bool Cy_ParallelTryClaimSlot()
+  {
+    Cy_ParallelState * shared = Cy_Parallel.shared;
+    int n = shared->active;
+    while(n < shared->limit)
+    {
+      int const prev = __sync_val_compare_and_swap(&shared->active, n, n+1);
+      if(prev == n)
+        return true;
+      n = prev;
+    }
+    return false;
+  }
+
+  inline void Cy_ParallelReleaseSlot()
+    { __sync_fetch_and_sub(&Cy_Parallel.shared->active, 1); }
+
+  // Stops every worker forked by this process.  Takes the output lock first,
+  // so that no worker is killed while printing, and releases it afterwards for
+  // workers further down.
+  inline void Cy_ParallelKillWorkers()
+  {
+    if(!Cy_Parallel.shared || Cy_Parallel.children.empty())
+      return;
+    volatile int * lock = &Cy_Parallel.shared->output_lock;
+    while(__sync_lock_test_and_set(lock, 1))
+      sched_yield();
+    for(pid_t pid: Cy_Parallel.children)
+      kill(pid, SIGKILL);
+    __sync_lock_release(lock);
+  }
+
+  // If a worker slot is free, forks a new worker and gives it the oldest half
+  // of the work queue.  Call only between steps, when no reference to a frame
+  // of @p computation is held.  Returns true in the new worker.
+  template<typename Queue>
+  bool Cy_ParallelShareWork(Queue & computation)
+  {
+    size_t const size = computation.size();
+    if(size < 2 || !Cy_ParallelTryClaimSlot())
+      return false;
+
+    // Unwritten output would otherwise be duplicated in the child.
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t const pid = fork();
+    if(pid < 0)
+    {
+      Cy_ParallelReleaseSlot();
+      return false;
+    }
+
+    size_t const nstolen = size / 2;
+    if(pid == 0)
+    {
+      Cy_Parallel.is_worker = true;
+      Cy_Parallel.children.clear();
+      Cy_TimeoutArm();
+      // Count only the chunks this worker allocates.
+      CyMem_RunChunks = 0;
+      CyMem_RunBegin = CyMem_AllocPtr;
+      for(size_t i=nstolen; i<size; ++i)
+        computation.pop_front();
+      return true;
+    }
+    else
+    {
+      Cy_Parallel.children.push_back(pid);
+      for(size_t i=0; i<nstolen; ++i)
+        computation.pop_back();
+      return false;
+    }
+  }
+
+  // Called when a worker's queue is exhausted.  Waits for the workers it
+  // forked.  Workers then exit; the original process returns.
+  inline void Cy_ParallelFinish()
+  {
+    // This process is idle from now on, so its slot can be used by another.
+    Cy_ParallelReleaseSlot();
+    // The timeout must interrupt the wait.  Then, the workers are stopped,
+    // since they may not reach a safepoint soon.
+    if(Cy_Limits().timeout_ms)
+      Cy_TimeoutInstall(false);
+    for(pid_t pid: Cy_Parallel.children)
+    {
+      int status = 0;
+      pid_t waited;
+      while((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+      {
+        if(Cy_StopRequested())
+          Cy_ParallelKillWorkers();
+      }
+      // The status is unknown if the wait failed.
+      if(waited < 0)
+      {
+        perror("SPRITE_THREADS: waitpid");
+        continue;
+      }
+      // Workers may be killed when the program stops early.
+      if((!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+          && !Cy_StopRequested()
+        )
+        fprintf(stderr, "SPRITE_THREADS: worker %d failed.\n", (int) pid);
+    }
+    Cy_Parallel.children.clear();
+    if(Cy_Parallel.is_worker)
+    {
+      Cy_LimitsWorkerExit();
+      fflush(stdout);
+      fflush(stderr);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+}}
@@ -0,0 +1,153 @@
+// Defines Ring, a contiguous double-ended queue used for work queues.
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <utility>
+
+namespace sprite { namespace compiler
+{
+  // A growable ring buffer.
+  //
+  // Elements live in one contiguous allocation and slots are reused as
+  // elements come and go, so steady-state pushing and popping never touches
+  // the allocator.  When the buffer is full, its capacity doubles and the
+  // elements are moved to the new storage, front first.  Element references
+  // are therefore invalidated by any operation that adds an element.
+  //
+  // T must be move-constructible.
+  template<typename T> struct Ring
+  {
+    Ring() {}
+    ~Ring()
+    {
+      clear();
+      std::free(data);
+    }
+
+    // Non-copyable.
+    Ring(Ring const &) = delete;
+    Ring & operator=(Ring const &) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T & front() { assert(count); return slot(0); }
+    T const & front() const { assert(count); return slot(0); }
+    T & back() { assert(count); return slot(count-1); }
+    T const & back() const { assert(count); return slot(count-1); }
+
+    // Indexed access, counting from the front.
+    T & operator[](size_t i) { return slot(i); }
+    T const & operator[](size_t i) const { return slot(i); }
+
+    template<typename...Args> void emplace_front(Args&&...args)
+    {
+      reserve_one();
+      head = (head + capacity - 1) & (capacity - 1);
+      new(&data[head]) T(std::forward<Args>(args)...);
+      ++count;
+    }
+
+    template<typename...Args> void emplace_back(Args&&...args)
+    {
+      reserve_one();
+      new(&slot(count)) T(std::forward<Args>(args)...);
+      ++count;
+    }
+
+    void pop_front()
+    {
+      assert(count);
+      data[head].~T();
+      head = (head + 1) & (capacity - 1);
+      --count;
+    }
+
+    void pop_back()
+    {
+      assert(count);
+      slot(count-1).~T();
+      --count;
+    }
+
+    // Moves the front element to the back.  When the buffer is full this only
+    // advances the head index.
+    void rotate()
+    {
+      assert(count);
+      if(count != capacity)
+      {
+        new(&slot(count)) T(std::move(data[head]));
+        data[head].~T();
+      }
+      head = (head + 1) & (capacity - 1);
+    }
+
+    void clear() { while(count) pop_back(); }
+
+    template<typename Value> struct iterator_base
+    {
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = Value;
+      using difference_type = std::ptrdiff_t;
+      using pointer = Value *;
+      using reference = Value &;
+
+      iterator_base(Ring const * r, size_t i) : ring(r), index(i) {}
+      Value & operator*() const { return ring->slot(index); }
+      Value * operator->() const { return &**this; }
+      iterator_base & operator++() { ++index; return *this; }
+      iterator_base operator++(int)
+        { iterator_base tmp = *this; ++index; return tmp; }
+      bool operator==(iterator_base const & arg) const
+        { return index == arg.index; }
+      bool operator!=(iterator_base const & arg) const
+        { return index != arg.index; }
+    private:
+      Ring const * ring;
+      size_t index;
+    };
+
+    using iterator = iterator_base<T>;
+    using const_iterator = iterator_base<T const>;
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, count); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, count); }
+
+  private:
+
+    T & slot(size_t i) const
+      { return data[(head + i) & (capacity - 1)]; }
+
+    void reserve_one()
+    {
+      if(count == capacity)
+      {
+        size_t const new_capacity = capacity ? 2 * capacity : 16;
+        T * new_data = static_cast<T *>(std::malloc(new_capacity * sizeof(T)));
+        if(!new_data)
+          throw std::bad_alloc();
+        for(size_t i=0; i<count; ++i)
+        {
+          new(&new_data[i]) T(std::move(slot(i)));
+          slot(i).~T();
+        }
+        std::free(data);
+        data = new_data;
+        capacity = new_capacity;
+        head = 0;
+      }
+    }
+
+    // The storage.  The capacity is always zero or a power of two.
+    T * data = nullptr;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t count = 0;
+  };
+}}
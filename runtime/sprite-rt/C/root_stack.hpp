@@ -0,0 +1,90 @@
+// Defines Cy_RootStack, which holds the temporary roots of a fiber.
+#pragma once
+#include "basic_runtime.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+namespace sprite { namespace compiler
+{
+  // The number of roots a root stack holds when first used.
+  constexpr size_t CY_ROOT_STACK_INITIAL = 1024;
+
+  /**
+   * @brief A stack of temporary roots.
+   *
+   * Compiled code keeps a new node alive across an allocation by pushing it
+   * here.  A push is an inline store at top; a pop moves top back (see
+   * rt_h::CyMem_PushRoot).  Only a push that finds the stack full calls into
+   * the runtime, to grow it.  The collector reads [base, top) and updates the
+   * entries of moved nodes.
+   *
+   * The compiler knows the layout.  The stack of the running fiber is
+   * CyMem_Roots.  A suspended fiber keeps its own.  See Fiber::switch_.
+   */
+  struct Cy_RootStack
+  {
+    node ** top = nullptr;
+    node ** limit = nullptr;
+    node ** base = nullptr;
+
+    Cy_RootStack() = default;
+    Cy_RootStack(Cy_RootStack const &) = delete;
+    Cy_RootStack & operator=(Cy_RootStack const &) = delete;
+    ~Cy_RootStack() { std::free(base); }
+
+    node ** begin() const { return base; }
+    node ** end() const { return top; }
+    size_t size() const { return top - base; }
+    bool empty() const { return top == base; }
+    node *& back() const { return top[-1]; }
+    node *& operator[](size_t i) const { return base[i]; }
+
+    void push_back(node * p)
+    {
+      if(top == limit)
+        this->grow();
+      *top++ = p;
+    }
+
+    void pop_back() { --top; }
+
+    // Empties the stack.  Keeps its memory.
+    void clear() { top = base; }
+
+    void swap(Cy_RootStack & other)
+    {
+      std::swap(top, other.top);
+      std::swap(limit, other.limit);
+      std::swap(base, other.base);
+    }
+
+    // Doubles the capacity.  Entries move, so no reference to one survives.
+    void grow();
+  };
+
+  inline void Cy_RootStack::grow()
+  {
+    size_t const n = this->size();
+    size_t const capacity =
+        std::max<size_t>(CY_ROOT_STACK_INITIAL, 2 * (limit - base));
+    node ** const p = static_cast<node **>(
+        std::realloc(base, capacity * sizeof(node *))
+      );
+    if(!p)
+      throw std::bad_alloc();
+    base = p;
+    top = p + n;
+    limit = p + capacity;
+  }
+
+  extern "C"
+  {
+    // The root stack of the running fiber.
+    extern Cy_RootStack CyMem_Roots;
+
+    // Grows CyMem_Roots.  Called by compiled code when a push finds it full.
+    void CyMem_GrowRoots();
+  }
+}}
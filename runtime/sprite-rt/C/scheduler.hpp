@@ -0,0 +1,239 @@
+// This file may only be included from main.cpp.
+//
+// Defines the search strategies used by Cy_Eval.
+//
+// Cy_Eval always works on the frame at the front of its work queue.  A
+// scheduler decides where the branches of a fork go, when the front frame is
+// preempted, and (for iterative deepening) which frames are explored at all.
+// The strategy is chosen by the environment variable SPRITE_SEARCH (one of
+// fair, dfs, bfs, or id).  If it is not set, the default compiled into the
+// program by scc --search is used.
+//
+// Preemption is driven by a CPU-time timer.  When the current quantum expires,
+// a signal handler sets Cy_PreemptRequested.  Generated step functions poll
+// that flag on entry (see rt_h::safepoint) and call Cy_Preempt, which asks the
+// scheduler whether to switch.  The quantum and its growth factor are set by
+// SPRITE_QUANTUM_US and SPRITE_QUANTUM_GROWTH (see timer.hpp).
+#pragma once
+#include "basic_runtime.hpp"
+#include "computation_frame.hpp"
+#include "timer.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+
+extern "C"
+{
+  // Set asynchronously when the current quantum expires.
+  volatile sig_atomic_t Cy_PreemptRequested = 0;
+}
+
+namespace sprite { namespace compiler
+{
+  inline void Cy_PreemptHandler(int) { Cy_PreemptRequested = 1; }
+
+  // Starts a new quantum of the given length.  Timers are not inherited by
+  // forked workers, so each process creates its own.
+  inline void Cy_PreemptArm(Interval const & ivl)
+  {
+    static Timer * timer = nullptr;
+    static pid_t owner = 0;
+    pid_t const pid = getpid();
+    if(owner != pid)
+    {
+      if(!timer)
+      {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &Cy_PreemptHandler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(SIGVTALRM, &sa, nullptr))
+          _os_error("sigaction");
+      }
+      // The parent's timer does not exist here, so it is not deleted.
+      timer = new Timer(SIGVTALRM);
+      owner = pid;
+    }
+    Cy_PreemptRequested = 0;
+    (*timer)(ivl);
+  }
+
+  struct Cy_Scheduler
+  {
+    virtual ~Cy_Scheduler() {}
+
+    // Called at the start of Cy_Eval.
+    virtual void start() {}
+
+    // Schedules the two branches of a fork.  On entry, the front frame holds
+    // the RHS.  The LHS is given.
+    virtual void fork(Cy_FrameRing & queue, Cy_EvalFrame && lhs) = 0;
+
+    // Called after the quantum expires, when the queue holds at least two
+    // frames.  Returns true if the front frame should be preempted.
+    virtual bool should_preempt(Cy_EvalFrame &) { return false; }
+
+    // Preempts the front frame.
+    virtual void preempt(Cy_FrameRing & queue) { queue.rotate(); }
+
+    // Starts a new quantum for the front frame.
+    virtual void resume(Cy_EvalFrame &) {}
+
+    // Indicates whether the front frame should be explored.  Frames that are
+    // not admitted are discarded.
+    virtual bool admit(Cy_EvalFrame const &) { return true; }
+
+    // Indicates whether a value computed by the given frame should be yielded.
+    virtual bool accept(Cy_EvalFrame const &) { return true; }
+
+    // Called when the queue is empty.  Returns true if more work was added.
+    virtual bool restart(Cy_FrameRing &, node *) { return false; }
+
+    // Indicates whether the work queue may be split between workers.
+    virtual bool can_share_work() const { return true; }
+  };
+
+  // The Fair Scheme.  The LHS of a fork goes to the front and the RHS goes to
+  // the back.  A frame is preempted after running for its time_interval, and
+  // the interval grows each time.
+  struct Cy_FairScheduler : Cy_Scheduler
+  {
+    void fork(Cy_FrameRing & queue, Cy_EvalFrame && lhs) override
+    {
+      queue.rotate();
+      queue.emplace_front(std::move(lhs));
+    }
+
+    bool should_preempt(Cy_EvalFrame &) override { return true; }
+
+    void preempt(Cy_FrameRing & queue) override
+    {
+      ++queue.front().time_interval;
+      queue.rotate();
+    }
+
+    void resume(Cy_EvalFrame & front) override
+      { Cy_PreemptArm(front.time_interval); }
+  };
+
+  // Depth-first search.  Both branches go to the front, LHS first, and frames
+  // are never preempted.  An infinite branch hides every branch to its right.
+  struct Cy_DfsScheduler : Cy_Scheduler
+  {
+    void fork(Cy_FrameRing & queue, Cy_EvalFrame && lhs) override
+      { queue.emplace_front(std::move(lhs)); }
+  };
+
+  // Breadth-first search.  Both branches go to the back, LHS first.  Frames
+  // are preempted after every quantum.
+  struct Cy_BfsScheduler : Cy_Scheduler
+  {
+    void fork(Cy_FrameRing & queue, Cy_EvalFrame && lhs) override
+    {
+      queue.emplace_back(std::move(lhs));
+      queue.rotate();
+    }
+
+    bool should_preempt(Cy_EvalFrame &) override { return true; }
+
+    void resume(Cy_EvalFrame &) override { Cy_PreemptArm(Interval()); }
+  };
+
+  // Iterative deepening.  Each round is a depth-first search that discards
+  // frames with more than @p bound forks on their path.  If anything was
+  // discarded, the next round restarts from the root with a larger bound.
+  // The graph keeps the steps performed in earlier rounds, so a restart only
+  // repeats the forks.  Values found in earlier rounds are not yielded again.
+  //
+  // The bound starts at SPRITE_ID_STEP (default 8) and grows by that amount.
+  struct Cy_IdScheduler : Cy_DfsScheduler
+  {
+    void start() override
+    {
+      char const * str = std::getenv("SPRITE_ID_STEP");
+      step = str ? std::strtoul(str, nullptr, 10) : 8;
+      if(step == 0) step = 1;
+      bound = step;
+      prev_bound = 0;
+      truncated = false;
+    }
+
+    bool admit(Cy_EvalFrame const & frame) override
+    {
+      if(frame.depth > bound)
+      {
+        truncated = true;
+        return false;
+      }
+      return true;
+    }
+
+    bool accept(Cy_EvalFrame const & frame) override
+      { return frame.depth > prev_bound || prev_bound == 0; }
+
+    bool restart(Cy_FrameRing & queue, node * root) override
+    {
+      if(!truncated)
+        return false;
+      truncated = false;
+      prev_bound = bound;
+      bound += step;
+      queue.emplace_back(root);
+      return true;
+    }
+
+    // Workers would each restart from the root.
+    bool can_share_work() const override { return false; }
+
+  private:
+
+    size_t step = 8;
+    size_t bound = 8;
+    size_t prev_bound = 0;
+    bool truncated = false;
+  };
+
+  // The strategy compiled into the program.
+  SearchStrategy Cy_DefaultSearchStrategy = SEARCH_FAIR;
+
+  // Creates the scheduler for a new call to Cy_Eval.
+  inline Cy_Scheduler * Cy_MakeScheduler()
+  {
+    SearchStrategy strategy = Cy_DefaultSearchStrategy;
+    if(char const * str = std::getenv("SPRITE_SEARCH"))
+    {
+      if(!std::strcmp(str, "fair"))
+        strategy = SEARCH_FAIR;
+      else if(!std::strcmp(str, "dfs"))
+        strategy = SEARCH_DFS;
+      else if(!std::strcmp(str, "bfs"))
+        strategy = SEARCH_BFS;
+      else if(!std::strcmp(str, "id"))
+        strategy = SEARCH_ID;
+      else
+        fprintf(stderr, "SPRITE_SEARCH: unknown strategy \"%s\" ignored.\n", str);
+    }
+    switch(strategy)
+    {
+      case SEARCH_DFS: return new Cy_DfsScheduler();
+      case SEARCH_BFS: return new Cy_BfsScheduler();
+      case SEARCH_ID:  return new Cy_IdScheduler();
+      case SEARCH_FAIR:
+      default:         return new Cy_FairScheduler();
+    }
+  }
+}}
+
+extern "C"
+{
+  // Sets the strategy used when SPRITE_SEARCH is not set.  Called by the main
+  // function generated by scc.
+  void CySearch_SetDefault(int strategy)
+  {
+    sprite::compiler::Cy_DefaultSearchStrategy =
+        static_cast<sprite::compiler::SearchStrategy>(strategy);
+  }
+}
@@ -0,0 +1,132 @@
+// Defines Shared, the copy-on-write handle for per-computation state.
+#pragma once
+#include "boost-pool-1.46/pool.hpp"
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace sprite { namespace compiler
+{
+  namespace shared
+  {
+    // A managed object and its reference count, allocated together.
+    template<typename T> struct Box
+    {
+      template<typename...Args>
+      Box(Args&&...args) : value(std::forward<Args>(args)...) {}
+
+      size_t refcount = 1;
+      // The last GC pass that visited this object.  See Shared::gc_visit.
+      size_t stamp = 0;
+      T value;
+    };
+
+    // Returns a stamp that no box has seen.  Each GC pass over the shared
+    // objects takes a new one.
+    inline size_t new_stamp()
+    {
+      static size_t last = 0;
+      return ++last;
+    }
+
+    // The pool for boxes of type T.
+    template<typename T> boost::pool<> & box_pool()
+    {
+      static boost::pool<> pool(sizeof(Box<T>));
+      return pool;
+    }
+
+    template<typename T, typename...Args> Box<T> * box_new(Args&&...args)
+    {
+      void * p = box_pool<T>().malloc();
+      if(!p)
+        throw std::bad_alloc();
+      return new(p) Box<T>(std::forward<Args>(args)...);
+    }
+
+    template<typename T> void box_release(Box<T> * box)
+    {
+      if(box && --box->refcount == 0)
+      {
+        box->~Box<T>();
+        box_pool<T>().free(box);
+      }
+    }
+  }
+
+  // Manages an instance of T using copy-on-write semantics.
+  //
+  // Read access produces the object directly.  Write access triggers a copy if
+  // the object is not unique.  Follow the never-empty rule.
+  //
+  // The reference count is stored with the object and is not atomic.  Each
+  // computation runs in one thread, and SPRITE_THREADS workers are separate
+  // processes, so handles are never shared between threads.  Objects are
+  // allocated from a pool per type, so that forking a computation does not
+  // reach malloc.
+  template<typename T> struct Shared
+  {
+    // Construct a new managed object.
+    template<typename...Args>
+    Shared(Args&&...args)
+      : data(shared::box_new<T>(std::forward<Args>(args)...))
+    {}
+
+    // Copy/assign/move.  The non-const copy constructor keeps the constructor
+    // above from matching non-const handles.
+    Shared(Shared const & arg) : data(arg.data) { data->refcount++; }
+    Shared(Shared & arg) : data(arg.data) { data->refcount++; }
+    Shared(Shared && arg) : data(arg.data) { arg.data = nullptr; }
+    Shared & operator=(Shared const & arg)
+    {
+      arg.data->refcount++;
+      shared::box_release(data);
+      data = arg.data;
+      return *this;
+    }
+    Shared & operator=(Shared && arg)
+    {
+      if(this != &arg)
+      {
+        shared::box_release(data);
+        data = arg.data;
+        arg.data = nullptr;
+      }
+      return *this;
+    }
+    ~Shared() { shared::box_release(data); }
+
+    // Data access.
+    T const & read() const { return data->value; }
+    T & write()
+    {
+      if(data->refcount > 1)
+      {
+        shared::Box<T> * copy = shared::box_new<T>(data->value);
+        data->refcount--;
+        data = copy;
+      }
+      return data->value;
+    }
+    bool needs_copy() const { return data->refcount > 1; }
+    T const * operator->() const { return &read(); } // implied read
+
+    // The GC gets special write access without triggering a copy.
+    T & gc_write() const { return data->value; }
+
+    // Returns true the first time it is called with @p stamp, which comes
+    // from shared::new_stamp.  The GC uses it to visit each object once per
+    // pass, however many handles share it.
+    bool gc_visit(size_t stamp) const
+    {
+      if(data->stamp == stamp)
+        return false;
+      data->stamp = stamp;
+      return true;
+    }
+
+  private:
+
+    shared::Box<T> * data;
+  };
+}}
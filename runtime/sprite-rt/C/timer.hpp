@@ -0,0 +1,132 @@
+// Defines CPU-time intervals and timers used to preempt computations.
+#pragma once
+#include <unistd.h>
+
+// Other platforms may be added as needed.
+#ifdef _POSIX_C_SOURCE
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+
+namespace sprite { namespace compiler
+{
+  inline void _os_error(char const * where)
+  {
+    std::string msg("Error in POSIX ");
+    msg += where;
+    perror(msg.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // Represents a timer interval.
+  //
+  // An interval starts at one quantum and grows by a constant factor each time
+  // it is incremented.  Both are tunable through the environment:
+  //
+  //     SPRITE_QUANTUM_US      The quantum, in microseconds (default: 20000).
+  //     SPRITE_QUANTUM_GROWTH  The growth factor (default: 2).
+  struct Interval
+  {
+    Interval() { set(quantum_ns()); }
+    explicit Interval(uint64_t ns) { set(ns); }
+
+    // Increase the timer interval.
+    Interval & operator++()
+    {
+      uint64_t const ns = data.it_value.tv_sec * 1000000000ULL
+          + data.it_value.tv_nsec;
+      // Intervals stop growing at about an hour.
+      uint64_t const max_ns = 3600ULL * 1000000000ULL;
+      double const next = ns * growth();
+      set(next < max_ns ? static_cast<uint64_t>(next) : max_ns);
+      return *this;
+    }
+
+    itimerspec const & get() const { return data; }
+
+    // The length of the first interval, in nanoseconds.
+    static uint64_t quantum_ns()
+    {
+      static uint64_t const value = []
+      {
+        char const * str = getenv("SPRITE_QUANTUM_US");
+        long const us = str ? atol(str) : 20000;
+        return 1000ULL * (us > 0 ? us : 1);
+      }();
+      return value;
+    }
+
+    // The factor by which intervals grow.
+    static double growth()
+    {
+      static double const value = []
+      {
+        char const * str = getenv("SPRITE_QUANTUM_GROWTH");
+        double const g = str ? atof(str) : 2.0;
+        return g < 1.0 ? 1.0 : g;
+      }();
+      return value;
+    }
+
+  private:
+
+    void set(uint64_t ns)
+    {
+      data.it_interval.tv_sec = 0;
+      data.it_interval.tv_nsec = 0;
+      data.it_value.tv_sec = ns / 1000000000ULL;
+      data.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+
+    itimerspec data;
+  };
+
+  // Represents a timer used to trigger context switches.  It raises a signal
+  // when it expires.  By default, it measures the CPU time of the calling
+  // thread.
+  struct Timer
+  {
+    explicit Timer(int signo, clockid_t clock = CLOCK_THREAD_CPUTIME_ID)
+    {
+      sigevent sevp;
+      memset(&sevp, 0, sizeof(sevp));
+      sevp.sigev_notify = SIGEV_SIGNAL;
+      sevp.sigev_signo = signo;
+      if(timer_create(clock, &sevp, &timerid))
+        _os_error("timer_create");
+    }
+
+    ~Timer() { timer_delete(timerid); }
+
+    Timer(Timer const &) = delete;
+    Timer & operator=(Timer const &) = delete;
+
+    // Indicates whether the timer is running.
+    explicit operator bool() const
+    {
+      itimerspec timedata;
+      if(timer_gettime(timerid, &timedata))
+        _os_error("timer_gettime");
+      return timedata.it_value.tv_sec != 0 || timedata.it_value.tv_nsec != 0;
+    }
+
+    // Sets the timer.
+    void operator()(Interval const & ivl)
+    {
+      if(timer_settime(timerid, 0, &ivl.get(), nullptr))
+        _os_error("timer_settime");
+    }
+
+  private:
+
+    timer_t timerid;
+  };
+}}
+
+#else
+#error "Context switches are not availble on this platform."
+#endif
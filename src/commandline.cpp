@@ -148,6 +148,7 @@ namespace sprite
     using namespace backend;
     using namespace sprite::compiler::member_labels;
     auto const & rt = module_stab.rt();
+    rt.reserve_at_restart_points = options.gc_resume;
 
     function const print_action = extern_(
         rt.stepfun_t, "main.print_action", {"root"}
@@ -168,8 +169,11 @@ namespace sprite
       );
 
     extern_(
-        types::int_(32)(), "main", {}
+        types::int_(32)(rt.int_t, **rt.char_t), "main", {"argc", "argv"}
       , [&]{
+          rt.CyArgs_Parse(arg("argc"), arg("argv"));
+          if(options.search_strategy != sprite::compiler::SEARCH_FAIR)
+            rt.CySearch_SetDefault(options.search_strategy);
           label redo = rt.make_restart_point();
           value root_p = rt.node_alloc(*rt.node_t, redo);
           root_p = construct(module_stab, root_p, {start, {}});
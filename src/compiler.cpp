@@ -4,9 +4,12 @@
 #include "sprite/compiler.hpp"
 #include "sprite/runtime.hpp"
 #include <algorithm>
+#include <functional>
 #include <iterator>
 #include <boost/scope_exit.hpp>
+#include <set>
 #include <tuple>
+#include <unordered_map>
 #include "sprite/tree_utils.hpp"
 
 // DIAGNOSTIC - this may warrant a command-line option setting.
@@ -188,19 +191,168 @@ namespace
     return str;
   }
 
+  // The kinds of primitive values a rule can compute unboxed.  Bool and
+  // Ordering are only results.  PRIM_ANY is an operand of a polymorphic
+  // operation, such as ==, or a constructor of unknown type.
+  enum PrimKind
+    { PRIM_INT, PRIM_CHAR, PRIM_FLOAT, PRIM_BOOL, PRIM_ORDERING, PRIM_ANY };
+
+  // A Prelude operation that is computed in registers when its arguments are
+  // values.  See Rewriter::build_primitive.
+  //
+  // emit computes the result.  A Bool or Ordering result is the index of its
+  // constructor.  For a partial operation, fails computes whether the
+  // runtime must be left to handle the arguments (e.g., division by zero).
+  struct PrimOp
+  {
+    using emit_t = std::function<value(std::vector<value> const &)>;
+    std::vector<PrimKind> args;
+    PrimKind result;
+    emit_t emit;
+    emit_t fails;
+  };
+
+  // Widens a Bool to the index of its constructor.
+  value bool_index(value const & x)
+    { return typecast(x, unsigned_(types::int_(64))); }
+
+  // Computes x div y and x mod y, which truncate towards negative infinity.
+  // Produces the quotient or the remainder according to @p mod.
+  value floor_divide(value const & x, value const & y, bool mod)
+  {
+    value const q = x /(signed_)(y);
+    value const r = x %(signed_)(y);
+    value const adjust =
+        (r !=(signed_)(0)) & ((r <(signed_)(0)) ^ (y <(signed_)(0)));
+    return mod ? select(adjust, r + y, r) : select(adjust, q - 1, q);
+  }
+
+  // Gets the primitive operation for a function, or null.  The operations
+  // mirror the externals in the runtime (e.g., CyPrelude_div) and the
+  // primitive ==.T and compare.T functions.
+  PrimOp const * get_prim_op(Qname const & qname)
+  {
+    using args_t = std::vector<value>;
+    // Division by zero, and by -1, which overflows, is left to the runtime.
+    static PrimOp::emit_t const bad_divisor = [](args_t const & a) -> value
+      { return (a[1] ==(signed_)(0)) | (a[1] ==(signed_)(-1)); };
+    static std::unordered_map<std::string, PrimOp> const ops = {
+        {"+", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value { return a[0] + a[1]; }, nullptr}}
+      , {"-", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value { return a[0] - a[1]; }, nullptr}}
+      , {"*", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value { return a[0] * a[1]; }, nullptr}}
+      , {"div", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value
+              { return floor_divide(a[0], a[1], false); }
+          , bad_divisor}}
+      , {"mod", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value
+              { return floor_divide(a[0], a[1], true); }
+          , bad_divisor}}
+      , {"quot", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value { return a[0] /(signed_)(a[1]); }
+          , bad_divisor}}
+      , {"rem", {{PRIM_INT, PRIM_INT}, PRIM_INT
+          , [](args_t const & a) -> value { return a[0] %(signed_)(a[1]); }
+          , bad_divisor}}
+      , {"negateFloat", {{PRIM_FLOAT}, PRIM_FLOAT
+          , [](args_t const & a) -> value { return -a[0]; }, nullptr}}
+      , {"ord", {{PRIM_CHAR}, PRIM_INT
+          , [](args_t const & a) -> value
+              { return typecast(a[0], signed_(types::int_(64))); }
+          , nullptr}}
+      , {"chr", {{PRIM_INT}, PRIM_CHAR
+          , [](args_t const & a) -> value
+              { return typecast(a[0], types::char_()); }
+          , nullptr}}
+      , {"==", {{PRIM_ANY, PRIM_ANY}, PRIM_BOOL
+          , [](args_t const & a) -> value
+              { return bool_index(a[0] ==(signed_)(a[1])); }
+          , nullptr}}
+        // LT, EQ and GT are at indices 0, 1 and 2.
+      , {"compare", {{PRIM_ANY, PRIM_ANY}, PRIM_ORDERING
+          , [](args_t const & a) -> value
+            {
+              value const lt = bool_index(a[0] <(signed_)(a[1]));
+              value const gt = bool_index(a[1] <(signed_)(a[0]));
+              return gt - lt + 1;
+            }
+          , nullptr}}
+      };
+    if(qname.module != "Prelude")
+      return nullptr;
+    auto const it = ops.find(qname.name);
+    return it == ops.end() ? nullptr : &it->second;
+  }
+
+  struct GetLhsPrimKind
+  {
+    using result_type = PrimKind;
+
+    result_type operator()(char) const { return PRIM_CHAR; }
+    result_type operator()(int64_t) const { return PRIM_INT; }
+    result_type operator()(double) const { return PRIM_FLOAT; }
+    result_type operator()(Qname const &) const { return PRIM_ANY; }
+  };
+
+  PrimKind get_case_kind(curry::CaseLhs const & lhs)
+  {
+    GetLhsPrimKind visitor;
+    return lhs.visit(visitor);
+  }
+
+  // Counts the vtable member call sites generated for a module.  Reported by
+  // compile when CompilerOptions::verbose is set.
+  struct CallSiteCounts
+  {
+    // Calls to a member known at compile time.
+    size_t direct = 0;
+    // Calls through the vtable of the node (see vinvoke).
+    size_t indirect = 0;
+  } call_sites;
+
+  // The number of demanded arguments head-normalized before the replacement
+  // was built (see FunctionCompiler::evaluate_demanded).  Reported by compile
+  // when CompilerOptions::verbose is set.
+  size_t eager_arguments = 0;
+
+  // Calls @p member, the vtable member of the node that is known at compile
+  // time, without loading it from the vtable.
+  value dinvoke(function const & member, value const & node_p)
+  {
+    ++call_sites.direct;
+    return member(node_p);
+  }
+
   /**
-   * Move the contents of a node from src to tgt.  Leaves src in an invalid
-   * state if it has an extended successor array.
+   * Copies the node at src to tgt, which was allocated with
+   * node_chunks(arity) chunks.  Three or more successors are copied inline,
+   * and the array of src, if external, is freed.
    */
-  void move(value const & src, value const & tgt, size_t arity)
+  void move(
+      rt_h const & rt, value const & src, value const & tgt, size_t arity
+    )
   {
     tgt.arrow(ND_VPTR) = src.arrow(ND_VPTR);
     tgt.arrow(ND_TAG) = src.arrow(ND_TAG);
     tgt.arrow(ND_AUX) = src.arrow(ND_AUX);
-    if(arity > 0)
-      tgt.arrow(ND_SLOT0) = src.arrow(ND_SLOT0);
-    if(arity > 1)
-      tgt.arrow(ND_SLOT1) = src.arrow(ND_SLOT1);
+    if(arity < 3)
+    {
+      if(arity > 0)
+        tgt.arrow(ND_SLOT0) = src.arrow(ND_SLOT0);
+      if(arity > 1)
+        tgt.arrow(ND_SLOT1) = src.arrow(ND_SLOT1);
+    }
+    else
+    {
+      value const from = bitcast(src.arrow(ND_SLOT0), **types::char_());
+      value const to = set_inline_child_array(tgt);
+      for(size_t i=0; i<arity; ++i)
+        to[i] = from[i];
+      dinvoke(rt.Cy_Destroy(arity), src);
+    }
   }
 
   /**
@@ -275,8 +427,41 @@ namespace
 
     // Node allocator for use in the rewriter.  Automatically uses this
     // object's out-of-memory handler.
-    value node_alloc(type const & ty) const
-      { return rt.node_alloc(ty, this->out_of_memory_handler); }
+    value node_alloc(type const & ty, size_t nchunks = 1) const
+      { return rt.node_alloc(ty, this->out_of_memory_handler, nchunks); }
+
+    // True if the target was allocated with room for the successors of the
+    // term placed there, stored inline.  Only a term reads it.
+    bool target_inline = false;
+
+    // Set while the boxed fallback of a primitive expression is built, so
+    // that its subexpressions are boxed, too.  See build_primitive.
+    bool build_boxed = false;
+
+    // Whether primitive expressions are computed unboxed.  See
+    // CompilerOptions::inline_primitives.
+    bool inline_primitives = true;
+
+    // Variables known to be values where code is being generated, because an
+    // enclosing branch matched them.  The kind is PRIM_ANY unless the branch
+    // matched literals.  See FunctionCompiler::visit_case.
+    std::map<size_t, PrimKind> known_values;
+
+    // Local variables holding demanded arguments that were head-normalized
+    // before the replacement is built.  Primitive expressions read them, as
+    // they do variables reached by a path.  See
+    // FunctionCompiler::evaluate_demanded.
+    std::set<size_t> eager_locals;
+
+    // The number of chunks to allocate for a new node holding @p rule.
+    static size_t new_node_chunks(curry::Rule const & rule)
+    {
+      curry::Term const * term = rule.getterm();
+      return term ? node_chunks(term->args.size()) : 1;
+    }
+
+    template<typename T>
+    static size_t new_node_chunks(T const &) { return 1; }
 
     // Places an expression at an uninitialized location.
     template<typename RuleOrCaseLhs>
@@ -291,7 +476,9 @@ namespace
     template<typename RuleOrCaseLhs>
     tgt::value new_(RuleOrCaseLhs const & def)
     {
-      tgt::value data = this->node_alloc(*rt.node_t);
+      size_t const nchunks = new_node_chunks(def);
+      tgt::value data = this->node_alloc(*rt.node_t, nchunks);
+      this->target_inline = nchunks > 1;
       return this->new_(data, def);
     }
 
@@ -299,7 +486,15 @@ namespace
     void destroy_target()
     {
       if(root_p.ptr() == target_p.ptr() && fundef && fundef->arity > 2)
-        vinvoke(this->target_p, VT_DESTROY);
+        dinvoke(rt.Cy_Destroy(fundef->arity), this->target_p);
+    }
+
+    // Emits the write barrier after successors are stored in the target, if
+    // the target is the root.  Other targets were allocated by this step.
+    void barrier_target() const
+    {
+      if(root_p.ptr() == target_p.ptr())
+        rt.write_barrier(this->target_p);
     }
 
     // Looks up a node using the function paths and path reference.  The result
@@ -353,6 +548,17 @@ namespace
     tgt::value resolve_path_char_p(size_t pathid) const
       { return bitcast(resolve_path(pathid), *tgt::types::char_()); }
 
+    // True if @p pathid names a node reached from the root.  Free, bound and
+    // local variables are built by this step.
+    bool is_path_variable(size_t pathid) const
+    {
+      if(!this->fundef || pathid >= LOCAL_ID_START)
+        return false;
+      size_t const base = this->fundef->paths.at(pathid).base;
+      return base != curry::freevar && base != curry::bind
+          && base != curry::local;
+    }
+
     // Helper for @p resolve_path.  Updates @p resolved_path_alloca.
     void _resolve_path(curry::Function::PathElem const & pathelem) const
     {
@@ -441,6 +647,281 @@ namespace
       slot0_typed = data;
     }
 
+    // The LLVM type of a primitive value.
+    static tgt::type prim_type(PrimKind kind)
+    {
+      switch(kind)
+      {
+        case PRIM_INT: return get_type<int64_t>();
+        case PRIM_CHAR: return get_type<char>();
+        case PRIM_FLOAT: return get_type<double>();
+        default: break;
+      }
+      throw std::logic_error("unreachable");
+    }
+
+    // The vtable of a boxed primitive value.
+    tgt::value prim_vt(PrimKind kind) const
+    {
+      switch(kind)
+      {
+        case PRIM_INT: return rt.Int64_vt;
+        case PRIM_CHAR: return rt.Char_vt;
+        case PRIM_FLOAT: return rt.Float_vt;
+        default: break;
+      }
+      throw std::logic_error("unreachable");
+    }
+
+    // The constructors of a Bool or Ordering, in order of index.
+    static std::vector<Qname> const & prim_ctors(PrimKind kind)
+    {
+      static std::vector<Qname> const bool_ctors{
+          {"Prelude", "False"}, {"Prelude", "True"}
+        };
+      static std::vector<Qname> const ordering_ctors{
+          {"Prelude", "LT"}, {"Prelude", "EQ"}, {"Prelude", "GT"}
+        };
+      return kind == PRIM_BOOL ? bool_ctors : ordering_ctors;
+    }
+
+    /// Rewrites the target to a primitive value computed at run time.
+    void rewrite_primitive(PrimKind kind, tgt::value const & data)
+    {
+      this->destroy_target();
+      if(kind == PRIM_BOOL || kind == PRIM_ORDERING)
+      {
+        // The data is the index of the constructor.
+        auto const & ctors = prim_ctors(kind);
+        auto const & last = this->module_stab.lookup(ctors.back());
+        tgt::value vptr = bitcast(&last.vtable, *rt.vtable_t);
+        tgt::value tag = rt.tag_t(last.tag);
+        for(size_t i=ctors.size()-1; i-->0;)
+        {
+          auto const & node_stab = this->module_stab.lookup(ctors[i]);
+          tgt::value const is_i =
+              data ==(tgt::signed_)(static_cast<int64_t>(i));
+          vptr = select(is_i, bitcast(&node_stab.vtable, *rt.vtable_t), vptr);
+          tag = select(is_i, rt.tag_t(node_stab.tag), tag);
+        }
+        this->target_p.arrow(ND_VPTR) = vptr;
+        this->target_p.arrow(ND_TAG) = tag;
+        return;
+      }
+      this->target_p.arrow(ND_VPTR) = this->prim_vt(kind);
+      this->target_p.arrow(ND_TAG) = compiler::CTOR;
+      auto slot0 = this->target_p.arrow(ND_SLOT0);
+      ref slot0_typed(bitcast(&slot0, *prim_type(kind)));
+      slot0_typed = data;
+    }
+
+    // The kind of a literal, or PRIM_ANY.
+    static PrimKind literal_kind(curry::Rule const & rule)
+    {
+      if(rule.getint()) return PRIM_INT;
+      if(rule.getchar()) return PRIM_CHAR;
+      if(rule.getdouble()) return PRIM_FLOAT;
+      return PRIM_ANY;
+    }
+
+    // The kind of the operands of a polymorphic operation, such as ==.  It is
+    // the kind of a literal or primitive operation among them, or of a
+    // variable a branch matched against literals.  Otherwise, @p guessed is
+    // set and the operands are read as Ints.
+    PrimKind operand_kind(curry::Term const & term, bool & guessed) const
+    {
+      for(auto const & arg: term.args)
+      {
+        PrimKind kind = literal_kind(arg);
+        if(curry::Term const * subterm = arg.getterm())
+        {
+          if(PrimOp const * op = get_prim_op(subterm->qname))
+            kind = op->result;
+        }
+        else if(curry::Ref const * varref = arg.getvar())
+        {
+          auto const it = this->known_values.find(varref->pathid);
+          if(it != this->known_values.end())
+            kind = it->second;
+        }
+        if(kind == PRIM_INT || kind == PRIM_CHAR || kind == PRIM_FLOAT)
+          return kind;
+      }
+      guessed = true;
+      return PRIM_INT;
+    }
+
+    // Describes a primitive expression.  See is_primitive.
+    struct PrimExpr
+    {
+      // The variables read.  Each is mapped to true if its type is not known
+      // and must be checked.
+      std::map<size_t, bool> vars;
+      // True if an operation may leave its arguments to the runtime.
+      bool partial = false;
+    };
+
+    // Checks whether @p rule is a primitive expression of the given kind:
+    // a literal, a variable reached by a path or evaluated eagerly, or a
+    // primitive operation applied to primitive expressions.
+    bool is_primitive(
+        curry::Rule const & rule, PrimKind kind, PrimExpr & expr
+      , bool guessed = false
+      ) const
+    {
+      PrimKind const lit = literal_kind(rule);
+      if(lit != PRIM_ANY)
+        return lit == kind;
+      if(curry::Ref const * varref = rule.getvar())
+      {
+        if(!this->is_path_variable(varref->pathid)
+            && !this->eager_locals.count(varref->pathid)
+          )
+        { return false; }
+        bool & unknown = expr.vars[varref->pathid];
+        unknown = unknown || guessed;
+        return true;
+      }
+      if(curry::Term const * term = rule.getterm())
+        return this->is_primitive(*term, kind, expr);
+      return false;
+    }
+
+    bool is_primitive(
+        curry::Term const & term, PrimKind kind, PrimExpr & expr
+      ) const
+    {
+      PrimOp const * op = get_prim_op(term.qname);
+      if(!op || op->result != kind || op->args.size() != term.args.size())
+        return false;
+      expr.partial = expr.partial || static_cast<bool>(op->fails);
+      bool guessed = false;
+      PrimKind const operand = this->operand_kind(term, guessed);
+      for(size_t i=0; i<term.args.size(); ++i)
+      {
+        bool const any = op->args[i] == PRIM_ANY;
+        if(!this->is_primitive(
+            term.args[i], any ? operand : op->args[i], expr, any && guessed
+          ))
+        { return false; }
+      }
+      return true;
+    }
+
+    // Computes a primitive expression in registers.  The variables are
+    // looked up in @p nodes and must be values.  A partial operation jumps to
+    // @p fallback when it cannot compute its result.
+    tgt::value compute_primitive(
+        curry::Rule const & rule, PrimKind kind
+      , std::map<size_t, tgt::value> const & nodes
+      , tgt::label const & fallback
+      ) const
+    {
+      if(char const * data = rule.getchar())
+        return get_constant(get_type<char>(), *data);
+      if(int64_t const * data = rule.getint())
+        return get_constant(get_type<int64_t>(), *data);
+      if(double const * data = rule.getdouble())
+        return get_constant(get_type<double>(), *data);
+      if(curry::Ref const * varref = rule.getvar())
+      {
+        auto slot0 = nodes.at(varref->pathid).arrow(ND_SLOT0);
+        return *bitcast(&slot0, *prim_type(kind));
+      }
+      return this->compute_primitive(*rule.getterm(), nodes, fallback);
+    }
+
+    tgt::value compute_primitive(
+        curry::Term const & term, std::map<size_t, tgt::value> const & nodes
+      , tgt::label const & fallback
+      ) const
+    {
+      PrimOp const & op = *get_prim_op(term.qname);
+      bool guessed = false;
+      PrimKind const operand = this->operand_kind(term, guessed);
+      std::vector<tgt::value> args;
+      args.reserve(term.args.size());
+      for(size_t i=0; i<term.args.size(); ++i)
+      {
+        PrimKind const kind = op.args[i] == PRIM_ANY ? operand : op.args[i];
+        args.push_back(
+            this->compute_primitive(term.args[i], kind, nodes, fallback)
+          );
+      }
+      if(op.fails)
+        tgt::if_(op.fails(args), [&] { tgt::goto_(fallback); });
+      return op.emit(args);
+    }
+
+    // Builds a primitive expression, such as x+y*2 or n==0, at the target
+    // without allocating its subexpressions.  The result is computed in
+    // registers and only boxed into the target.  That needs every variable
+    // read to be a value.  Unless that is known (see known_values), it is
+    // checked, and if not, the term is built as usual, to be evaluated later.
+    // The same happens when a partial operation, such as div, cannot compute
+    // its result.  Computing early never changes the result, since a value
+    // read now is the one the term would see later.  The fallback is built
+    // boxed throughout.  Otherwise, each primitive subexpression would emit
+    // its own checks, computation and fallback inside it.  Returns false if
+    // @p term is not primitive.
+    bool build_primitive(curry::Term const & term)
+    {
+      if(this->build_boxed || !this->inline_primitives)
+        return false;
+      PrimOp const * op = get_prim_op(term.qname);
+      PrimExpr expr;
+      if(!op || !this->is_primitive(term, op->result, expr))
+        return false;
+
+      // Resolve the variables and check the ones not known to be values.  A
+      // variable whose type is not known is checked to be an Int.
+      std::map<size_t, tgt::value> nodes;
+      tgt::value unknown;
+      for(auto const & var: expr.vars)
+      {
+        tgt::value const node_p = this->resolve_path(var.first);
+        nodes.emplace(var.first, node_p);
+        tgt::value check;
+        if(!this->known_values.count(var.first))
+        {
+          check = node_p.arrow(ND_TAG)
+              !=(tgt::signed_)(static_cast<tag_t>(compiler::CTOR));
+        }
+        if(var.second)
+        {
+          tgt::value const not_int =
+              node_p.arrow(ND_VPTR) != this->prim_vt(PRIM_INT);
+          check = check.ptr() ? (check | not_int) : not_int;
+        }
+        if(check.ptr())
+          unknown = unknown.ptr() ? (unknown | check) : check;
+      }
+
+      if(!unknown.ptr() && !expr.partial)
+      {
+        tgt::value const data =
+            this->compute_primitive(term, nodes, tgt::label(nullptr));
+        this->rewrite_primitive(op->result, data);
+        return true;
+      }
+
+      tgt::label done;
+      tgt::label const fallback([&]
+      {
+        this->build_boxed = true;
+        (*this)(term);
+        this->build_boxed = false;
+        tgt::goto_(done);
+      });
+      if(unknown.ptr())
+        tgt::if_(unknown, [&] { tgt::goto_(fallback); });
+      tgt::value const data = this->compute_primitive(term, nodes, fallback);
+      this->rewrite_primitive(op->result, data);
+      tgt::goto_(done);
+      tgt::scope::update_current_label_after_branch(done);
+      return true;
+    }
+
   public:
   
     // Subcases of Rule.
@@ -469,6 +950,7 @@ namespace
       this->target_p.arrow(ND_VPTR) = rt.fwd_vt;
       this->target_p.arrow(ND_TAG) = compiler::FWD;
       this->target_p.arrow(ND_SLOT0) = target;
+      this->barrier_target();
     }
 
     // Rewrites the root as a partial node.
@@ -543,10 +1025,15 @@ namespace
         this_node.arrow(ND_SLOT1) = data;
         prev_node = this_node;
       }
+      this->barrier_target();
     }
 
     result_type operator()(curry::Term const & term)
     {
+      if(this->build_primitive(term))
+        return;
+      bool const inline_children = this->target_inline;
+      this->target_inline = false;
       std::vector<tgt::value> child_data;
       child_data.reserve(term.args.size());
 
@@ -569,10 +1056,12 @@ namespace
           // Allocate a new node and place its contents with a recursive call.
           else
           {
-            tgt::value child = this->node_alloc(*rt.char_t);
+            size_t const nchunks = new_node_chunks(subexpr);
+            tgt::value child = this->node_alloc(*rt.char_t, nchunks);
             child_data.push_back(child);
             // Clobber the root so the recursive call works.
             this->target_p = bitcast(child, node_pointer_type);
+            this->target_inline = nchunks > 1;
             (*this)(subexpr);
           }
         }
@@ -590,6 +1079,13 @@ namespace
       if(child_data.size() < 3)
         for(size_t i=0; i<child_data.size(); ++i)
           this->target_p.arrow(ND_SLOT0+i) = child_data[i];
+      else if(inline_children)
+      {
+        // A new node has room for its children after the header.
+        value children = set_inline_child_array(this->target_p);
+        for(size_t i=0; i<child_data.size(); ++i)
+          children[i] = child_data[i];
+      }
       else
       {
         // Note: pseudo-C-code shown in comments for clarity.
@@ -602,12 +1098,18 @@ namespace
         for(size_t i=0; i<child_data.size(); ++i)
           children[i] = child_data[i];
       }
+      this->barrier_target();
     }
 
     result_type operator()(curry::NLTerm const & term)
     {
       for(curry::NLTerm::Step const & step: term.steps)
-        this->new_(this->resolve_path(step.varid), step.term);
+      {
+        // The step may place its term at a node reached by a path.
+        tgt::value const p = this->resolve_path(step.varid);
+        this->new_(p, step.term);
+        rt.write_barrier(p);
+      }
       return (*this)(*term.result);
     }
 
@@ -635,6 +1137,9 @@ namespace
       , inductive_alloca(tgt::local(node_pointer_type))
       , options(options_)
     {
+      this->inline_primitives = options.inline_primitives;
+      // Each step begins at a safepoint.
+      rt.safepoint();
       if(options.enable_tracing) trace_step_start(rt, root_p);
     }
 
@@ -684,6 +1189,164 @@ namespace
       return_();
     }
 
+    // Generates the action of a case.  There, the inductive node is a value
+    // of the given kind, and so is every variable the condition demands.
+    void visit_case(
+        curry::Case const & case_, size_t pathid, PrimKind kind
+      , std::set<size_t> const & demanded
+      )
+    {
+      std::vector<size_t> added;
+      auto const add = [&](size_t id, PrimKind k)
+      {
+        if(id < LOCAL_ID_START && this->known_values.emplace(id, k).second)
+          added.push_back(id);
+      };
+      add(pathid, kind);
+      for(size_t id: demanded)
+        add(id, PRIM_ANY);
+      case_.action.visit(*this);
+      for(size_t id: added)
+        this->known_values.erase(id);
+    }
+
+    // Builds @p rule at a new local node, which is a root for gc until the
+    // step returns.  Returns the ID of the local variable.
+    size_t build_local(curry::Rule const & rule)
+    {
+      this->set_out_of_memory_handler_returning_here();
+      value p = this->new_(this->resolve_path(next_local_id), rule);
+
+      // Add the local allocation, p, as a new root for gc.
+      rt.CyMem_PushRoot(p, options.enable_tracing);
+      return next_local_id++;
+    }
+
+    // Steps @p node_p, a local node this step built from @p term.  If the
+    // function it applies is compiled in this module, its step function is
+    // called directly.  Otherwise, H is called through the vtable.  If
+    // @p just_built is set, nothing can have rewritten the node yet, so the
+    // step is called unconditionally.  Then H is called through the vtable
+    // only if the node is not a constructor.  Otherwise, the node is stepped
+    // directly only while it still has the function's vtable, and the caller
+    // repeats until the node is head-normal.
+    void step_local(
+        value const & node_p, curry::Term const & term, bool just_built
+      )
+    {
+      function const step =
+          term.qname.module == module_stab.source->name
+            ? function(module_stab.module_ir->getFunction(
+                  (".step." + term.qname.name).c_str()
+                ))
+            : function(nullptr);
+      if(!step.ptr())
+      {
+        vinvoke(node_p, VT_H);
+        return;
+      }
+      if(just_built)
+      {
+        dinvoke(step, node_p);
+        if_(
+            node_p.arrow(ND_TAG)
+                <(signed_)(static_cast<tag_t>(compiler::CTOR))
+          , [&]{ vinvoke(node_p, VT_H); }
+          );
+        return;
+      }
+      value const vt = bitcast(
+          &module_stab.lookup(term.qname).vtable, *rt.vtable_t
+        );
+      if_(
+          node_p.arrow(ND_VPTR) == vt
+        , [&]{ dinvoke(step, node_p); }
+        , [&]{ vinvoke(node_p, VT_H); }
+        );
+    }
+
+    // Head-normalizes the arguments that the replacement demands before it
+    // is built.  The root is being head-normalized, so each would be
+    // evaluated next anyway.  An argument applying a function is built at a
+    // local node and evaluated there, and the replacement reads the local.
+    // A demanded variable is evaluated where it is.  The operands of a
+    // primitive operation are then usually values, so build_primitive
+    // computes it instead of building a node to be evaluated later.  The
+    // arguments an argument that is itself a primitive operation demands are
+    // evaluated the same way.  A failure is treated as divergence.
+    // Evaluating early never changes a value computed, but an argument that
+    // would not be reached, because another fails first, may diverge.  That
+    // hides the alternatives of an enclosing choice, so this is done only
+    // when CompilerOptions::eager_demanded is set.
+    curry::Rule evaluate_demanded(curry::Rule const & rule)
+    {
+      curry::Term const * term = rule.getterm();
+      if(!options.eager_demanded || !term)
+        return rule;
+      return this->evaluate_arguments(*term);
+    }
+
+    // Evaluates the demanded arguments of @p term.  See evaluate_demanded.
+    curry::Term evaluate_arguments(curry::Term const & term)
+    {
+      curry::Term eager = term;
+      auto const it = module_stab.demands.find(term.qname);
+      if(it == module_stab.demands.end())
+        return eager;
+      auto const & demanded = it->second;
+      for(size_t i=0; i<eager.args.size() && i<demanded.size(); ++i)
+      {
+        if(demanded[i])
+          eager.args[i] = this->evaluate_argument(term.args[i]);
+      }
+      return eager;
+    }
+
+    // Evaluates a demanded argument.  See evaluate_demanded.
+    curry::Rule evaluate_argument(curry::Rule const & arg)
+    {
+      if(curry::Ref const * varref = arg.getvar())
+      {
+        if(this->is_path_variable(varref->pathid)
+            && !this->known_values.count(varref->pathid)
+          )
+        {
+          value const node_p = this->resolve_path(varref->pathid);
+          if_(
+              node_p.arrow(ND_TAG)
+                  ==(signed_)(static_cast<tag_t>(compiler::OPER))
+            , [&]{ vinvoke(node_p, VT_H); }
+            );
+          ++eager_arguments;
+        }
+        return arg;
+      }
+      curry::Term const * term = arg.getterm();
+      if(!term)
+        return arg;
+      if(this->inline_primitives && get_prim_op(term->qname))
+        return this->evaluate_arguments(*term);
+      if(module_stab.lookup(term->qname).tag != compiler::OPER)
+        return arg;
+
+      // Evaluate the local and skip the FWD node it may leave.
+      size_t const id = this->build_local(arg);
+      tgt::ref & local = this->freevar_alloca.at(id);
+      this->step_local(local, *term, true);
+      tgt::while_(
+          [&]{
+              local.arrow(ND_TAG)
+                  ==(tgt::signed_) (static_cast<tag_t>(compiler::FWD));
+            }
+        , [&]{
+              local = bitcast(local.arrow(ND_SLOT0), node_pointer_type);
+            }
+        );
+      this->eager_locals.insert(id);
+      ++eager_arguments;
+      return curry::Ref{id};
+    }
+
     template<typename...Ts>
     void error(std::string const & message, Ts const &...ts)
     {
@@ -699,14 +1362,7 @@ namespace
       if(curry::Ref const * cond = condition.getvar())
         return cond->pathid;
       else if(condition.getterm())
-      {
-        this->set_out_of_memory_handler_returning_here();
-        value p = this->new_(this->resolve_path(next_local_id), condition);
-
-        // Add the local allocation, p, as a new root for gc.
-        rt.CyMem_PushRoot(p, options.enable_tracing);
-        return next_local_id++;
-      }
+        return this->build_local(condition);
       else
         throw compile_error("Invalid branch condition");
     }
@@ -720,6 +1376,7 @@ namespace
         function G = get_generator_from_case(example, module_stab);
         if(!G.ptr()) return;
         var.arrow(ND_SLOT0) = G(var, var.arrow(ND_AUX));
+        rt.write_barrier(var);
         stencil = var.arrow(ND_SLOT0);
       });
 
@@ -746,8 +1403,10 @@ namespace
       auto & node_stab = this->module_stab.lookup(qname);
 
       // Begin to construct the replacement.  Successors are set below.
-      value copy_of_root = this->node_alloc(*rt.node_t);
-      move(root_p, copy_of_root, this->fundef->arity);
+      size_t const root_arity = this->fundef->arity;
+      value copy_of_root =
+          this->node_alloc(*rt.node_t, node_chunks(root_arity));
+      move(rt, root_p, copy_of_root, root_arity);
       root_p.arrow(ND_VPTR) = &*node_stab.auxvt.at(&branch);
 
       // See if any additional arguments are required and add them, if necessary.
@@ -769,6 +1428,7 @@ namespace
         for(size_t i=2; i<arity; ++i)
           successors[i] = this->resolve_path(pathid_args.at(i-2));
       }
+      rt.write_barrier(root_p);
       return std::make_pair(inductive, arity);
     }
 
@@ -802,6 +1462,8 @@ namespace
       } _freevar_alloca_manager(*this);
 
       size_t const pathid = build_condition(branch.condition);
+      std::set<size_t> const demanded =
+          curry::find_demanded_variables(branch.condition, module_stab.demands);
       // Declare the jump table in the target program.
       size_t const table_size = TAGOFFSET + branch.num_tag_cases();
       tgt::globalvar jumptable =
@@ -822,7 +1484,7 @@ namespace
           // scope.
           tgt::label tmp;
           tgt::scope _ = tmp;
-          case_->action.visit(*this);
+          this->visit_case(*case_, pathid, PRIM_ANY, demanded);
           labels.push_back(tmp);
         }
       }
@@ -842,7 +1504,9 @@ namespace
             label tmp2;
             {
               scope _ = tmp2;
-              case_->action.visit(*this);
+              this->visit_case(
+                  *case_, pathid, get_case_kind(case_->lhs), demanded
+                );
             }
             sw->addCase(get_case_value(case_->lhs).ptr(), tmp2.ptr());
           }
@@ -936,8 +1600,14 @@ namespace
       {
         tgt::scope _ = labels[TAGOFFSET + OPER];
         tgt::value inductive = this->inductive_alloca;
-        // Head-normalize the inductive node.
-        vinvoke(inductive, VT_H);
+        // Head-normalize the inductive node.  A condition built by this step
+        // applies a known function.  The loop back through the jump table
+        // finishes head-normalization.
+        curry::Term const * term = branch.condition.getterm();
+        if(term && pathid >= LOCAL_ID_START)
+          this->step_local(inductive, *term, false);
+        else
+          vinvoke(inductive, VT_H);
         // Repeat the previous jump.
         tgt::value const index = inductive.arrow(ND_TAG) + TAGOFFSET;
         tgt::goto_(jumptable[index], labels);
@@ -958,15 +1628,27 @@ namespace
 
     result_type operator()(curry::Rule const & rule)
     {
+      size_t const first_local = next_local_id;
+      curry::Rule const eager = this->evaluate_demanded(rule);
+
       // The rewrite step is always a series of allocations and memory stores
       // that finishes by attaching all allocated nodes to the root.  If memory
       // allocation fails, causing gc to run, restart here.
       this->set_out_of_memory_handler_returning_here();
 
       // Step.
-      (this->Rewriter::operator())(rule);
+      (this->Rewriter::operator())(eager);
 
       clean_up_and_return();
+
+      // Release the locals evaluated eagerly.  The rule of another case
+      // reuses their IDs.
+      while(next_local_id > first_local)
+      {
+        next_local_id--;
+        this->freevar_alloca.erase(next_local_id);
+        this->eager_locals.erase(next_local_id);
+      }
     }
   };
 
@@ -1056,7 +1738,7 @@ namespace
       // FAIL case.
       {
         scope _ = labels[TAGOFFSET + FAIL];
-        if(arity > 2) vinvoke(root_p, VT_DESTROY);
+        if(arity > 2) dinvoke(rt.Cy_Destroy(arity), root_p);
         root_p.arrow(ND_VPTR) = rt.failed_vt;
         root_p.arrow(ND_TAG) = compiler::FAIL;
         return_();
@@ -1106,14 +1788,14 @@ namespace
       // OPER case (recursive call to child.N, then loop back to the jump).
       {
         scope _ = labels[TAGOFFSET + OPER];
-        child.arrow(ND_VPTR).arrow(VT_N)(child);
+        vinvoke(child, VT_N);
         make_jump(1);
       }
 
       // CTOR case #1 (recursive call to child.N then second jump).
       {
         scope _ = labels[TAGOFFSET + CTOR];
-        call = child.arrow(ND_VPTR).arrow(VT_N)(child);
+        call = vinvoke(child, VT_N);
         make_jump(2);
       }
 
@@ -1199,7 +1881,6 @@ namespace
       G = static_<function>(rt.genfun_t, name, {"node_p", "id"});
       scope _ = G;
       value node_p = arg("node_p");
-      value id = arg("id");
       Rewriter rewriter(module_stab, node_p);
       rewriter.set_out_of_memory_handler_returning_here();
       // If the (only) constructor has successors, then we must make a choice
@@ -1212,7 +1893,10 @@ namespace
         value rhs = rewriter.new_(curry::Rule()); // failure
         choice.arrow(ND_VPTR) = rt.choice_vt;
         choice.arrow(ND_TAG) = compiler::CHOICE;
-        choice.arrow(ND_AUX) = id;
+        // The ID is read from the variable, not taken from the argument.  The
+        // allocations above may suspend this computation, and IDs may be
+        // renumbered meanwhile (see NodePool::compact_ids).
+        choice.arrow(ND_AUX) = node_p.arrow(ND_AUX);
         choice.arrow(ND_SLOT0) = lhs;
         choice.arrow(ND_SLOT1) = rhs;
         return_(choice);
@@ -1237,8 +1921,11 @@ namespace
                 value rhs = mktree(middle, end, false);
                 choice.arrow(ND_VPTR) = rt.choice_vt;
                 choice.arrow(ND_TAG) = compiler::CHOICE;
-                // The head of the tree has the designated choice ID.
-                choice.arrow(ND_AUX) = is_head ? id : rt.Cy_NextChoiceId++;
+                // The head of the tree has the ID of the variable.  As above,
+                // it is read after the subtrees are allocated.
+                choice.arrow(ND_AUX) = is_head
+                    ? static_cast<value>(node_p.arrow(ND_AUX))
+                    : static_cast<value>(rt.Cy_NextChoiceId++);
                 choice.arrow(ND_SLOT0) = lhs;
                 choice.arrow(ND_SLOT1) = rhs;
                 return choice;
@@ -1519,7 +2206,9 @@ namespace sprite { namespace compiler
     std::vector<value> values;
     for(size_t cid=0; cid<choice_arity; ++cid)
     {
-      value arg = rt.node_alloc(*rt.node_t, out_of_memory_handler);
+      value arg = rt.node_alloc(
+          *rt.node_t, out_of_memory_handler, node_chunks(arity)
+        );
       values.push_back(arg);
     }
     // Done allocating everything. Now it's okay to partially initialize the nodes.
@@ -1562,23 +2251,15 @@ namespace sprite { namespace compiler
     }
     else
     {
+      // The copies store their successors inline.  The successors of src are
+      // read through slot0, so either layout works.  An external array is
+      // freed below.
+      value const src_children =
+          bitcast(src.arrow(ND_SLOT0), **types::char_());
       std::vector<value> child_arrays;
-      // The first argument array is stolen from the root node.
-      child_arrays.push_back(
-          set_extended_child_array(values[0], src.arrow(ND_SLOT0))
-        );
-      // The others are allocated.
-      for(size_t j=1; j<choice_arity; ++j)
-      {
-        child_arrays.push_back(
-            set_extended_child_array(
-                values[j]
-              , rt.Cy_ArrayAllocTyped(static_cast<aux_t>(arity))
-              )
-          );
-      }
+      for(size_t j=0; j<choice_arity; ++j)
+        child_arrays.push_back(set_inline_child_array(values[j]));
 
-      // The LHS argument array is stolen from the root node.
       for(size_t i=0; i<arity; ++i)
       {
         if(i == itgt)
@@ -1597,14 +2278,14 @@ namespace sprite { namespace compiler
         }
         else
         {
-          value tmp = child_arrays[0][i];
-          for(size_t j=1; j<choice_arity; ++j)
+          value tmp = src_children[i];
+          for(size_t j=0; j<choice_arity; ++j)
             child_arrays[j][i] = tmp;
         }
       }
+      dinvoke(rt.Cy_Destroy(arity), src);
     }
 
-    // Do not call this->destroy_target.  The successor list was stolen.
     src.arrow(ND_VPTR) = rt.choice_vt;
     src.arrow(ND_TAG) = compiler::CHOICE;
     src.arrow(ND_AUX) = tgt.arrow(ND_AUX);
@@ -1627,6 +2308,7 @@ namespace sprite { namespace compiler
           choice_successors[j] = bitcast(values[j], *types::char_());
       }
     }
+    rt.write_barrier(src);
   }
 
   void exec_pullbind(
@@ -1635,7 +2317,9 @@ namespace sprite { namespace compiler
     )
   {
     label out_of_memory_handler = rt.make_restart_point();
-    value tmp = rt.node_alloc(*rt.node_t, out_of_memory_handler);
+    value tmp = rt.node_alloc(
+        *rt.node_t, out_of_memory_handler, node_chunks(arity)
+      );
     tmp.arrow(ND_VPTR) = src.arrow(ND_VPTR);
     tmp.arrow(ND_TAG) = src.arrow(ND_TAG);
 
@@ -1651,18 +2335,32 @@ namespace sprite { namespace compiler
     }
     else
     {
-      value children = set_extended_child_array(tmp, src.arrow(ND_SLOT0));
-      children[itgt] = tgt.arrow(ND_SLOT0);
+      // The copy stores its successors inline.  See exec_pulltab.
+      value const src_children =
+          bitcast(src.arrow(ND_SLOT0), **types::char_());
+      value children = set_inline_child_array(tmp);
+      for(size_t i=0; i<arity; ++i)
+      {
+        if(i == itgt)
+          children[i] = tgt.arrow(ND_SLOT0);
+        else
+          children[i] = src_children[i];
+      }
+      dinvoke(rt.Cy_Destroy(arity), src);
     }
 
     src.arrow(ND_VPTR) = tgt.arrow(ND_VPTR);
     src.arrow(ND_TAG) = BINDING;
     src.arrow(ND_SLOT0) = tmp;
     src.arrow(ND_SLOT1) = tgt.arrow(ND_SLOT1);
+    rt.write_barrier(src);
   }
 
   tgt::value vinvoke(tgt::value const & node_p, compiler::VtMember member)
-    { return node_p.arrow(compiler::ND_VPTR).arrow(member)(node_p); }
+  {
+    ++call_sites.indirect;
+    return node_p.arrow(compiler::ND_VPTR).arrow(member)(node_p);
+  }
 
   tgt::value vinvoke(
       tgt::value const & node_p, compiler::VtMember member, tgt::attribute attr
@@ -1807,6 +2505,7 @@ namespace sprite { namespace compiler
 
     tgt::module & module_ir = module_stab.module_ir;
     auto const & rt = module_stab.rt();
+    rt.reserve_at_restart_points = options.gc_resume;
     
     // Set the module as the current scope.  Subsequent statements will add
     // functions, type definitions, and data to this module.
@@ -1918,16 +2617,45 @@ namespace sprite { namespace compiler
     };
 
     // Process the imports.
+    std::vector<curry::Module const *> sources{&cymodule};
     for(auto const & import: cymodule.imports)
     {
       auto p = stab.modules.find(import);
       if(p == stab.modules.end())
         throw compile_error("Imported module \"" + import + "\" was not found");
       process_module(*p->second.source, false);
+      sources.push_back(p->second.source);
     }
 
+    // Find the demanded arguments.  Variables demanded by a branch condition
+    // are known to be values in its cases.  See FunctionCompiler::visit_case.
+    module_stab.demands = curry::find_demanded_arguments(sources);
+
     // Process the primary module.
+    call_sites = CallSiteCounts();
+    eager_arguments = 0;
     process_module(cymodule, true);
+
+    if(options.verbose)
+    {
+      std::cerr
+        << "[" << cymodule.name << "] vtable call sites: "
+        << call_sites.direct << " devirtualized, "
+        << call_sites.indirect << " indirect" << std::endl;
+
+      size_t ndemanded = 0, nargs = 0;
+      for(auto const & fun: cymodule.functions)
+      {
+        auto const & demanded =
+            module_stab.demands.at(curry::Qname{cymodule.name, fun.name});
+        ndemanded += std::count(demanded.begin(), demanded.end(), true);
+        nargs += demanded.size();
+      }
+      std::cerr
+        << "[" << cymodule.name << "] demanded arguments: "
+        << ndemanded << " of " << nargs << ", "
+        << eager_arguments << " evaluated before construction" << std::endl;
+    }
   }
 }}
 
@@ -1,8 +1,15 @@
 #include "sprite/runtime.hpp"
 #include "sprite/compiler.hpp" 
+#include <algorithm>
 
 namespace sprite { namespace compiler
 {
+  namespace
+  {
+    // The most chunks a restart point reserves.  See make_restart_point.
+    size_t const RESERVE_MAX_CHUNKS = 64;
+  }
+
   function rt_h::Cy_NoGenerator(std::string const & name) const
   {
     function const f = static_(genfun_t, ".nogen." + name);
@@ -103,7 +110,10 @@ namespace sprite { namespace compiler
       if(destroy->size() == 0) // no body
       {
         scope _ = destroy;
-        Cy_ArrayDealloc(arity, arg("node_p").arrow(ND_SLOT0));
+        value node_p = arg("node_p");
+        value const array = node_p.arrow(ND_SLOT0);
+        value const inline_array = bitcast(&node_p.arrow(ND_SLOT1), *char_t);
+        if_(array != inline_array, [&] { Cy_ArrayDealloc(arity, array); });
         return_();
       }
       return destroy;
@@ -136,23 +146,96 @@ namespace sprite { namespace compiler
     label redo;
     goto_(redo);
     scope::update_current_label_after_branch(redo);
-    return label([&]{ this->CyMem_Collect(); goto_(redo); });
+    label const handler([&]{ this->CyMem_Collect(); goto_(redo); });
+    if(reserve_at_restart_points)
+    {
+      // The number of chunks is filled in as node_alloc uses the handler.
+      globalvar nchunks =
+          static_(size_t_t, flexible(".reserve")).as_globalvar();
+      (&nchunks)->setConstant(true);
+      nchunks.set_initializer(size_t(0));
+      reservations.emplace(
+          handler.ptr(), std::make_pair((&nchunks).ptr(), size_t(0))
+        );
+      value const n = nchunks;
+      value const head = CyMem_AllocPtr;
+      value const limit = CyMem_AllocLimit;
+      value const next = bitcast(&bitcast(head, *node_t)[n], *char_t);
+      if_(
+          next >(unsigned_)(limit)
+        , [&] { CyMem_AllocChunks = n; this->CyMem_Collect(); }
+        );
+    }
+    return handler;
   }
 
-  value rt_h::node_alloc(type const & ty, label const & eh) const
+  value rt_h::node_alloc(
+      type const & ty, label const & eh, size_t nchunks
+    ) const
   {
-    value const head = CyMem_FreeList;
+    // Count the node in the reservation of its restart point.  A large
+    // reservation needs a long run of free chunks, so it is capped.  Nodes
+    // past the cap fall back to the handler.
+    auto const it = reservations.find(eh.ptr());
+    if(it != reservations.end())
+    {
+      size_t & reserved = it->second.second;
+      reserved += nchunks;
+      globalvar(globalvaraddr(it->second.first)).set_initializer(
+          std::min(reserved, RESERVE_MAX_CHUNKS)
+        );
+    }
+
+    // Bump allocation.  When the run is exhausted, eh calls CyMem_Collect.
+    value const head = CyMem_AllocPtr;
+    value const limit = CyMem_AllocLimit;
+    if(nchunks == 1)
+    {
+      if_(
+          head == limit
+        , [&] { goto_(eh); }
+        , [&] { CyMem_AllocPtr = bitcast(&bitcast(head, *node_t)[1], *char_t); }
+        );
+    }
+    else
+    {
+      // The node must fit before the limit.  Otherwise, CyMem_Collect is told
+      // how many chunks to find.
+      value const next = bitcast(&bitcast(head, *node_t)[nchunks], *char_t);
+      if_(
+          next >(unsigned_)(limit)
+        , [&] { CyMem_AllocChunks = nchunks; goto_(eh); }
+        , [&] { CyMem_AllocPtr = next; }
+        );
+    }
+    return bitcast(head, ty);
+  }
+
+  void rt_h::write_barrier(value node_p) const
+  {
+    value const bits =
+        node_p.arrow(ND_MARK) & mark_t(GC_OLD | GC_REMEMBERED);
     if_(
-        head == (*char_t)(nullptr)
-      , [&] { goto_(eh); }
-      , [&] { CyMem_FreeList = *bitcast(head, **char_t); }
+        bits ==(signed_)(mark_t(GC_OLD))
+      , [&] { this->CyMem_Remember(node_p); }
       );
-    return bitcast(head, ty);
+  }
+
+  void rt_h::safepoint() const
+  {
+    value const flag = Cy_PreemptRequested;
+    if_(flag != int_t(0), [&] { this->Cy_Preempt(); });
   }
 
   void rt_h::CyMem_PushRoot(value root_p, bool enable_tracing) const
   {
-    this->_CyMem_PushRoot(root_p);
+    value const top = CyMem_Roots.dot(0);
+    value const limit = CyMem_Roots.dot(1);
+    if_(top == limit, [&] { this->CyMem_GrowRoots(); });
+    // Growing moves the stack, so top is read again.
+    value const slot = CyMem_Roots.dot(0);
+    slot[0] = bitcast(root_p, *node_t);
+    CyMem_Roots.dot(0) = &slot[1];
     if(enable_tracing)
     {
       this->CyTrace_Indent();
@@ -164,6 +247,7 @@ namespace sprite { namespace compiler
   {
     if(enable_tracing)
       this->CyTrace_Dedent();
-    this->_CyMem_PopRoot();
+    value const top = CyMem_Roots.dot(0);
+    CyMem_Roots.dot(0) = &top[-1];
   }
 }}
@@ -1,4 +1,6 @@
 #include "sprite/tree_utils.hpp"
+#include <algorithm>
+#include <iterator>
 
 namespace
 {
@@ -55,6 +57,137 @@ namespace
     bool operator()(T const &) const
       { return false; }
   };
+
+  // The variables a rule demands.  A rule that never produces a constructor
+  // demands everything.
+  struct Demanded
+  {
+    bool all;
+    std::set<size_t> pathids;
+
+    Demanded(bool all_ = false) : all(all_) {}
+    Demanded(size_t pathid) : all(false), pathids{pathid} {}
+
+    void join(Demanded const & other)
+    {
+      if(other.all)
+        this->all = true;
+      else
+        this->pathids.insert(other.pathids.begin(), other.pathids.end());
+    }
+
+    void meet(Demanded const & other)
+    {
+      if(this->all)
+        *this = other;
+      else if(!other.all)
+      {
+        std::set<size_t> tmp;
+        std::set_intersection(
+            this->pathids.begin(), this->pathids.end()
+          , other.pathids.begin(), other.pathids.end()
+          , std::inserter(tmp, tmp.end())
+          );
+        this->pathids.swap(tmp);
+      }
+    }
+  };
+
+  struct DemandedImpl
+  {
+    using result_type = Demanded;
+
+    DemandedImpl(Demands const & demands_) : demands(demands_) {}
+    Demands const & demands;
+
+    // The condition is always demanded.  A case action is demanded only when
+    // its case is taken.
+    Demanded operator()(Branch const & branch) const
+    {
+      Demanded out = branch.condition.visit(*this);
+      Demanded actions(true);
+      for(auto const & case_: branch.cases)
+        actions.meet(case_->action.visit(*this));
+      out.join(actions);
+      return out;
+    }
+
+    Demanded operator()(Rule const & rule) const
+      { return rule.visit(*this); }
+
+    Demanded operator()(Fail const &) const
+      { return Demanded(true); }
+
+    Demanded operator()(Ref const & ref) const
+      { return Demanded(ref.pathid); }
+
+    // A constructor demands nothing.  A function demands the variables of its
+    // demanded arguments.  Those arguments are head-normalized in place, so
+    // nested function applications are followed.
+    Demanded operator()(Term const & term) const
+    {
+      Demanded out;
+      auto const p = this->demands.find(term.qname);
+      if(p != this->demands.end())
+      {
+        size_t const N = std::min(p->second.size(), term.args.size());
+        for(size_t i=0; i<N; ++i)
+        {
+          if(p->second[i])
+            out.join(term.args[i].visit(*this));
+        }
+      }
+      return out;
+    }
+
+    Demanded operator()(Partial const &) const
+      { return Demanded(); }
+
+    Demanded operator()(NLTerm const & nlterm) const
+      { return nlterm.result->visit(*this); }
+
+    // default.
+    template<typename T>
+    Demanded operator()(T const &) const
+      { return Demanded(); }
+  };
+
+  struct IsExternalImpl
+  {
+    using result_type = bool;
+
+    bool operator()(Rule const & rule) const
+      { return rule.visit(*this); }
+
+    bool operator()(ExternalCall const &) const
+      { return true; }
+
+    // default.
+    template<typename T>
+    bool operator()(T const &) const
+      { return false; }
+  };
+
+  // The demands of external functions.  Only the Prelude externals that
+  // head-normalize their arguments are listed.  == and compare are not: they
+  // may bind or return when an argument is a free variable, which is not a
+  // value.
+  std::vector<bool> external_demands(Qname const & qname, size_t arity)
+  {
+    static std::set<std::string> const binary{
+        "+", "-", "*", "div", "mod", "quot", "rem"
+      };
+    static std::set<std::string> const unary{"negateFloat", "ord", "chr"};
+    std::vector<bool> out(arity, false);
+    if(qname.module == "Prelude")
+    {
+      if(binary.count(qname.name))
+        std::fill(out.begin(), out.end(), true);
+      else if(unary.count(qname.name) && arity > 0)
+        out[0] = true;
+    }
+    return out;
+  }
 }
 
 namespace sprite { namespace curry
@@ -89,4 +222,66 @@ namespace sprite { namespace curry
     }
     return out;
   }
+
+  Demands find_demanded_arguments(std::vector<Module const *> const & modules)
+  {
+    // Begin with every argument demanded and iterate until nothing changes.
+    // Each pass can only remove demands, so this reaches the greatest fixed
+    // point.  That lets recursive functions be strict in their arguments.
+    Demands out;
+    std::vector<std::pair<Function const *, std::vector<bool> *>> todo;
+    for(Module const * module: modules)
+    {
+      for(auto const & fun: module->functions)
+      {
+        Qname const qname{module->name, fun.name};
+        if(fun.def.visit(IsExternalImpl()))
+          out[qname] = external_demands(qname, fun.arity);
+        else
+        {
+          auto & demanded = out[qname];
+          demanded.assign(fun.arity, true);
+          todo.emplace_back(&fun, &demanded);
+        }
+      }
+    }
+
+    DemandedImpl const impl(out);
+    bool changed = true;
+    while(changed)
+    {
+      changed = false;
+      for(auto const & item: todo)
+      {
+        Function const & fun = *item.first;
+        Demanded const demanded = fun.def.visit(impl);
+        std::vector<bool> args(fun.arity, demanded.all);
+        for(size_t pathid: demanded.pathids)
+        {
+          if(pathid >= fun.paths.size())
+            continue;
+          auto const & path = fun.paths[pathid];
+          if(path.base == nobase && path.idx < fun.arity)
+            args[path.idx] = true;
+        }
+        if(args != *item.second)
+        {
+          item.second->swap(args);
+          changed = true;
+        }
+      }
+    }
+    return out;
+  }
+
+  std::set<size_t> find_demanded_variables(
+      Rule const & rule, Demands const & demands
+    )
+  {
+    Demanded out = rule.visit(DemandedImpl(demands));
+    // A rule that never produces a constructor has no case to inform.
+    if(out.all)
+      return std::set<size_t>();
+    return std::move(out.pathids);
+  }
 }}
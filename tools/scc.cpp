@@ -32,6 +32,9 @@ namespace
   enum OutputType { OUTPUT_BITCODE=0, OUTPUT_ASSEMBLY=1, OUTPUT_EXECUTABLE=2 };
   OutputType output_type = OUTPUT_EXECUTABLE;
 
+  // Codes for long options without a short form.
+  enum LongOption { OPT_SEARCH=256 };
+
   template<typename Vector>
   void remove_duplicates(Vector & v)
   {
@@ -60,10 +63,20 @@ namespace
       << "       Compile only (do not link).\n"
       << "   -E, --preprocess\n"
       << "       Proprocess the source into ICurry only.\n"
+      << "   --eager-demanded\n"
+      << "       Evaluate the arguments a function demands before the function\n"
+      << "       is built.  A computation that would fail may diverge instead.\n"
+      << "   --gc-resume\n"
+      << "       Collect garbage before a group of allocations, where every\n"
+      << "       live node is rooted, rather than at the allocation that\n"
+      << "       fails.  The code then continues instead of running again.\n"
       << "   -h, --help\n"
       << "       Display this help message.\n"
       << "   -m MODULE, --main=MODULE\n"
       << "       Start the program using the 'main' function in MODULE.\n"
+      << "   --no-inline-primitives\n"
+      << "       Build a node for each arithmetic operation and comparison,\n"
+      << "       rather than computing it in registers.  For debugging.\n"
       << "   -On, --optimize=n\n"
       << "       Control optimizations.  Possible values of n are: 0, 1, 2, 3,\n"
       << "       s, and z.  These correspond roughly to the same options for\n"
@@ -75,8 +88,16 @@ namespace
       << "       Save temporary files.\n"
       << "   -S, --output-assembly\n"
       << "       Write out the final program as assembly.\n"
+      << "   --search=STRATEGY\n"
+      << "       Set the default search strategy of the program.  Possible\n"
+      << "       values are: fair (the default), dfs, bfs, and id (iterative\n"
+      << "       deepening).  The environment variable SPRITE_SEARCH overrides\n"
+      << "       this when the program runs.\n"
       << "   -T, --trace\n"
       << "       Compile tracing output into the program.\n"
+      << "   -v, --verbose\n"
+      << "       Report statistics about the generated code, such as how\n"
+      << "       many vtable calls were devirtualized.\n"
       // << "Feature options:\n"
       // << "   --f[no]bypass (Default=OFF)\n"
       // << "       Bypass choices.  Skips some pull-tab steps by rerouting pointers\n"
@@ -107,13 +128,18 @@ namespace
         {"output-bitcode",  no_argument, 0, 'b'},
         {"compile",         no_argument, 0, 'c'},
         {"preprocess",      no_argument, 0, 'E'},
+        {"eager-demanded",  no_argument, &options.eager_demanded, 1},
+        {"gc-resume",       no_argument, &options.gc_resume, 1},
         {"help",            no_argument, 0, 'h'},
         {"main",            no_argument, 0, 'm'},
+        {"no-inline-primitives", no_argument, &options.inline_primitives, 0},
         {"optimize",        no_argument, 0, 'O'},
         {"output",          no_argument, 0, 'o'},
         {"output-assembly", no_argument, 0, 'S'},
         {"save-temps",      no_argument, &save_temps, 1},
+        {"search",          required_argument, 0, OPT_SEARCH},
         {"trace",           no_argument, 0, 'T'},
+        {"verbose",         no_argument, 0, 'v'},
         // Functional flags
         // {"fbypass",         no_argument, &options.bypass_choices, 1},
         // {"fnobypass",       no_argument, &options.bypass_choices, 0},
@@ -123,7 +149,7 @@ namespace
       if(optind == argc)
         break;
 
-      int const i = getopt_long(argc, argv, "bcEhm:O:o:ST", long_options, 0);
+      int const i = getopt_long(argc, argv, "bcEhm:O:o:STv", long_options, 0);
 
       switch(i)
       {
@@ -170,6 +196,27 @@ namespace
         case 'T':
           options.enable_tracing = true;
           break;
+        case 'v':
+          options.verbose = true;
+          break;
+        case OPT_SEARCH:
+        {
+          std::string const arg = optarg;
+          if(arg == "fair")
+            options.search_strategy = sprite::compiler::SEARCH_FAIR;
+          else if(arg == "dfs")
+            options.search_strategy = sprite::compiler::SEARCH_DFS;
+          else if(arg == "bfs")
+            options.search_strategy = sprite::compiler::SEARCH_BFS;
+          else if(arg == "id")
+            options.search_strategy = sprite::compiler::SEARCH_ID;
+          else
+          {
+            std::cerr << "invalid search strategy: --search=" << optarg << std::endl;
+            exit(EXIT_FAILURE);
+          }
+          break;
+        }
         default:
           std::exit(EXIT_FAILURE);
       }